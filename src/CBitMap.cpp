@@ -20,7 +20,7 @@ void CBitMap::Create(int w, int h) {
   }
 
 
-void CBitMap::SaveBMP(string filename) {
+bool CBitMap::SaveBMP(string filename) {
   
   CBMPHeader b;
   
@@ -68,7 +68,7 @@ void CBitMap::SaveBMP(string filename) {
   
   f.close ();
   
-  return;  
+  return !f.fail();
   
   
 }
@@ -153,4 +153,20 @@ void Camera::move(vector<float> system_size, bool periodic_boundary_conditions)
 		position.y = fmod(position.y + system_size[1],(double)system_size[1]);
 		position.z = fmod(position.z + system_size[2],(double)system_size[2]);
 	}
+}
+
+// Function to set position and rotation without any mouse or keyboard input
+void Camera::set_state(CVector position_, CVector rotation_)
+{
+	position = position_;
+	rotation = rotation_;
+
+	double sinXRot = sin( to_rads( rotation.x ) );
+	double cosXRot = cos( to_rads( rotation.x ) );
+	double sinYRot = sin( to_rads( rotation.y ) );
+	double cosYRot = cos( to_rads( rotation.y ) );
+
+	target.x = sinYRot*cosXRot;
+	target.y = -sinXRot;
+	target.z = -cosYRot*cosXRot;
 }
\ No newline at end of file
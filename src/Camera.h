@@ -56,6 +56,9 @@ class Camera
  
         // Method to move the camera based on the current direction
         void move(vector<float> system_size, bool periodic_boundary_conditions);
+
+        // Method to place the camera directly, e.g. when replaying a camera path
+        void set_state(CVector position_, CVector rotation_);
  
         // --------------------------------- Inline methods ----------------------------------------------
  
@@ -0,0 +1,170 @@
+#include <CameraPath.h>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <math.h>
+
+using std::ifstream;
+using std::ofstream;
+using std::istringstream;
+using std::ios;
+using std::cout;
+using std::endl;
+
+// Non-uniform Catmull-Rom between value1 (at time1) and value2 (at time2), f in [0, 1].
+// value0 and value3 are the neighbouring keyframes, equal to value1 and value2 at the ends of the path.
+inline double catmull_rom(double value0, double value1, double value2, double value3, double time0, double time1, double time2, double time3, double f) {
+    double segment = time2 - time1;
+    double tangent1 = time2 > time0 ? (value2 - value0)/(time2 - time0)*segment : 0;
+    double tangent2 = time3 > time1 ? (value3 - value1)/(time3 - time1)*segment : 0;
+    double f2 = f*f;
+    double f3 = f2*f;
+
+    return (2*f3 - 3*f2 + 1)*value1 + (f3 - 2*f2 + f)*tangent1 + (-2*f3 + 3*f2)*value2 + (f3 - f2)*tangent2;
+}
+
+bool CameraPath::load(string filename) {
+    if(filename.size() > 4 && filename.substr(filename.size()-4).compare(".txt") == 0) return load_text(filename);
+    return load_binary(filename);
+}
+
+bool CameraPath::load_text(string filename) {
+    ifstream file(filename.c_str());
+    if(!file) {
+        cout << "Error in CameraPath::load_text(): Failed to open file " << filename << endl;
+        return false;
+    }
+
+    clear();
+    string line;
+    while(getline(file, line)) {
+        if(line.size() == 0 || line[0] == '#') continue;
+        istringstream stream(line);
+        CVector position, rotation;
+        if(stream >> position.x >> position.y >> position.z >> rotation.x >> rotation.y) {
+            add_keyframe(positions.size(), position, rotation);
+        }
+    }
+
+    return positions.size() > 0;
+}
+
+bool CameraPath::load_binary(string filename) {
+    ifstream file(filename.c_str(), ios::in | ios::binary);
+    char magic[4];
+    int num_keyframes = 0;
+    file.read(magic, 4);
+    file.read(reinterpret_cast<char*>(&num_keyframes), sizeof(int));
+    if(!file || magic[0] != 'M' || magic[1] != 'D' || magic[2] != 'C' || magic[3] != 'P') {
+        cout << "Error in CameraPath::load_binary(): " << filename << " is not a camera path file" << endl;
+        return false;
+    }
+    if(num_keyframes <= 0) return false;
+
+    vector<float> data(6*num_keyframes);
+    file.read(reinterpret_cast<char*>(&data[0]), data.size()*sizeof(float));
+    if(!file) {
+        cout << "Error in CameraPath::load_binary(): " << filename << " is truncated" << endl;
+        return false;
+    }
+
+    clear();
+    for(int i=0; i<num_keyframes; i++) {
+        CVector position(data[6*i+1], data[6*i+2], data[6*i+3]);
+        CVector rotation(data[6*i+4], data[6*i+5], 0);
+        add_keyframe(data[6*i+0], position, rotation);
+    }
+
+    return positions.size() > 0;
+}
+
+bool CameraPath::save_binary(string filename) {
+    ofstream file(filename.c_str(), ios::out | ios::binary);
+    if(!file) {
+        cout << "Error in CameraPath::save_binary(): Failed to open file " << filename << endl;
+        return false;
+    }
+
+    int num_keyframes = positions.size();
+    vector<float> data(6*num_keyframes);
+    for(int i=0; i<num_keyframes; i++) {
+        data[6*i+0] = times[i];
+        data[6*i+1] = positions[i].x;
+        data[6*i+2] = positions[i].y;
+        data[6*i+3] = positions[i].z;
+        data[6*i+4] = rotations[i].x;
+        data[6*i+5] = rotations[i].y;
+    }
+
+    file.write("MDCP", 4);
+    file.write(reinterpret_cast<char*>(&num_keyframes), sizeof(int));
+    if(num_keyframes > 0) file.write(reinterpret_cast<char*>(&data[0]), data.size()*sizeof(float));
+    file.close();
+    cout << "Saved " << num_keyframes << " camera keyframes (" << get_duration() << " s) to " << filename << endl;
+
+    return true;
+}
+
+void CameraPath::clear() {
+    times.clear();
+    positions.clear();
+    rotations.clear();
+}
+
+// Keyframes must arrive in time order, keyframes that are not later than the previous one are skipped
+void CameraPath::add_keyframe(double time, CVector position, CVector rotation) {
+    if(times.size() > 0) {
+        if(time <= times.back()) return;
+        // Yaw wraps around at 360 degrees, turn the shortest way
+        double delta_yaw = rotation.y - rotations.back().y;
+        rotation.y = rotations.back().y + delta_yaw - 360*floor(delta_yaw/360 + 0.5);
+    }
+
+    times.push_back(time);
+    positions.push_back(position);
+    rotations.push_back(rotation);
+}
+
+int CameraPath::get_number_of_keyframes() {
+    return positions.size();
+}
+
+double CameraPath::get_duration() {
+    if(times.size() == 0) return 0;
+    return times.back() - times.front();
+}
+
+// Spline interpolation through the keyframes, time is clamped to the recorded range
+void CameraPath::sample(double time, CVector &position, CVector &rotation) {
+    int num_keyframes = positions.size();
+    if(num_keyframes == 1 || time <= times.front()) {
+        position = positions.front();
+        rotation = rotations.front();
+        return;
+    }
+    if(time >= times.back()) {
+        position = positions.back();
+        rotation = rotations.back();
+        return;
+    }
+
+    // Binary search for the segment [times[i], times[i+1]] containing time
+    int i = 0;
+    int j = num_keyframes - 1;
+    while(j - i > 1) {
+        int middle = (i + j)/2;
+        if(times[middle] <= time) i = middle;
+        else j = middle;
+    }
+    int i0 = max(i-1, 0);
+    int i3 = min(i+2, num_keyframes-1);
+    double f = (time - times[i])/(times[i+1] - times[i]);
+
+    double t0 = times[i0], t1 = times[i], t2 = times[i+1], t3 = times[i3];
+    position.x = catmull_rom(positions[i0].x, positions[i].x, positions[i+1].x, positions[i3].x, t0, t1, t2, t3, f);
+    position.y = catmull_rom(positions[i0].y, positions[i].y, positions[i+1].y, positions[i3].y, t0, t1, t2, t3, f);
+    position.z = catmull_rom(positions[i0].z, positions[i].z, positions[i+1].z, positions[i3].z, t0, t1, t2, t3, f);
+    rotation.x = catmull_rom(rotations[i0].x, rotations[i].x, rotations[i+1].x, rotations[i3].x, t0, t1, t2, t3, f);
+    rotation.y = catmull_rom(rotations[i0].y, rotations[i].y, rotations[i+1].y, rotations[i3].y, t0, t1, t2, t3, f);
+    rotation.z = 0;
+}
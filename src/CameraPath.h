@@ -0,0 +1,35 @@
+/*
+CameraPath.cpp CameraPath.h
+
+A list of camera keyframes (time in seconds, position and rotation in degrees) that can be sampled
+at any time with Catmull-Rom spline interpolation, so a path recorded at one frame rate can be
+played back at another. Text files contain one keyframe per line, "x y z rot_x rot_y", placed one
+second apart, lines starting with # are ignored. Binary files (written by save_binary) start with
+the magic "MDCP" and the number of keyframes, followed by six floats per keyframe:
+time x y z rot_x rot_y. The camera target is not stored since it follows from the rotation.
+*/
+
+#pragma once
+#include <vector>
+#include <string>
+#include <CVector.h>
+
+using std::vector;
+using std::string;
+
+class CameraPath {
+public:
+  vector<double> times;
+  vector<CVector> positions;
+  vector<CVector> rotations; // Yaw is unwrapped so that consecutive keyframes differ by less than 180 degrees
+
+  bool load(string filename);
+  bool load_text(string filename);
+  bool load_binary(string filename);
+  bool save_binary(string filename);
+  void clear();
+  void add_keyframe(double time, CVector position, CVector rotation);
+  int get_number_of_keyframes();
+  double get_duration();
+  void sample(double time, CVector &position, CVector &rotation);
+};
@@ -0,0 +1,150 @@
+#include <DepthSort.h>
+#include <TaskPool.h>
+#include <algorithm>
+#include <string.h>
+#include <omp.h>
+
+DepthSort::DepthSort() {
+    sort_time = 0;
+    sort_time_per_million_atoms = 0;
+}
+
+// The atoms are split into a fixed number of chunks, each pool task works on whole chunks
+#define DEPTH_SORT_MIN_CHUNK 16384
+
+class DepthKeys {
+public:
+  vector<long> *atom_indices;
+  vector<vector<float> > *positions;
+  vector<unsigned int> *keys;
+  double cam_x, cam_y, cam_z, direction_x, direction_y, direction_z;
+  bool front_to_back;
+
+  void operator()(int begin, int end, int worker) {
+    long i_end = std::min(long(atom_indices->size()), long(end)*DEPTH_SORT_MIN_CHUNK);
+    for(long i=long(begin)*DEPTH_SORT_MIN_CHUNK; i<i_end; i++) {
+      long n = (*atom_indices)[i];
+      vector<float> &position = (*positions)[n];
+      float depth = (position[0] - cam_x)*direction_x + (position[1] - cam_y)*direction_y + (position[2] - cam_z)*direction_z;
+
+      // Map the float to an unsigned int with the same ordering (flip all bits of negatives, the sign bit of positives)
+      unsigned int key;
+      memcpy(&key, &depth, sizeof(float));
+      key ^= (key & 0x80000000) ? 0xFFFFFFFF : 0x80000000;
+      (*keys)[i] = front_to_back ? key : ~key;
+    }
+  }
+};
+
+class RadixHistogram {
+public:
+  unsigned int *keys;
+  long *histograms;
+  long num;
+  int num_chunks, shift;
+
+  void operator()(int begin, int end, int worker) {
+    for(int chunk=begin; chunk<end; chunk++) {
+      long *histogram = &histograms[256*chunk];
+      for(int digit=0; digit<256; digit++) histogram[digit] = 0;
+      long i_end = num*(chunk+1)/num_chunks;
+      for(long i=num*chunk/num_chunks; i<i_end; i++) histogram[(keys[i] >> shift) & 255]++;
+    }
+  }
+};
+
+class RadixScatter {
+public:
+  unsigned int *source_keys, *target_keys;
+  long *source_values, *target_values;
+  long *histograms;
+  long num;
+  int num_chunks, shift;
+
+  void operator()(int begin, int end, int worker) {
+    for(int chunk=begin; chunk<end; chunk++) {
+      long *histogram = &histograms[256*chunk];
+      long i_end = num*(chunk+1)/num_chunks;
+      for(long i=num*chunk/num_chunks; i<i_end; i++) {
+        long position = histogram[(source_keys[i] >> shift) & 255]++;
+        target_keys[position] = source_keys[i];
+        target_values[position] = source_values[i];
+      }
+    }
+  }
+};
+
+void DepthSort::sort(vector<long> &atom_indices, vector<vector<float> > &positions, double cam_x, double cam_y, double cam_z, double direction_x, double direction_y, double direction_z, bool front_to_back) {
+    double t0 = omp_get_wtime();
+    long num_atoms = atom_indices.size();
+    if(num_atoms == 0) return;
+    keys.resize(num_atoms);
+
+    DepthKeys depth_keys;
+    depth_keys.atom_indices = &atom_indices;
+    depth_keys.positions = &positions;
+    depth_keys.keys = &keys;
+    depth_keys.cam_x = cam_x; depth_keys.cam_y = cam_y; depth_keys.cam_z = cam_z;
+    depth_keys.direction_x = direction_x; depth_keys.direction_y = direction_y; depth_keys.direction_z = direction_z;
+    depth_keys.front_to_back = front_to_back;
+    parallel_for(0, int((num_atoms + DEPTH_SORT_MIN_CHUNK - 1)/DEPTH_SORT_MIN_CHUNK), 1, depth_keys);
+
+    radix_sort(atom_indices);
+
+    sort_time = omp_get_wtime() - t0;
+    sort_time_per_million_atoms = sort_time*1e6/num_atoms;
+}
+
+// Stable sort of values by increasing key, sort_keys is sorted along
+void DepthSort::sort_by_keys(vector<unsigned int> &sort_keys, vector<long> &values) {
+    if(values.size() == 0) return;
+    keys.swap(sort_keys);
+    radix_sort(values);
+    keys.swap(sort_keys);
+}
+
+void DepthSort::radix_sort(vector<long> &values) {
+    long num = values.size();
+    keys_tmp.resize(num);
+    values_tmp.resize(num);
+
+    int num_chunks = std::min(long(4*TaskPool::instance().num_workers), num/DEPTH_SORT_MIN_CHUNK + 1);
+    histograms.resize(256*num_chunks);
+
+    RadixHistogram histogram;
+    histogram.histograms = &histograms[0];
+    histogram.num = num;
+    histogram.num_chunks = num_chunks;
+
+    RadixScatter scatter;
+    scatter.source_keys = &keys[0];
+    scatter.target_keys = &keys_tmp[0];
+    scatter.source_values = &values[0];
+    scatter.target_values = &values_tmp[0];
+    scatter.histograms = &histograms[0];
+    scatter.num = num;
+    scatter.num_chunks = num_chunks;
+
+    for(int shift=0; shift<32; shift+=8) {
+        histogram.keys = scatter.source_keys;
+        histogram.shift = shift;
+        parallel_for(0, num_chunks, 1, histogram);
+
+        // Turn the counts into scatter offsets, ordered by digit and then by chunk so the sort is stable
+        long offset = 0;
+        for(int digit=0; digit<256; digit++) {
+            for(int chunk=0; chunk<num_chunks; chunk++) {
+                long count = histograms[256*chunk + digit];
+                histograms[256*chunk + digit] = offset;
+                offset += count;
+            }
+        }
+
+        scatter.shift = shift;
+        parallel_for(0, num_chunks, 1, scatter);
+
+        std::swap(scatter.source_keys, scatter.target_keys);
+        std::swap(scatter.source_values, scatter.target_values);
+    }
+    // After an even number of passes the sorted data is back in keys and values
+}
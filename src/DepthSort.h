@@ -0,0 +1,30 @@
+/*
+DepthSort.cpp DepthSort.h
+
+Sorts a list of atom indices by their depth along the view direction with a parallel LSD radix sort
+on 32-bit keys (four passes of 8 bits, per-chunk histograms, run on the TaskPool). Used to submit opaque billboards
+front-to-back (early depth rejection) and blended billboards back-to-front. sort_by_keys() runs the
+same sort on caller supplied keys, Timestep uses it for the Morton order of the atoms.
+*/
+
+#pragma once
+#include <vector>
+
+using std::vector;
+
+class DepthSort {
+private:
+  vector<unsigned int> keys, keys_tmp;
+  vector<long> values_tmp;
+  vector<long> histograms;
+
+  void radix_sort(vector<long> &values);
+
+public:
+  double sort_time;      // Seconds spent in the last call to sort()
+  double sort_time_per_million_atoms;
+
+  DepthSort();
+  void sort(vector<long> &atom_indices, vector<vector<float> > &positions, double cam_x, double cam_y, double cam_z, double direction_x, double direction_y, double direction_z, bool front_to_back);
+  void sort_by_keys(vector<unsigned int> &sort_keys, vector<long> &values);
+};
@@ -0,0 +1,211 @@
+#pragma once
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <stdio.h>
+
+#include <GL/glew.h>     // Timer query extension check
+#ifndef __glfw_h_
+    #include <GL/glfw.h>
+#endif
+#include <GLUT/glut.h>    // Bitmap font for the HUD
+
+using std::string;
+using std::vector;
+using std::ofstream;
+
+class FrameProfiler
+{
+    public:
+        vector<string> stage_names;
+        vector<double> stage_times;        // Seconds spent in each stage during the current frame
+        vector<vector<double> > history;   // Ring buffer of the last history_size frames for each stage
+        int history_size;
+        int history_index;
+        int frames_recorded;
+        int frame_number;
+
+        ofstream csv;                      // One row per frame, all times in milliseconds
+        bool csv_header_written;
+        bool show_hud;
+        vector<string> hud_lines;          // Extra lines shown below the stage table, set by the caller
+
+        // GPU time of the draw submission, measured with double buffered GL_TIME_ELAPSED queries
+        // so that reading the result never stalls the pipeline
+        bool gpu_timer_available;
+        GLuint gpu_queries[2];
+        int gpu_stage;
+        int gpu_query_frame;
+
+        FrameProfiler()
+        {
+            history_size = 300;
+            history_index = 0;
+            frames_recorded = 0;
+            frame_number = 0;
+            csv_header_written = false;
+            show_hud = false;
+            gpu_timer_available = false;
+            gpu_stage = -1;
+            gpu_query_frame = 0;
+        }
+
+        // Register a stage and return its index. Stages should be added before the first frame.
+        int add_stage(string name)
+        {
+            stage_names.push_back(name);
+            stage_times.push_back(0);
+            history.push_back(vector<double>(history_size, 0));
+            return stage_names.size() - 1;
+        }
+
+        void open_csv(string filename)
+        {
+            csv.open(filename.c_str());
+            if (!csv) std::cout << "Could not open profile file " << filename << std::endl;
+        }
+
+        // Needs a GL context, call after glewInit()
+        void init_gpu_timer()
+        {
+            gpu_timer_available = GLEW_ARB_timer_query;
+            if (!gpu_timer_available) return;
+            glGenQueries(2, gpu_queries);
+            gpu_stage = add_stage("gpu");
+        }
+
+        void begin_gpu()
+        {
+            if (gpu_timer_available) glBeginQuery(GL_TIME_ELAPSED, gpu_queries[gpu_query_frame % 2]);
+        }
+
+        void end_gpu()
+        {
+            if (!gpu_timer_available) return;
+            glEndQuery(GL_TIME_ELAPSED);
+
+            // Read the query from the previous frame if it has finished
+            gpu_query_frame++;
+            if (gpu_query_frame < 2) return;
+            GLuint previous_query = gpu_queries[gpu_query_frame % 2];
+            GLint available = 0;
+            glGetQueryObjectiv(previous_query, GL_QUERY_RESULT_AVAILABLE, &available);
+            if (available)
+            {
+                GLuint64 nanoseconds = 0;
+                glGetQueryObjectui64v(previous_query, GL_QUERY_RESULT, &nanoseconds);
+                stage_times[gpu_stage] = nanoseconds*1e-9;
+            }
+        }
+
+        void add(int stage, double seconds) { stage_times[stage] += seconds; }
+
+        // Store the current frame in the history, write it to the CSV file and start a new frame
+        void end_frame()
+        {
+            if (csv.is_open())
+            {
+                if (!csv_header_written)
+                {
+                    csv << "frame";
+                    for (int stage = 0; stage < stage_names.size(); stage++) csv << "," << stage_names[stage] << "_ms";
+                    csv << "\n";
+                    csv_header_written = true;
+                }
+                csv << frame_number;
+                for (int stage = 0; stage < stage_names.size(); stage++) csv << "," << 1000*stage_times[stage];
+                csv << "\n";
+            }
+
+            for (int stage = 0; stage < stage_names.size(); stage++)
+            {
+                history[stage][history_index] = stage_times[stage];
+                stage_times[stage] = 0;
+            }
+            history_index = (history_index + 1) % history_size;
+            frames_recorded = std::min(frames_recorded + 1, history_size);
+            frame_number++;
+        }
+
+        double last(int stage)
+        {
+            return history[stage][(history_index + history_size - 1) % history_size];
+        }
+
+        // Percentile p (0 to 100) over the frames in the history
+        double percentile(int stage, double p)
+        {
+            if (frames_recorded == 0) return 0;
+            vector<double> values(history[stage].begin(), history[stage].begin() + frames_recorded);
+            int index = std::min(frames_recorded - 1, int(p/100.0*frames_recorded));
+            std::nth_element(values.begin(), values.begin() + index, values.end());
+            return values[index];
+        }
+
+        // Draw the statistics as text in the upper left corner of the window
+        void draw_hud(int window_width, int window_height)
+        {
+            if (!show_hud) return;
+            glMatrixMode(GL_PROJECTION);
+            glPushMatrix();
+            glLoadIdentity();
+            glOrtho(0, window_width, 0, window_height, -1, 1);
+            glMatrixMode(GL_MODELVIEW);
+            glPushMatrix();
+            glLoadIdentity();
+            glDisable(GL_DEPTH_TEST);
+            glDisable(GL_TEXTURE_2D);
+            glColor4f(1.0, 1.0, 1.0, 1.0);
+
+            char line[200];
+            int y = window_height - 20;
+            sprintf(line, "%-10s %8s %8s %8s %8s", "stage (ms)", "last", "p50", "p95", "p99");
+            draw_text(line, 10, y);
+            for (int stage = 0; stage < stage_names.size(); stage++)
+            {
+                y -= 15;
+                sprintf(line, "%-10s %8.2f %8.2f %8.2f %8.2f", stage_names[stage].c_str(), 1000*last(stage), 1000*percentile(stage, 50), 1000*percentile(stage, 95), 1000*percentile(stage, 99));
+                draw_text(line, 10, y);
+            }
+            for (int i = 0; i < hud_lines.size(); i++)
+            {
+                y -= 15;
+                draw_text(hud_lines[i].c_str(), 10, y);
+            }
+
+            glEnable(GL_DEPTH_TEST);
+            glPopMatrix();
+            glMatrixMode(GL_PROJECTION);
+            glPopMatrix();
+            glMatrixMode(GL_MODELVIEW);
+        }
+
+        void draw_text(const char *text, int x, int y)
+        {
+            glRasterPos2i(x, y);
+            for (const char *c = text; *c != '\0'; c++) glutBitmapCharacter(GLUT_BITMAP_8_BY_13, *c);
+        }
+};
+
+// Adds the time between construction and destruction to a stage of the profiler
+class ScopedTimer
+{
+    public:
+        FrameProfiler &profiler;
+        int stage;
+        double start_time;
+
+        ScopedTimer(FrameProfiler &profiler_, int stage_) : profiler(profiler_)
+        {
+            stage = stage_;
+            start_time = glfwGetTime();
+        }
+
+        ~ScopedTimer()
+        {
+            profiler.add(stage, glfwGetTime() - start_time);
+        }
+};
@@ -0,0 +1,214 @@
+#include <IoRing.h>
+#include <TaskPool.h>
+#include <iostream>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <pthread.h>
+// Kernel headers before 5.1 have no linux/io_uring.h and the ones before 5.6 lack the probe, openat and read,
+// those builds (and -DNO_IO_URING) get the stub below and always fall back
+#if defined(__linux__) && !defined(NO_IO_URING) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#if defined(IO_URING_OP_SUPPORTED) && defined(__NR_io_uring_setup)
+#define IO_RING_SUPPORTED
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#endif
+#endif
+
+using std::cout;
+using std::endl;
+
+bool IoRing::enabled = true;
+vector<IoRing*> IoRing::rings;
+static int kernel_support = -1;  // -1 until probed
+static pthread_mutex_t probe_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+#ifdef IO_RING_SUPPORTED
+
+static bool probe_kernel() {
+    IoRing ring;
+    return ring.setup(4);
+}
+
+IoRing::IoRing() {
+    ring = -1;
+    num_entries = 0;
+    sq_tail = 0;
+    num_prepared = 0;
+    sq_memory = cq_memory = sqe_memory = MAP_FAILED;
+    sq_memory_size = cq_memory_size = sqe_memory_size = 0;
+}
+
+IoRing::~IoRing() {
+    if(sqe_memory != MAP_FAILED) munmap(sqe_memory, sqe_memory_size);
+    if(cq_memory != MAP_FAILED) munmap(cq_memory, cq_memory_size);
+    if(sq_memory != MAP_FAILED) munmap(sq_memory, sq_memory_size);
+    if(ring >= 0) close(ring);
+}
+
+// Fails unless the kernel has openat and read on the ring, both arrived in Linux 5.6 together with the probe
+bool IoRing::setup(unsigned entries) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring = syscall(__NR_io_uring_setup, entries, &params);
+    if(ring < 0) return false;
+
+    char probe_memory[sizeof(struct io_uring_probe) + 256*sizeof(struct io_uring_probe_op)];
+    memset(probe_memory, 0, sizeof(probe_memory));
+    struct io_uring_probe *probe = (struct io_uring_probe*)probe_memory;
+    if(syscall(__NR_io_uring_register, ring, IORING_REGISTER_PROBE, probe, 256) < 0) return false;
+    if(probe->last_op < IORING_OP_READ) return false;
+    if(!(probe->ops[IORING_OP_OPENAT].flags & IO_URING_OP_SUPPORTED)) return false;
+    if(!(probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED)) return false;
+
+    num_entries = params.sq_entries;
+    sq_memory_size = params.sq_off.array + params.sq_entries*sizeof(unsigned);
+    cq_memory_size = params.cq_off.cqes + params.cq_entries*sizeof(struct io_uring_cqe);
+    sqe_memory_size = params.sq_entries*sizeof(struct io_uring_sqe);
+    sq_memory = mmap(0, sq_memory_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_SQ_RING);
+    cq_memory = mmap(0, cq_memory_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_CQ_RING);
+    sqe_memory = mmap(0, sqe_memory_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_SQES);
+    if(sq_memory == MAP_FAILED || cq_memory == MAP_FAILED || sqe_memory == MAP_FAILED) return false;
+
+    char *sq = (char*)sq_memory;
+    sq_head_pointer = (unsigned*)(sq + params.sq_off.head);
+    sq_tail_pointer = (unsigned*)(sq + params.sq_off.tail);
+    sq_mask = *(unsigned*)(sq + params.sq_off.ring_mask);
+    sq_array = (unsigned*)(sq + params.sq_off.array);
+    sq_tail = *sq_tail_pointer;
+    char *cq = (char*)cq_memory;
+    cq_head_pointer = (unsigned*)(cq + params.cq_off.head);
+    cq_tail_pointer = (unsigned*)(cq + params.cq_off.tail);
+    cq_mask = *(unsigned*)(cq + params.cq_off.ring_mask);
+    cqes = cq + params.cq_off.cqes;
+    sqes = sqe_memory;
+    return true;
+}
+
+// Submits first when the submission queue is full
+void *IoRing::next_sqe() {
+    if(sq_tail - *(volatile unsigned*)sq_head_pointer >= num_entries) submit();
+    unsigned index = sq_tail & sq_mask;
+    struct io_uring_sqe *sqe = (struct io_uring_sqe*)sqes + index;
+    memset(sqe, 0, sizeof(*sqe));
+    sq_array[index] = index;
+    sq_tail++;
+    num_prepared++;
+    return sqe;
+}
+
+void IoRing::prepare_open(const char *filename, long tag) {
+    struct io_uring_sqe *sqe = (struct io_uring_sqe*)next_sqe();
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (unsigned long)filename;
+    sqe->open_flags = O_RDONLY;
+    sqe->user_data = tag;
+}
+
+void IoRing::prepare_read(int file, void *buffer, unsigned bytes, long offset, long tag) {
+    struct io_uring_sqe *sqe = (struct io_uring_sqe*)next_sqe();
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = file;
+    sqe->addr = (unsigned long)buffer;
+    sqe->len = bytes;
+    sqe->off = offset;
+    sqe->user_data = tag;
+}
+
+void IoRing::submit() {
+    if(num_prepared == 0) return;
+    // The entries must be visible to the kernel before the new tail
+    __sync_synchronize();
+    *(volatile unsigned*)sq_tail_pointer = sq_tail;
+    while(num_prepared > 0) {
+        int num_submitted = syscall(__NR_io_uring_enter, ring, num_prepared, 0, 0, 0, 0);
+        if(num_submitted < 0) {
+            if(errno == EINTR || errno == EAGAIN) continue;
+            cout << "Error in IoRing::submit(): io_uring_enter failed: " << strerror(errno) << endl;
+            exit(1);
+        }
+        num_prepared -= num_submitted;
+    }
+}
+
+void IoRing::wait(long &tag, int &result) {
+    while(true) {
+        unsigned head = *cq_head_pointer;
+        unsigned tail = *(volatile unsigned*)cq_tail_pointer;
+        __sync_synchronize();
+        if(head != tail) {
+            struct io_uring_cqe *cqe = (struct io_uring_cqe*)cqes + (head & cq_mask);
+            tag = cqe->user_data;
+            result = cqe->res;
+            // Done with the entry before the kernel may reuse it
+            __sync_synchronize();
+            *(volatile unsigned*)cq_head_pointer = head + 1;
+            return;
+        }
+        if(syscall(__NR_io_uring_enter, ring, 0, 1, IORING_ENTER_GETEVENTS, 0, 0) < 0 && errno != EINTR) {
+            cout << "Error in IoRing::wait(): io_uring_enter failed: " << strerror(errno) << endl;
+            exit(1);
+        }
+    }
+}
+
+#else
+
+static bool probe_kernel() {
+    return false;
+}
+
+IoRing::IoRing() {
+    ring = -1;
+}
+
+IoRing::~IoRing() { }
+
+bool IoRing::setup(unsigned entries) {
+    return false;
+}
+
+void *IoRing::next_sqe() {
+    return 0;
+}
+
+void IoRing::prepare_open(const char *filename, long tag) { }
+
+void IoRing::prepare_read(int file, void *buffer, unsigned bytes, long offset, long tag) { }
+
+void IoRing::submit() { }
+
+void IoRing::wait(long &tag, int &result) { }
+
+#endif
+
+bool IoRing::is_available() {
+    if(!enabled) return false;
+    pthread_mutex_lock(&probe_mutex);
+    if(kernel_support < 0) {
+        kernel_support = probe_kernel();
+        rings.assign(TaskPool::instance().num_workers, (IoRing*)0);
+    }
+    pthread_mutex_unlock(&probe_mutex);
+    return kernel_support;
+}
+
+// Only the worker itself touches its slot. A worker whose ring cannot be set up (locked memory limits) falls back.
+IoRing *IoRing::for_worker(int worker) {
+    if(worker < 0 || !is_available()) return 0;
+    if(!rings[worker]) {
+        IoRing *ring = new IoRing();
+        if(!ring->setup(IO_RING_ENTRIES)) {
+            delete ring;
+            return 0;
+        }
+        rings[worker] = ring;
+    }
+    return rings[worker];
+}
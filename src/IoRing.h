@@ -0,0 +1,60 @@
+/*
+IoRing.cpp IoRing.h
+
+Batched asynchronous file I/O through Linux io_uring, used to read the node files of a timestep.
+On network filesystems a timestep load is bound by the latency of hundreds of open/read/close
+round trips, so instead of one blocking call at a time a worker queues the opens and reads of many
+node files and submits them with a single system call, then handles the completions in whatever
+order they arrive.
+
+The ring is driven with the raw system calls, there is no liburing dependency. Rings are not thread
+safe, every TaskPool worker gets its own from for_worker(). Where io_uring is missing (other systems,
+kernels or kernel headers before 5.6, containers that block it) or disabled, for_worker() returns 0
+and the callers fall back to blocking reads on the thread pool. Builds without the headers compile a
+stub whose is_available() is always false.
+
+  IoRing *ring = IoRing::for_worker(worker);
+  ring->prepare_open(filename, tag);
+  ring->submit();
+  long tag; int result;
+  ring->wait(tag, result);           // result is the fd, bytes read or -errno
+*/
+
+#pragma once
+#include <vector>
+
+using std::vector;
+
+#define IO_RING_ENTRIES 256
+
+class IoRing {
+public:
+  static bool enabled;            // Set from io_uring in md_visualizer.ini, false always uses the fallback
+
+  static bool is_available();     // Enabled and supported by the kernel, probed once
+  static IoRing *for_worker(int worker); // 0 when not available
+
+  IoRing();
+  ~IoRing();
+  bool setup(unsigned entries);
+  void prepare_open(const char *filename, long tag); // filename must stay valid until the open completes
+  void prepare_read(int file, void *buffer, unsigned bytes, long offset, long tag);
+  void submit();                  // Submits everything prepared since the last submit
+  void wait(long &tag, int &result); // Blocks until the next completion
+
+private:
+  int ring;
+  unsigned num_entries;
+  unsigned sq_tail;               // Local tail, published by submit()
+  unsigned num_prepared;
+  void *sq_memory, *cq_memory, *sqe_memory;
+  long sq_memory_size, cq_memory_size, sqe_memory_size;
+  unsigned *sq_head_pointer, *sq_tail_pointer, *sq_array;
+  unsigned *cq_head_pointer, *cq_tail_pointer;
+  unsigned sq_mask, cq_mask;
+  void *sqes, *cqes;
+
+  void *next_sqe();
+
+  static vector<IoRing*> rings;   // One per TaskPool worker, created on first use
+};
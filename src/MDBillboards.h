@@ -0,0 +1,150 @@
+/*
+MDBillboards.h
+
+CPU part of the billboard renderer: fills the vertex and colour arrays of the camera facing quads for
+the visible atoms. Kept free of OpenGL so the kernels can run without a context (MDTexture submits
+the arrays, md_index_check drives the kernels with atom indices past 2^31). Positions is any type
+with positions[n][k], vector<vector<float> > in the viewer.
+*/
+
+#pragma once
+#include <vector>
+#include <algorithm>
+#include <mts0_io.h>
+using std::vector;
+using std::min;
+using std::max;
+
+#define MAX_NUM_ATOMS 1000000
+
+// Per-frame constants shared by the billboard kernels
+class MDBillboardFrame {
+ public:
+  double cam_x, cam_y, cam_z;
+  double direction[3];
+  double corners[4][3];         // Billboard corners for unit radius
+  double one_over_color_cutoff;
+  double dr2_max, water_dr2_max;
+  double system_size[3];
+};
+
+// Arrays the kernels write to
+class MDBillboardBuffers {
+ public:
+  float *vertices;                   // Render mode 3, MAX_NUM_ATOMS quads, 3 coordinates per vertex
+  float *colors;                     // Render mode 3, RGB and alpha per atom
+  int   *indices;                    // Render mode 3, one per vertex
+  vector<float> billboard_vertices;  // Render modes 1 and 2, 3 coordinates per vertex
+  vector<float> billboard_colors;    // Render modes 1 and 2, RGBA per vertex
+
+  MDBillboardBuffers() : vertices(0), colors(0), indices(0) { }
+};
+
+// The per-atom loop shared by all render modes. The flags are template parameters so that every
+// instantiation has the periodic image loop and the mode specific code resolved at compile time.
+// The visible atoms come in ranges of one type (grouped by type, or in depth order for blending), so hidden
+// types, radius, colour and the water cutoff are handled once per range, leaving no invariant branches in the
+// innermost loop.
+template<int render_mode, bool periodic_boundary_conditions, bool use_ambient_occlusion, class Positions>
+int billboard_kernel(MDBillboardFrame &frame, MDBillboardBuffers &buffers, vector<long> &visible_atom_indices, vector<TypeRange> &type_ranges, Positions &positions, vector<float> &ambient_occlusion, bool draw_water) {
+  const int image_range = periodic_boundary_conditions ? 1 : 0;
+  int num_vertices = 0;
+  int num_atoms = 0;
+
+  for(int range=0; range<type_ranges.size(); range++) {
+    int atom_type = type_ranges[range].type;
+    bool is_water = (atom_type == H_TYPE || atom_type == O_TYPE);
+    if(!draw_water && is_water) continue;
+
+    double scale = visual_atom_radii[atom_type];
+    double range_dr2_max = (render_mode == 1 && is_water) ? min(frame.dr2_max, frame.water_dr2_max) : frame.dr2_max;
+
+    for(long index=type_ranges[range].begin; index<type_ranges[range].end; index++) {
+      long n = visible_atom_indices[index];
+      double occlusion_factor = use_ambient_occlusion ? ambient_occlusion[n] : 1.0;
+
+      double real_x = positions[n][0];
+      double real_y = positions[n][1];
+      double real_z = positions[n][2];
+
+      for(int dx = -image_range; dx <= image_range; dx++) {
+        for(int dy = -image_range; dy <= image_range; dy++) {
+          for(int dz = -image_range; dz <= image_range; dz++) {
+            double x = real_x + frame.system_size[0]*dx;
+            double y = real_y + frame.system_size[1]*dy;
+            double z = real_z + frame.system_size[2]*dz;
+
+            double delta_x = x - frame.cam_x;
+            double delta_y = y - frame.cam_y;
+            double delta_z = z - frame.cam_z;
+
+            double dr2 = delta_x*delta_x + delta_y*delta_y + delta_z*delta_z;
+            if(dr2 < 50) continue;
+            if(dr2 > range_dr2_max) continue;
+
+            double cam_target_times_dr = delta_x*frame.direction[0] + delta_y*frame.direction[1] + delta_z*frame.direction[2];
+            if(cam_target_times_dr < 0) continue;
+
+            if(render_mode == 3) {
+              if(num_atoms == MAX_NUM_ATOMS) continue; // The buffers from prepare_billboards3() are full
+              for(int corner=0; corner<4; corner++) {
+                buffers.vertices[3*num_vertices + 0] = frame.corners[corner][0]*scale + x;
+                buffers.vertices[3*num_vertices + 1] = frame.corners[corner][1]*scale + y;
+                buffers.vertices[3*num_vertices + 2] = frame.corners[corner][2]*scale + z;
+                buffers.indices[num_vertices] = num_vertices;
+                num_vertices++;
+              }
+
+              buffers.colors[4*num_atoms + 0] = color_list[atom_type][0];
+              buffers.colors[4*num_atoms + 1] = color_list[atom_type][1];
+              buffers.colors[4*num_atoms + 2] = color_list[atom_type][2];
+              buffers.colors[4*num_atoms + 3] = 1.0;
+              num_atoms++;
+              continue;
+            }
+
+            float color[4];
+            if(render_mode == 1) {
+              double color_factor = max( (1-dr2*frame.one_over_color_cutoff),0.3)*occlusion_factor;
+              color[0] = color_factor*color_list[atom_type][0];
+              color[1] = color_factor*color_list[atom_type][1];
+              color[2] = color_factor*color_list[atom_type][2];
+              color[3] = 1.0;
+            } else {
+              color[0] = color_list[atom_type][0];
+              color[1] = color_list[atom_type][1];
+              color[2] = color_list[atom_type][2];
+              color[3] = 0.3;
+            }
+
+            for(int corner=0; corner<4; corner++) {
+              buffers.billboard_vertices.push_back(frame.corners[corner][0]*scale + x);
+              buffers.billboard_vertices.push_back(frame.corners[corner][1]*scale + y);
+              buffers.billboard_vertices.push_back(frame.corners[corner][2]*scale + z);
+              buffers.billboard_colors.insert(buffers.billboard_colors.end(), color, color + 4);
+            }
+            num_vertices += 4;
+          }
+        }
+      }
+    }
+  }
+
+  return num_vertices;
+}
+
+// Selects the kernel instantiation for this frame's flags
+template<int render_mode, class Positions>
+int dispatch_billboards(MDBillboardFrame &frame, MDBillboardBuffers &buffers, vector<long> &visible_atom_indices, vector<TypeRange> &type_ranges, Positions &positions, vector<float> &ambient_occlusion, bool draw_water, bool periodic_boundary_conditions) {
+  // Only mode 1 shades by distance and ambient occlusion
+  bool use_ambient_occlusion = render_mode == 1 && ambient_occlusion.size() > 0;
+  int flags = (periodic_boundary_conditions ? 2 : 0) + (use_ambient_occlusion ? 1 : 0);
+
+  switch(flags) {
+  case 0: return billboard_kernel<render_mode, false, false>(frame, buffers, visible_atom_indices, type_ranges, positions, ambient_occlusion, draw_water);
+  case 1: return billboard_kernel<render_mode, false, true>(frame, buffers, visible_atom_indices, type_ranges, positions, ambient_occlusion, draw_water);
+  case 2: return billboard_kernel<render_mode, true,  false>(frame, buffers, visible_atom_indices, type_ranges, positions, ambient_occlusion, draw_water);
+  default: return billboard_kernel<render_mode, true, true>(frame, buffers, visible_atom_indices, type_ranges, positions, ambient_occlusion, draw_water);
+  }
+}
+
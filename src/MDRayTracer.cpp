@@ -0,0 +1,371 @@
+#include <MDRayTracer.h>
+#include <mts0_io.h>
+#include <TaskPool.h>
+#include <algorithm>
+#include <math.h>
+#include <string.h>
+#include <omp.h>
+
+#define BVH_LEAF_SIZE 4
+#define BVH_TASK_SIZE 50000
+
+// Orders spheres by their centre along one axis, used for the median split
+class CompareSphereAxis {
+public:
+  int axis;
+  CompareSphereAxis(int axis_) { axis = axis_; }
+  bool operator()(const MDSphere &a, const MDSphere &b) const {
+    if(axis == 0) return a.x < b.x;
+    if(axis == 1) return a.y < b.y;
+    return a.z < b.z;
+  }
+};
+
+class MDBVHBuildTask : public PoolTask {
+public:
+  MDRayTracer *tracer;
+  int node_index, first, count;
+
+  MDBVHBuildTask(MDRayTracer *tracer_, int node_index_, int first_, int count_) {
+    tracer = tracer_;
+    node_index = node_index_;
+    first = first_;
+    count = count_;
+  }
+
+  void execute(int worker) {
+    tracer->build_node(node_index, first, count);
+  }
+};
+
+// Traces whole tiles, counting rays per worker (padded to a cache line each)
+class MDTileTracer {
+public:
+  MDRayTracer *tracer;
+  vector<double> worker_rays;
+
+  void operator()(int begin, int end, int worker) {
+    for(int tile=begin; tile<end; tile++) tracer->trace_tile(tile, worker_rays[8*worker]);
+  }
+};
+
+inline unsigned int xorshift(unsigned int &seed) {
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    return seed;
+}
+
+inline double random_uniform(unsigned int &seed) {
+    return xorshift(seed)*(1.0/4294967296.0);
+}
+
+MDRayTracer::MDRayTracer(int width_, int height_, int tile_size_) {
+    width = width_;
+    height = height_;
+    tile_size = tile_size_;
+    tiles_x = (width + tile_size - 1) / tile_size;
+    tiles_y = (height + tile_size - 1) / tile_size;
+    num_threads = TaskPool::instance().num_workers;
+    field_of_view = 60.0;
+    samples_per_pixel = 4;
+    ao_samples = 8;
+    ao_distance = 5.0;
+
+    color_buffer.resize(3*width*height);
+    num_nodes = 0;
+    build_time = 0;
+    render_time = 0;
+    num_rays = 0;
+    rays_per_second = 0;
+}
+
+void MDRayTracer::build_bvh(Timestep *timestep, double cam_x_, double cam_y_, double cam_z_, bool draw_water, double dr2_max, vector<float> system_size, bool periodic_boundary_conditions, double water_dr2_max) {
+    double t0 = omp_get_wtime();
+
+    vector<vector<float> > &positions = timestep->positions;
+    vector<TypeRange> &type_ranges = timestep->visible_type_ranges;
+    vector<long> &visible_atom_indices = timestep->visible_atom_indices;
+    spheres.clear();
+
+    // Same selection as the billboard renderers, except that atoms behind the camera are kept
+    // since they cast shadows and occlude
+    for(int range=0; range<type_ranges.size(); range++) {
+        int atom_type = type_ranges[range].type;
+        bool is_water = (atom_type == H_TYPE || atom_type == O_TYPE);
+        if(is_water && !draw_water) continue;
+
+        double radius = visual_atom_radii[atom_type];
+        double range_dr2_max = is_water ? min(dr2_max, water_dr2_max) : dr2_max;
+
+        for(long index=type_ranges[range].begin; index<type_ranges[range].end; index++) {
+            long n = visible_atom_indices[index];
+
+            for(int dx = -1; dx <= 1; dx++) {
+                for(int dy = -1; dy <= 1; dy++) {
+                    for(int dz = -1; dz <= 1; dz++) {
+                        if(!periodic_boundary_conditions && (dx != 0 || dy != 0 || dz != 0)) continue;
+
+                        MDSphere sphere;
+                        sphere.x = positions[n][0] + system_size[0]*dx;
+                        sphere.y = positions[n][1] + system_size[1]*dy;
+                        sphere.z = positions[n][2] + system_size[2]*dz;
+
+                        double delta_x = sphere.x - cam_x_;
+                        double delta_y = sphere.y - cam_y_;
+                        double delta_z = sphere.z - cam_z_;
+                        double dr2 = delta_x*delta_x + delta_y*delta_y + delta_z*delta_z;
+                        if(dr2 < 50) continue;
+                        if(dr2 > range_dr2_max) continue;
+
+                        sphere.radius = radius;
+                        sphere.atom_type = atom_type;
+                        spheres.push_back(sphere);
+                    }
+                }
+            }
+        }
+    }
+
+    nodes.resize(max(1, 2*(int)spheres.size()));
+    num_nodes = 1;
+
+    build_node(0, 0, spheres.size());
+    build_time = omp_get_wtime() - t0;
+}
+
+void MDRayTracer::build_node(int node_index, int first, int count) {
+    MDBVHNode &node = nodes[node_index];
+    float centroid_min[3] = {1e30, 1e30, 1e30};
+    float centroid_max[3] = {-1e30, -1e30, -1e30};
+    for(int k=0; k<3; k++) {
+        node.min[k] = 1e30;
+        node.max[k] = -1e30;
+    }
+
+    for(int i=first; i<first+count; i++) {
+        float center[3] = {spheres[i].x, spheres[i].y, spheres[i].z};
+        for(int k=0; k<3; k++) {
+            node.min[k] = min(node.min[k], center[k] - spheres[i].radius);
+            node.max[k] = max(node.max[k], center[k] + spheres[i].radius);
+            centroid_min[k] = min(centroid_min[k], center[k]);
+            centroid_max[k] = max(centroid_max[k], center[k]);
+        }
+    }
+
+    if(count <= BVH_LEAF_SIZE) {
+        node.first = first;
+        node.count = count;
+        return;
+    }
+
+    int axis = 0;
+    for(int k=1; k<3; k++) {
+        if(centroid_max[k] - centroid_min[k] > centroid_max[axis] - centroid_min[axis]) axis = k;
+    }
+
+    int half = count/2;
+    std::nth_element(spheres.begin() + first, spheres.begin() + first + half, spheres.begin() + first + count, CompareSphereAxis(axis));
+
+    int left = __sync_fetch_and_add(&num_nodes, 2);
+    node.first = left;
+    node.count = 0;
+
+    // Split the top of the tree into TaskPool tasks
+    if(count > BVH_TASK_SIZE) {
+        TaskGroup group;
+        group.run(new MDBVHBuildTask(this, left, first, half));
+        group.run(new MDBVHBuildTask(this, left + 1, first + half, count - half));
+        group.wait();
+    } else {
+        build_node(left, first, half);
+        build_node(left + 1, first + half, count - half);
+    }
+}
+
+bool MDRayTracer::intersect(const double *origin, const double *direction, double t_max, double &t_hit, int &sphere_index, bool any_hit) {
+    if(spheres.size() == 0) return false;
+    double inverse_direction[3];
+    for(int k=0; k<3; k++) inverse_direction[k] = 1.0/direction[k];
+
+    int stack[64];
+    int stack_size = 0;
+    stack[stack_size++] = 0;
+    bool hit = false;
+    t_hit = t_max;
+
+    while(stack_size > 0) {
+        MDBVHNode &node = nodes[stack[--stack_size]];
+
+        // Slab test against the bounding box
+        double t_near = 0;
+        double t_far = t_hit;
+        for(int k=0; k<3; k++) {
+            double t0 = (node.min[k] - origin[k])*inverse_direction[k];
+            double t1 = (node.max[k] - origin[k])*inverse_direction[k];
+            if(t0 > t1) std::swap(t0, t1);
+            t_near = max(t_near, t0);
+            t_far = min(t_far, t1);
+        }
+        if(t_near > t_far) continue;
+
+        if(node.count == 0) {
+            stack[stack_size++] = node.first;
+            stack[stack_size++] = node.first + 1;
+            continue;
+        }
+
+        for(int i=node.first; i<node.first+node.count; i++) {
+            MDSphere &sphere = spheres[i];
+            double oc_x = sphere.x - origin[0];
+            double oc_y = sphere.y - origin[1];
+            double oc_z = sphere.z - origin[2];
+            double b = oc_x*direction[0] + oc_y*direction[1] + oc_z*direction[2];
+            double c = oc_x*oc_x + oc_y*oc_y + oc_z*oc_z - sphere.radius*sphere.radius;
+            double discriminant = b*b - c;
+            if(discriminant < 0) continue;
+
+            double t = b - sqrt(discriminant);
+            if(t < 1e-4) t = b + sqrt(discriminant);
+            if(t < 1e-4 || t >= t_hit) continue;
+
+            t_hit = t;
+            sphere_index = i;
+            hit = true;
+            if(any_hit) return true;
+        }
+    }
+
+    return hit;
+}
+
+void MDRayTracer::shade(const double *direction, unsigned int &seed, double *color, double &num_rays) {
+    double origin[3] = {cam_x, cam_y, cam_z};
+    double t;
+    int sphere_index;
+    num_rays++;
+
+    color[0] = color[1] = color[2] = 0;
+    if(!intersect(origin, direction, 1e30, t, sphere_index, false)) return;
+
+    MDSphere &sphere = spheres[sphere_index];
+    double hit[3], normal[3];
+    for(int k=0; k<3; k++) hit[k] = origin[k] + t*direction[k];
+    normal[0] = (hit[0] - sphere.x)/sphere.radius;
+    normal[1] = (hit[1] - sphere.y)/sphere.radius;
+    normal[2] = (hit[2] - sphere.z)/sphere.radius;
+
+    // Lift the secondary ray origins off the surface
+    for(int k=0; k<3; k++) hit[k] += 1e-3*normal[k];
+
+    double diffuse = normal[0]*light[0] + normal[1]*light[1] + normal[2]*light[2];
+    if(diffuse > 0) {
+        num_rays++;
+        if(intersect(hit, light, 1e30, t, sphere_index, true)) diffuse = 0;
+    } else diffuse = 0;
+
+    // Cosine weighted hemisphere sampling around the normal
+    double tangent[3], bitangent[3];
+    if(fabs(normal[0]) > 0.5) {
+        tangent[0] = normal[1]; tangent[1] = -normal[0]; tangent[2] = 0;
+    } else {
+        tangent[0] = 0; tangent[1] = normal[2]; tangent[2] = -normal[1];
+    }
+    double tangent_length = sqrt(tangent[0]*tangent[0] + tangent[1]*tangent[1] + tangent[2]*tangent[2]);
+    for(int k=0; k<3; k++) tangent[k] /= tangent_length;
+    bitangent[0] = normal[1]*tangent[2] - normal[2]*tangent[1];
+    bitangent[1] = normal[2]*tangent[0] - normal[0]*tangent[2];
+    bitangent[2] = normal[0]*tangent[1] - normal[1]*tangent[0];
+
+    int unoccluded = 0;
+    for(int sample=0; sample<ao_samples; sample++) {
+        double r = sqrt(random_uniform(seed));
+        double phi = 2*M_PI*random_uniform(seed);
+        double a = r*cos(phi);
+        double b = r*sin(phi);
+        double c = sqrt(max(0.0, 1 - r*r));
+        double ao_direction[3];
+        for(int k=0; k<3; k++) ao_direction[k] = a*tangent[k] + b*bitangent[k] + c*normal[k];
+        if(!intersect(hit, ao_direction, ao_distance, t, sphere_index, true)) unoccluded++;
+    }
+    num_rays += ao_samples;
+    double ambient_occlusion = ao_samples > 0 ? unoccluded/double(ao_samples) : 1.0;
+
+    double intensity = 0.35*ambient_occlusion + 0.65*diffuse;
+    for(int k=0; k<3; k++) color[k] = intensity*color_list[sphere.atom_type][k];
+}
+
+void MDRayTracer::trace_tile(int tile, double &num_rays) {
+    int x_start = (tile % tiles_x)*tile_size;
+    int y_start = (tile / tiles_x)*tile_size;
+    int x_end = min(x_start + tile_size, width);
+    int y_end = min(y_start + tile_size, height);
+
+    for(int py = y_start; py < y_end; py++) {
+        for(int px = x_start; px < x_end; px++) {
+            unsigned int seed = 2654435761u*(py*width + px + 1);
+            double pixel_color[3] = {0, 0, 0};
+
+            for(int sample=0; sample<samples_per_pixel; sample++) {
+                double jitter_x = samples_per_pixel > 1 ? random_uniform(seed) : 0.5;
+                double jitter_y = samples_per_pixel > 1 ? random_uniform(seed) : 0.5;
+                double eye_x = (px + jitter_x - 0.5*width)/focal_length;
+                double eye_y = (py + jitter_y - 0.5*height)/focal_length;
+
+                double direction[3];
+                for(int k=0; k<3; k++) direction[k] = forward[k] + eye_x*right[k] + eye_y*up[k];
+                double length = sqrt(direction[0]*direction[0] + direction[1]*direction[1] + direction[2]*direction[2]);
+                for(int k=0; k<3; k++) direction[k] /= length;
+
+                double color[3];
+                shade(direction, seed, color, num_rays);
+                for(int k=0; k<3; k++) pixel_color[k] += color[k];
+            }
+
+            int pixel = py*width + px;
+            for(int k=0; k<3; k++) {
+                double value = 255.0*pixel_color[k]/samples_per_pixel;
+                color_buffer[3*pixel + 2 - k] = (unsigned char)min(255.0, value);
+            }
+        }
+    }
+}
+
+void MDRayTracer::render(double cam_x_, double cam_y_, double cam_z_, double rot_x, double rot_y) {
+    double t0 = omp_get_wtime();
+    cam_x = cam_x_;
+    cam_y = cam_y_;
+    cam_z = cam_z_;
+
+    // Inverse of the view rotation glRotatef(rot_x, 1,0,0)*glRotatef(rot_y, 0,1,0) applied to the eye axes
+    double sin_x = sin(rot_x*M_PI/180); double cos_x = cos(rot_x*M_PI/180);
+    double sin_y = sin(rot_y*M_PI/180); double cos_y = cos(rot_y*M_PI/180);
+    right[0] = cos_y;          right[1] = 0;       right[2] = sin_y;
+    up[0] = sin_y*sin_x;       up[1] = cos_x;      up[2] = -cos_y*sin_x;
+    forward[0] = sin_y*cos_x;  forward[1] = -sin_x; forward[2] = -cos_y*cos_x;
+    focal_length = 0.5*height / tan(0.5*field_of_view*M_PI/180);
+
+    // Light from above and to the left of the camera
+    double length = 0;
+    for(int k=0; k<3; k++) {
+        light[k] = -0.5*right[k] + 0.8*up[k] - 0.6*forward[k];
+        length += light[k]*light[k];
+    }
+    for(int k=0; k<3; k++) light[k] /= sqrt(length);
+
+    // Tiles are split off in halves and stolen by idle workers, so expensive regions of the image are shared out
+    MDTileTracer tile_tracer;
+    tile_tracer.tracer = this;
+    tile_tracer.worker_rays.resize(8*num_threads, 0);
+    parallel_for(0, tiles_x*tiles_y, 1, tile_tracer);
+
+    num_rays = 0;
+    for(int worker=0; worker<num_threads; worker++) num_rays += tile_tracer.worker_rays[8*worker];
+    render_time = omp_get_wtime() - t0;
+    rays_per_second = num_rays/render_time;
+}
+
+void MDRayTracer::copy_to_bitmap(CBitMap *bmp) {
+    if(bmp->width != width || bmp->height != height) bmp->Create(width, height);
+    memcpy(bmp->data, &color_buffer[0], 3*width*height);
+}
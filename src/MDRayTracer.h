@@ -0,0 +1,71 @@
+/*
+MDRayTracer.cpp MDRayTracer.h
+
+Offline renderer that ray traces exact spheres (radius from visual_atom_radii) with hard shadows
+from a camera-relative light and ambient occlusion. A BVH is built over the atoms of a Timestep,
+the image is split into tiles and the tiles are distributed over the TaskPool workers with work
+stealing. The colour buffer uses the same BGR bottom-up layout as MDSoftwareRenderer.
+*/
+
+#pragma once
+#include <vector>
+#include <CBitMap.h>
+
+using std::vector;
+
+class Timestep;
+
+class MDSphere {
+public:
+  float x, y, z;
+  float radius;
+  int atom_type;
+};
+
+// Leaf if count > 0 (spheres first ... first+count-1), otherwise children are first and first+1
+class MDBVHNode {
+public:
+  float min[3], max[3];
+  int first;
+  int count;
+};
+
+class MDRayTracer {
+private:
+  vector<MDSphere> spheres;
+  vector<MDBVHNode> nodes;
+  int num_nodes;
+
+  // Camera basis of the current frame
+  double cam_x, cam_y, cam_z;
+  double right[3], up[3], forward[3], light[3];
+  double focal_length;
+
+  bool intersect(const double *origin, const double *direction, double t_max, double &t_hit, int &sphere_index, bool any_hit);
+  void shade(const double *direction, unsigned int &seed, double *color, double &num_rays);
+
+public:
+  int width, height;
+  int tile_size;
+  int tiles_x, tiles_y;
+  int num_threads;  // Workers in the TaskPool
+  double field_of_view;
+  int samples_per_pixel; // Jittered primary rays per pixel (antialiasing)
+  int ao_samples;        // Occlusion rays per primary hit
+  double ao_distance;    // Occlusion rays are cut off at this length in Ångström
+
+  vector<unsigned char> color_buffer;
+
+  // Statistics from the last calls to build_bvh() and render()
+  double build_time;
+  double render_time;
+  double num_rays;
+  double rays_per_second;
+
+  MDRayTracer(int width_, int height_, int tile_size_);
+  void build_node(int node_index, int first, int count); // Run as TaskPool tasks
+  void trace_tile(int tile, double &num_rays);
+  void build_bvh(Timestep *timestep, double cam_x_, double cam_y_, double cam_z_, bool draw_water, double dr2_max, vector<float> system_size, bool periodic_boundary_conditions, double water_dr2_max);
+  void render(double cam_x_, double cam_y_, double cam_z_, double rot_x, double rot_y);
+  void copy_to_bitmap(CBitMap *bmp);
+};
@@ -0,0 +1,302 @@
+#include <MDSoftwareRenderer.h>
+#include <mts0_io.h>
+#include <TaskPool.h>
+#include <lodepng.h>
+#include <math.h>
+#include <string.h>
+#include <omp.h>
+#include <iostream>
+
+using std::cout;
+using std::endl;
+
+MDSoftwareRenderer::MDSoftwareRenderer(int width_, int height_, int tile_size_) {
+    width = width_;
+    height = height_;
+    tile_size = tile_size_;
+    tiles_x = (width + tile_size - 1) / tile_size;
+    tiles_y = (height + tile_size - 1) / tile_size;
+    num_threads = TaskPool::instance().num_workers;
+    num_chunks = 4*num_threads;
+
+    // Same projection as MDOpenGL::init_GL
+    field_of_view = 60.0;
+    near = 2.0;
+
+    color_buffer.resize(3*width*height);
+    depth_buffer.resize(width*height);
+
+    chunk_splats.resize(num_chunks);
+    chunk_tile_bins.resize(num_chunks);
+    for(int chunk=0; chunk<num_chunks; chunk++) {
+        chunk_tile_bins[chunk].resize(tiles_x*tiles_y);
+    }
+
+    render_time = 0;
+    num_splats = 0;
+    sprite_size = 0;
+}
+
+void MDSoftwareRenderer::load_png(string filename) {
+    unsigned int sprite_width, sprite_height;
+    unsigned error = lodepng::decode(sprite, sprite_width, sprite_height, filename.c_str());
+
+    if(error) {
+        std::cout << "decoder error " << error << ": " << lodepng_error_text(error) << std::endl;
+        std::cout << "Falling back to generated sphere sprite" << std::endl;
+        create_sphere1(512);
+        return;
+    }
+    sprite_size = sprite_width;
+}
+
+// Same shading as MDTexture::create_sphere1
+void MDSoftwareRenderer::create_sphere1(int w) {
+    sprite_size = w;
+    sprite.resize(4*w*w);
+    for (int i=0;i<w; i++) {
+        for (int j=0;j<w; j++) {
+            double x = (i-w/2)/(double)w;
+            double y = (j-w/2)/(double)w;
+            double dr = sqrt(x*x + y*y)*2;
+            dr = min(dr,1.0);
+
+            if(dr>=0.99) {
+                sprite[4*i + 4*w*j  +0] = 0;
+                sprite[4*i + 4*w*j  +1] = 0;
+                sprite[4*i + 4*w*j  +2] = 0;
+                sprite[4*i + 4*w*j  +3] = 0;
+            } else {
+                sprite[4*i + 4*w*j  +0] = (unsigned char)(255.0*(1 - 0.7*dr));
+                sprite[4*i + 4*w*j  +1] = (unsigned char)(255.0*(1 - 0.7*dr));
+                sprite[4*i + 4*w*j  +2] = (unsigned char)(255.0*(1 - 0.7*dr));
+                sprite[4*i + 4*w*j  +3] = 255;
+            }
+        }
+    }
+}
+
+// Projects the visible atoms of a range of chunks into the splat list and tile bins of each chunk
+class MDSplatProjection {
+public:
+  MDSoftwareRenderer *renderer;
+  Timestep *timestep;
+  bool draw_water, use_ambient_occlusion, periodic_boundary_conditions;
+  double cam_x, cam_y, cam_z;
+  double sin_x, cos_x, sin_y, cos_y;
+  double direction_x, direction_y, direction_z;
+  double focal_length, one_over_color_cutoff, dr2_max, water_dr2_max;
+  float *system_size;
+  long num_visible_atoms;
+  int num_chunks;
+
+  void operator()(int begin, int end, int worker) {
+    for(int chunk=begin; chunk<end; chunk++) project_chunk(chunk);
+  }
+
+  void project_chunk(int chunk) {
+    vector<vector<float> > &positions = timestep->positions;
+    vector<TypeRange> &type_ranges = timestep->visible_type_ranges;
+    vector<long> &visible_atom_indices = timestep->visible_atom_indices;
+    vector<float> &ambient_occlusion = timestep->ambient_occlusion;
+    int width = renderer->width;
+    int height = renderer->height;
+    int tile_size = renderer->tile_size;
+    int tiles_x = renderer->tiles_x;
+    int tiles_y = renderer->tiles_y;
+    double near = renderer->near;
+    vector<MDSplat> &splats = renderer->chunk_splats[chunk];
+    vector<vector<int> > &tile_bins = renderer->chunk_tile_bins[chunk];
+    splats.clear();
+    for(int tile=0; tile<tiles_x*tiles_y; tile++) tile_bins[tile].clear();
+
+    // The chunk's share of each type range, hidden types are skipped as a whole
+    long chunk_begin = num_visible_atoms*chunk/num_chunks;
+    long chunk_end = num_visible_atoms*(chunk+1)/num_chunks;
+    for(int range=0; range<type_ranges.size(); range++) {
+      int atom_type = type_ranges[range].type;
+      bool is_water = (atom_type == H_TYPE || atom_type == O_TYPE);
+      if(is_water && !draw_water) continue;
+
+      double scale = visual_atom_radii[atom_type];
+      double range_dr2_max = is_water ? min(dr2_max, water_dr2_max) : dr2_max;
+      long index_begin = max(chunk_begin, type_ranges[range].begin);
+      long index_end = min(chunk_end, type_ranges[range].end);
+
+      for(long index=index_begin; index<index_end; index++) {
+        long n = visible_atom_indices[index];
+        double occlusion_factor = use_ambient_occlusion ? ambient_occlusion[n] : 1.0;
+
+        double real_x = positions[n][0];
+        double real_y = positions[n][1];
+        double real_z = positions[n][2];
+
+        for(int dx = -1; dx <= 1; dx++) {
+          for(int dy = -1; dy <= 1; dy++) {
+            for(int dz = -1; dz <= 1; dz++) {
+              if(!periodic_boundary_conditions && (dx != 0 || dy != 0 || dz != 0)) continue;
+
+              double delta_x = real_x + system_size[0]*dx - cam_x;
+              double delta_y = real_y + system_size[1]*dy - cam_y;
+              double delta_z = real_z + system_size[2]*dz - cam_z;
+
+              double dr2 = delta_x*delta_x + delta_y*delta_y + delta_z*delta_z;
+              if(dr2 < 50) continue;
+              if(dr2 > range_dr2_max) continue;
+
+              double cam_target_times_dr = delta_x*direction_x + delta_y*direction_y + delta_z*direction_z;
+              if(cam_target_times_dr < 0) continue;
+
+              // Rotate into eye coordinates
+              double eye_x = cos_y*delta_x + sin_y*delta_z;
+              double tmp_z = -sin_y*delta_x + cos_y*delta_z;
+              double eye_y = cos_x*delta_y - sin_x*tmp_z;
+              double depth = -(sin_x*delta_y + cos_x*tmp_z);
+              if(depth < near) continue;
+
+              MDSplat splat;
+              splat.depth = depth;
+              splat.radius = scale;
+              splat.radius_px = focal_length*scale/depth;
+              splat.x = 0.5*width + focal_length*eye_x/depth;
+              splat.y = 0.5*height + focal_length*eye_y/depth;
+              if(splat.x + splat.radius_px < 0 || splat.x - splat.radius_px >= width) continue;
+              if(splat.y + splat.radius_px < 0 || splat.y - splat.radius_px >= height) continue;
+
+              double color_factor = max( (1-dr2*one_over_color_cutoff),0.3)*occlusion_factor;
+              splat.r = color_factor*color_list[atom_type][0];
+              splat.g = color_factor*color_list[atom_type][1];
+              splat.b = color_factor*color_list[atom_type][2];
+
+              int splat_index = splats.size();
+              splats.push_back(splat);
+
+              // Bin into every tile the bounding square touches
+              int tile_x0 = max(0, int(splat.x - splat.radius_px) / tile_size);
+              int tile_x1 = min(tiles_x - 1, int(splat.x + splat.radius_px) / tile_size);
+              int tile_y0 = max(0, int(splat.y - splat.radius_px) / tile_size);
+              int tile_y1 = min(tiles_y - 1, int(splat.y + splat.radius_px) / tile_size);
+              for(int tile_y = tile_y0; tile_y <= tile_y1; tile_y++) {
+                for(int tile_x = tile_x0; tile_x <= tile_x1; tile_x++) {
+                  tile_bins[tile_y*tiles_x + tile_x].push_back(splat_index);
+                }
+              }
+            }
+          }
+        }
+      }
+    }
+  }
+};
+
+class MDTileRasterizer {
+public:
+  MDSoftwareRenderer *renderer;
+
+  void operator()(int begin, int end, int worker) {
+    for(int tile=begin; tile<end; tile++) renderer->rasterize_tile(tile);
+  }
+};
+
+void MDSoftwareRenderer::render(Timestep *timestep, double cam_x, double cam_y, double cam_z, double rot_x, double rot_y, bool draw_water, double color_cutoff, double dr2_max, vector<float> system_size, bool periodic_boundary_conditions, double water_dr2_max) {
+    double t0 = omp_get_wtime();
+
+    bool use_ambient_occlusion = timestep->ambient_occlusion.size() > 0;
+    long num_visible_atoms = timestep->visible_atom_indices.size();
+
+    // View matrix is glRotatef(rot_x, 1,0,0)*glRotatef(rot_y, 0,1,0)*glTranslatef(-cam)
+    double sin_x = sin(rot_x*M_PI/180); double cos_x = cos(rot_x*M_PI/180);
+    double sin_y = sin(rot_y*M_PI/180); double cos_y = cos(rot_y*M_PI/180);
+    double direction_x = sin_y*cos_x;
+    double direction_y = -sin_x;
+    double direction_z = -cos_y*cos_x;
+
+    double focal_length = 0.5*height / tan(0.5*field_of_view*M_PI/180);
+    double one_over_color_cutoff = 1.0/color_cutoff;
+
+    MDSplatProjection projection;
+    projection.renderer = this;
+    projection.timestep = timestep;
+    projection.draw_water = draw_water;
+    projection.use_ambient_occlusion = use_ambient_occlusion;
+    projection.cam_x = cam_x; projection.cam_y = cam_y; projection.cam_z = cam_z;
+    projection.sin_x = sin_x; projection.cos_x = cos_x;
+    projection.sin_y = sin_y; projection.cos_y = cos_y;
+    projection.direction_x = direction_x; projection.direction_y = direction_y; projection.direction_z = direction_z;
+    projection.focal_length = focal_length;
+    projection.one_over_color_cutoff = one_over_color_cutoff;
+    projection.dr2_max = dr2_max;
+    projection.water_dr2_max = water_dr2_max;
+    projection.system_size = &system_size[0];
+    projection.periodic_boundary_conditions = periodic_boundary_conditions;
+    projection.num_visible_atoms = num_visible_atoms;
+    projection.num_chunks = num_chunks;
+    parallel_for(0, num_chunks, 1, projection);
+
+    // Tiles cover disjoint pixels, so no synchronization is needed while rasterizing
+    MDTileRasterizer rasterizer;
+    rasterizer.renderer = this;
+    parallel_for(0, tiles_x*tiles_y, 1, rasterizer);
+
+    num_splats = 0;
+    for(int chunk=0; chunk<num_chunks; chunk++) num_splats += chunk_splats[chunk].size();
+    render_time = omp_get_wtime() - t0;
+}
+
+void MDSoftwareRenderer::rasterize_tile(int tile) {
+    int x_start = (tile % tiles_x)*tile_size;
+    int y_start = (tile / tiles_x)*tile_size;
+    int x_end = min(x_start + tile_size, width);
+    int y_end = min(y_start + tile_size, height);
+
+    for(int py = y_start; py < y_end; py++) {
+        memset(&color_buffer[3*(py*width + x_start)], 0, 3*(x_end - x_start));
+        for(int px = x_start; px < x_end; px++) depth_buffer[py*width + px] = 1e30;
+    }
+
+    for(int chunk=0; chunk<num_chunks; chunk++) {
+        vector<MDSplat> &splats = chunk_splats[chunk];
+        vector<int> &tile_bin = chunk_tile_bins[chunk][tile];
+
+        for(int i=0; i<tile_bin.size(); i++) {
+            MDSplat &splat = splats[tile_bin[i]];
+            float one_over_radius_px = 1.0/splat.radius_px;
+
+            int x0 = max(x_start, int(floor(splat.x - splat.radius_px)));
+            int x1 = min(x_end - 1, int(ceil(splat.x + splat.radius_px)));
+            int y0 = max(y_start, int(floor(splat.y - splat.radius_px)));
+            int y1 = min(y_end - 1, int(ceil(splat.y + splat.radius_px)));
+
+            for(int py = y0; py <= y1; py++) {
+                float v = (py + 0.5f - splat.y)*one_over_radius_px;
+                int texel_y = min(sprite_size - 1, max(0, int((0.5f*v + 0.5f)*sprite_size)));
+
+                for(int px = x0; px <= x1; px++) {
+                    float u = (px + 0.5f - splat.x)*one_over_radius_px;
+                    float dr2 = u*u + v*v;
+                    if(dr2 >= 1) continue;
+
+                    int texel_x = min(sprite_size - 1, max(0, int((0.5f*u + 0.5f)*sprite_size)));
+                    unsigned char *texel = &sprite[4*(texel_y*sprite_size + texel_x)];
+                    // Same alpha test as render_billboards, glAlphaFunc(GL_GREATER,0.9)
+                    if(texel[3] <= 229) continue;
+
+                    // Depth of the sphere surface rather than of a flat billboard
+                    float depth = splat.depth - splat.radius*sqrt(1 - dr2);
+                    int pixel = py*width + px;
+                    if(depth >= depth_buffer[pixel]) continue;
+                    depth_buffer[pixel] = depth;
+
+                    color_buffer[3*pixel + 0] = (unsigned char)(texel[2]*splat.b);
+                    color_buffer[3*pixel + 1] = (unsigned char)(texel[1]*splat.g);
+                    color_buffer[3*pixel + 2] = (unsigned char)(texel[0]*splat.r);
+                }
+            }
+        }
+    }
+}
+
+void MDSoftwareRenderer::copy_to_bitmap(CBitMap *bmp) {
+    if(bmp->width != width || bmp->height != height) bmp->Create(width, height);
+    memcpy(bmp->data, &color_buffer[0], 3*width*height);
+}
@@ -0,0 +1,59 @@
+/*
+MDSoftwareRenderer.cpp MDSoftwareRenderer.h
+
+Tile based CPU rasterizer that draws the same shaded spheres as MDTexture::render_billboards
+without any OpenGL. Atoms are projected to screen space splats in parallel, binned into
+tile_size x tile_size tiles and each tile is rasterized with a per-pixel depth test by one TaskPool task.
+The colour buffer is stored as BGR rows bottom-up, i.e. the same layout as glReadPixels gives CBitMap.
+*/
+
+#pragma once
+#include <vector>
+#include <string>
+#include <CBitMap.h>
+
+using std::vector;
+using std::string;
+
+class Timestep;
+
+// One projected atom (or periodic image of an atom)
+class MDSplat {
+public:
+  float x, y;       // Screen position of the centre in pixels
+  float depth;      // Distance from the camera along the view direction
+  float radius;     // Radius in world units
+  float radius_px;  // Radius in pixels
+  float r, g, b;
+};
+
+class MDSoftwareRenderer {
+private:
+  vector<unsigned char> sprite;                   // RGBA sphere sprite
+  int sprite_size;
+
+public:
+  vector<vector<MDSplat> > chunk_splats;          // Splats produced from each chunk of the visible atoms
+  vector<vector<vector<int> > > chunk_tile_bins;  // [chunk][tile] -> indices into chunk_splats[chunk]
+  int width, height;
+  int tile_size;
+  int tiles_x, tiles_y;
+  int num_threads;  // Workers in the TaskPool
+  int num_chunks;   // Fixed, so that the splat order and thereby the image does not depend on scheduling
+  double field_of_view;
+  double near;
+
+  vector<unsigned char> color_buffer; // BGR, 3 bytes per pixel
+  vector<float> depth_buffer;
+
+  // Statistics from the last call to render()
+  double render_time;
+  int num_splats;
+
+  MDSoftwareRenderer(int width_, int height_, int tile_size_);
+  void rasterize_tile(int tile);
+  void load_png(string filename);
+  void create_sphere1(int w);
+  void render(Timestep *timestep, double cam_x, double cam_y, double cam_z, double rot_x, double rot_y, bool draw_water, double color_cutoff, double dr2_max, vector<float> system_size, bool periodic_boundary_conditions, double water_dr2_max);
+  void copy_to_bitmap(CBitMap *bmp);
+};
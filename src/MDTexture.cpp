@@ -4,6 +4,7 @@
 #include <MDTexture.h>
 #include <Camera.h>
 #include <lodepng.h>
+#include <mts0_io.h>
 
 #define SI_TYPE 1
 #define A_TYPE 2
@@ -12,9 +13,6 @@
 #define NA_TYPE 5
 #define CL_TYPE 6
 #define X_TYPE 7
-                    // Not Av   Si                      Si-O       H            O      Na                   Cl
-double color_list[7][3] = {{1,1,1},{230.0/255,230.0/255,0},{0,0,1},{1.0,1.0,1.0},{1,0,0},{9.0/255,92.0/255,0},{95.0/255,216.0/255,250.0/255}};
-double visual_atom_radii[7] = {0, 1.11, 0.66, 0.35, 0.66, 1.86, 1.02};
 
 void MDTexture::create_sphere1(string name, int w) {
     CBitMap bmp;
@@ -131,35 +129,26 @@ void MDTexture::load_texture(CBitMap* bmp, MDOpenGLTexture* texture, bool has_al
     
 }
 
-void MDTexture::render_billboards(MDOpenGL &opengl, vector<int> &visible_atom_indices, vector<int> &atom_types, vector<vector<float> > &positions, bool draw_water, double color_cutoff, double dr2_max, vector<float> system_size, bool periodic_boundary_conditions, double water_dr2_max) {
-    Camera *camera = opengl.camera;
-    glDisable(GL_CULL_FACE);
-    glEnable(GL_BLEND);
-    // glBlendFunc(GL_SRC_ALPHA, GL_ONE);
-    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-    // glBlendFunc(GL_SRC_ALPHA, GL_SRC_ALPHA_SATURATE);
-    MDOpenGLTexture texture = textures[0];
-    GLuint texture_id = texture.id;
-
-    glEnable( GL_TEXTURE_2D );
-    glBindTexture(GL_TEXTURE_2D, texture_id);
-    glDepthMask(GL_TRUE);
-
-    glEnable(GL_ALPHA_TEST);
-    glAlphaFunc(GL_GREATER,0.9);
+void MDTexture::prepare_billboards3() {
+    buffers.vertices = new float[4*3*MAX_NUM_ATOMS]; // 4 vertices per atom, 3 coordinates per vertex
+    buffers.colors   = new float[4*MAX_NUM_ATOMS];   
+    normals          = new float[3*MAX_NUM_ATOMS];
+    buffers.indices  = new int  [4*MAX_NUM_ATOMS];
 
-    glBegin(GL_QUADS);
+    glGenBuffers(1, &vertices_id);
+    glGenBuffers(1, &indices_id);
+    glGenBuffers(1, &normals_id);
+    glGenBuffers(1, &colors_id);
+}
 
 
+// CPU part of the billboards, fills the vertex arrays for this frame. Returns the number of vertices.
+int MDTexture::build_billboards(MDOpenGL &opengl, int render_mode, vector<long> &visible_atom_indices, vector<TypeRange> &type_ranges, vector<vector<float> > &positions, vector<float> &ambient_occlusion, bool draw_water, double color_cutoff, double dr2_max, vector<float> system_size, bool periodic_boundary_conditions, double water_dr2_max) {
+    Camera *camera = opengl.camera;
     CVector left, up, right, direction, v0, v1, v2, v3;
-    int S = 1.0;
-    double cam_x = camera->position.x; double cam_y = camera->position.y; double cam_z = camera->position.z;
-    double one_over_color_cutoff = 1.0/color_cutoff;
+    MDBillboardFrame frame;
 
     CVector up_on_screen = opengl.coord_to_ray(0,opengl.window_height/2.0);
-    double dx = camera->target.x - cam_x;
-    double dy = camera->target.y - cam_y;
-    double dz = camera->target.z - cam_z;
     direction = camera->target;
 
     left = direction.Cross(up_on_screen);
@@ -170,151 +159,91 @@ void MDTexture::render_billboards(MDOpenGL &opengl, vector<int> &visible_atom_in
     v1 = (right*-1 + up);
     v2 = (right*-1 + up*-1);
     v3 = (right + up*-1);
-    
-    glNormal3f(direction.x, direction.y, direction.z);
-    for(int index=0; index<visible_atom_indices.size(); index++) {
-        int n = visible_atom_indices[index];
-        int atom_type = atom_types[n];
-        bool is_water = (atom_type == H_TYPE || atom_type == O_TYPE);
-        if(is_water && !draw_water) continue;
-
-        double scale = visual_atom_radii[atom_type];
-
-        double real_x = positions[n][0];
-        double real_y = positions[n][1];
-        double real_z = positions[n][2];
-
-        for(int dx = -1; dx <= 1; dx++) {
-            for(int dy = -1; dy <= 1; dy++) {
-                for(int dz = -1; dz <= 1; dz++) {
-                    if(!periodic_boundary_conditions && (dx != 0 || dy != 0 || dz != 0)) continue;
-
-                    double x = real_x + system_size[0]*dx;
-                    double y = real_y + system_size[1]*dy;
-                    double z = real_z + system_size[2]*dz;
-
-                    double delta_x = x - cam_x;
-                    double delta_y = y - cam_y;
-                    double delta_z = z - cam_z;
-
-                    double dr2 = delta_x*delta_x + delta_y*delta_y + delta_z*delta_z;
-                    if(dr2 < 50) continue;
-                    if(dr2 > dr2_max) continue;
-                    if(is_water && dr2 > water_dr2_max) continue;
-
-                    double cam_target_times_dr = delta_x*direction.x + delta_y*direction.y + delta_z*direction.z;
-                    if(cam_target_times_dr < 0) continue;
-
-                    double color_factor = max( (1-dr2*one_over_color_cutoff),0.3);
-                    glColor4f(color_factor*color_list[atom_type][0],color_factor*color_list[atom_type][1],color_factor*color_list[atom_type][2], 1.0);
-                    
-                    glTexCoord2f(0,0);
-                    glVertex3f(v0.x*scale + x,v0.y*scale + y,v0.z*scale + z);
-                    glTexCoord2f(1,0);
-                    glVertex3f(v1.x*scale + x,v1.y*scale + y,v1.z*scale + z);
-                    glTexCoord2f(1,1);
-                    glVertex3f(v2.x*scale + x,v2.y*scale + y,v2.z*scale + z);
-                    glTexCoord2f(0,1);
-                    glVertex3f(v3.x*scale + x,v3.y*scale + y,v3.z*scale + z);
-                }
-            }
-        }
-    }
-    
-    glEnd();
-    glDisable(GL_BLEND);
-    glEnable(GL_CULL_FACE);
-    glDisable(GL_ALPHA_TEST);
 
-    glDepthMask(GL_TRUE);
-    glDisable( GL_TEXTURE_2D );
-    glColor4f(1.0,1.0,1.0,1.0);
+    CVector corners[4] = {v0, v1, v2, v3};
+    for(int corner=0; corner<4; corner++) {
+        frame.corners[corner][0] = corners[corner].x;
+        frame.corners[corner][1] = corners[corner].y;
+        frame.corners[corner][2] = corners[corner].z;
+    }
+    frame.direction[0] = direction.x; frame.direction[1] = direction.y; frame.direction[2] = direction.z;
+    frame.cam_x = camera->position.x; frame.cam_y = camera->position.y; frame.cam_z = camera->position.z;
+    frame.one_over_color_cutoff = 1.0/color_cutoff;
+    frame.dr2_max = dr2_max;
+    frame.water_dr2_max = water_dr2_max;
+    for(int k=0; k<3; k++) frame.system_size[k] = system_size[k];
+
+    billboard_normal[0] = direction.x; billboard_normal[1] = direction.y; billboard_normal[2] = direction.z;
+    buffers.billboard_vertices.clear();
+    buffers.billboard_colors.clear();
+
+    if(render_mode == 3) return dispatch_billboards<3>(frame, buffers, visible_atom_indices, type_ranges, positions, ambient_occlusion, draw_water, periodic_boundary_conditions);
+    if(render_mode == 1) return dispatch_billboards<1>(frame, buffers, visible_atom_indices, type_ranges, positions, ambient_occlusion, draw_water, periodic_boundary_conditions);
+    return dispatch_billboards<2>(frame, buffers, visible_atom_indices, type_ranges, positions, ambient_occlusion, draw_water, periodic_boundary_conditions);
 }
 
-void MDTexture::render_billboards2(MDOpenGL &opengl, vector<int> &visible_atom_indices, vector<int> &atom_types, vector<vector<float> > &positions, bool draw_water, double color_cutoff, double dr2_max, vector<float> system_size, bool periodic_boundary_conditions) {
-    Camera *camera = opengl.camera;
-    glDisable(GL_CULL_FACE);
-    glEnable(GL_BLEND);
-    glBlendFunc(GL_SRC_ALPHA, GL_ONE);
-    MDOpenGLTexture texture = textures[1];
-    GLuint texture_id = texture.id;
+// GL part of the billboards, draws the num_vertices vertices from build_billboards()
+void MDTexture::submit_billboards(int render_mode, int num_vertices) {
+    glNormal3f(billboard_normal[0], billboard_normal[1], billboard_normal[2]);
 
-    glEnable( GL_TEXTURE_2D );
-    glBindTexture(GL_TEXTURE_2D, texture_id);
-    glDepthMask(GL_FALSE);
+    if(render_mode == 3) {
+        glBindBuffer(GL_ARRAY_BUFFER, vertices_id);
+        glBufferData(GL_ARRAY_BUFFER, sizeof(GLfloat)*3*num_vertices, NULL, GL_DYNAMIC_DRAW);
+        glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(GLfloat)*3*num_vertices, buffers.vertices);
 
-    glEnable(GL_ALPHA_TEST);
-    glAlphaFunc(GL_GREATER,0.05);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indices_id);
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(GLuint)*num_vertices, NULL, GL_STATIC_DRAW);
+        glBufferSubData(GL_ELEMENT_ARRAY_BUFFER, 0, sizeof(GLuint)*num_vertices, buffers.indices);
 
-    glBegin(GL_QUADS);
+        glEnableClientState(GL_VERTEX_ARRAY);
+        glEnableClientState(GL_COLOR_ARRAY);
 
-    CVector left, up, right, direction, v0, v1, v2, v3;
-    int S = 1.0;
-    double cam_x = camera->position.x; double cam_y = camera->position.y; double cam_z = camera->position.z;
-    double one_over_color_cutoff = 1.0/color_cutoff;
+        glVertexPointer(3, GL_FLOAT, 3*sizeof(GLfloat), NULL);
+        glColorPointer (4, GL_FLOAT, 4, NULL);
 
-    CVector up_on_screen = opengl.coord_to_ray(0,opengl.window_height/2.0);
-    double dx = camera->target.x - cam_x;
-    double dy = camera->target.y - cam_y;
-    double dz = camera->target.z - cam_z;
-    direction = camera->target;
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indices_id);
+        glBindBuffer(GL_ARRAY_BUFFER, vertices_id);
+        glDrawElements(GL_QUADS, num_vertices, GL_UNSIGNED_INT, 0);
 
-    left = direction.Cross(up_on_screen);
-    up = (direction.Cross(left)).Normalize();
-    right = (direction.Cross(up)).Normalize();
+        glDisableClientState(GL_VERTEX_ARRAY);
+        return;
+    }
 
-    v0 = (right + up);
-    v1 = (right*-1 + up);
-    v2 = (right*-1 + up*-1);
-    v3 = (right + up*-1);
-    
-    glNormal3f(direction.x, direction.y, direction.z);
-
-    for(int n=0; n<positions.size(); n++) {
-        int atom_type = atom_types[n];
-        if( (atom_type == H_TYPE || atom_type == O_TYPE) && !draw_water) continue;
-        double scale = visual_atom_radii[atom_type];
-
-        double real_x = positions[n][0];
-        double real_y = positions[n][1];
-        double real_z = positions[n][2];
-
-        for(int dx = -1; dx <= 1; dx++) {
-            for(int dy = -1; dy <= 1; dy++) {
-                for(int dz = -1; dz <= 1; dz++) {
-                    if(!periodic_boundary_conditions && (dx != 0 || dy != 0 || dz != 0)) continue;
-
-                    double x = real_x + system_size[0]*dx;
-                    double y = real_y + system_size[1]*dy;
-                    double z = real_z + system_size[2]*dz;
-
-                    double delta_x = x - cam_x;
-                    double delta_y = y - cam_y;
-                    double delta_z = z - cam_z;
-
-                    double dr2 = delta_x*delta_x + delta_y*delta_y + delta_z*delta_z;
-                    if(dr2 < 50) continue;
-                    if(dr2 > dr2_max) continue;
-                    
-                    double cam_target_times_dr = delta_x*direction.x + delta_y*direction.y + delta_z*direction.z;
-                    if(cam_target_times_dr < 0) continue;
-
-                    glColor4f(color_list[atom_type][0],color_list[atom_type][1],color_list[atom_type][2], 0.3);
-                    
-                    glTexCoord2f(0,0);
-                    glVertex3f(v0.x*scale + x,v0.y*scale + y,v0.z*scale + z);
-                    glTexCoord2f(1,0);
-                    glVertex3f(v1.x*scale + x,v1.y*scale + y,v1.z*scale + z);
-                    glTexCoord2f(1,1);
-                    glVertex3f(v2.x*scale + x,v2.y*scale + y,v2.z*scale + z);
-                    glTexCoord2f(0,1);
-                    glVertex3f(v3.x*scale + x,v3.y*scale + y,v3.z*scale + z);
-                }
-            }
-        }
+    // Every billboard has the same texture coordinates, they are only added when more billboards are drawn than before
+    static const GLfloat quad_tex_coords[8] = {0,0, 1,0, 1,1, 0,1};
+    while(billboard_tex_coords.size() < 2*num_vertices) billboard_tex_coords.insert(billboard_tex_coords.end(), quad_tex_coords, quad_tex_coords + 8);
+
+    glDisable(GL_CULL_FACE);
+    glEnable(GL_BLEND);
+    glEnable( GL_TEXTURE_2D );
+    glEnable(GL_ALPHA_TEST);
+
+    if(render_mode == 1) {
+        glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+        glBindTexture(GL_TEXTURE_2D, textures[0].id);
+        glDepthMask(GL_TRUE);
+        glAlphaFunc(GL_GREATER,0.9);
+    } else {
+        // Additive blending without depth writes
+        glBlendFunc(GL_SRC_ALPHA, GL_ONE);
+        glBindTexture(GL_TEXTURE_2D, textures[1].id);
+        glDepthMask(GL_FALSE);
+        glAlphaFunc(GL_GREATER,0.05);
     }
-    
-    glEnd();
+
+    if(num_vertices > 0) {
+        glEnableClientState(GL_VERTEX_ARRAY);
+        glEnableClientState(GL_COLOR_ARRAY);
+        glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+        glVertexPointer(3, GL_FLOAT, 0, &buffers.billboard_vertices[0]);
+        glColorPointer(4, GL_FLOAT, 0, &buffers.billboard_colors[0]);
+        glTexCoordPointer(2, GL_FLOAT, 0, &billboard_tex_coords[0]);
+        glDrawArrays(GL_QUADS, 0, num_vertices);
+        glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+        glDisableClientState(GL_COLOR_ARRAY);
+        glDisableClientState(GL_VERTEX_ARRAY);
+    }
+
     glDisable(GL_BLEND);
     glEnable(GL_CULL_FACE);
     glDisable(GL_ALPHA_TEST);
@@ -324,126 +253,7 @@ void MDTexture::render_billboards2(MDOpenGL &opengl, vector<int> &visible_atom_i
     glColor4f(1.0,1.0,1.0,1.0);
 }
 
-void MDTexture::prepare_billboards3() {
-    vertices = new float[4*3*MAX_NUM_ATOMS]; // 4 vertices per atom, 3 coordinates per vertex
-    colors   = new float[4*MAX_NUM_ATOMS];   
-    normals  = new float[3*MAX_NUM_ATOMS];
-    indices  = new int  [4*MAX_NUM_ATOMS];
-
-    glGenBuffers(1, &vertices_id);
-    glGenBuffers(1, &indices_id);
-    glGenBuffers(1, &normals_id);
-    glGenBuffers(1, &colors_id);
+void MDTexture::render_billboards(MDOpenGL &opengl, int render_mode, vector<long> &visible_atom_indices, vector<TypeRange> &type_ranges, vector<vector<float> > &positions, vector<float> &ambient_occlusion, bool draw_water, double color_cutoff, double dr2_max, vector<float> system_size, bool periodic_boundary_conditions, double water_dr2_max) {
+    int num_vertices = build_billboards(opengl, render_mode, visible_atom_indices, type_ranges, positions, ambient_occlusion, draw_water, color_cutoff, dr2_max, system_size, periodic_boundary_conditions, water_dr2_max);
+    submit_billboards(render_mode, num_vertices);
 }
-
-void MDTexture::render_billboards3(MDOpenGL &opengl, vector<int> &visible_atom_indices, vector<int> &atom_types, vector<vector<float> > &positions, bool draw_water, double color_cutoff, double dr2_max, vector<float> system_size, bool periodic_boundary_conditions) {
-    Camera *camera = opengl.camera;
-    CVector left, up, right, direction, v0, v1, v2, v3;
-    int S = 1.0;
-    double cam_x = camera->position.x; double cam_y = camera->position.y; double cam_z = camera->position.z;
-    double one_over_color_cutoff = 1.0/color_cutoff;
-    CVector up_on_screen = opengl.coord_to_ray(0,opengl.window_height/2.0);
-    double dx = camera->target.x - cam_x;
-    double dy = camera->target.y - cam_y;
-    double dz = camera->target.z - cam_z;
-    direction = camera->target;
-
-    left = direction.Cross(up_on_screen);
-    up = (direction.Cross(left)).Normalize();
-    right = (direction.Cross(up)).Normalize();
-
-    v0 = (right + up);
-    v1 = (right*-1 + up);
-    v2 = (right*-1 + up*-1);
-    v3 = (right + up*-1);
-    
-    glNormal3f(direction.x, direction.y, direction.z);
-    int num_vertices = 0;
-    int num_atoms = 0;
-
-    for(int n=0; n<positions.size(); n++) {
-        int atom_type = atom_types[n];
-        if( (atom_type == H_TYPE || atom_type == O_TYPE) && !draw_water) continue;
-        double scale = visual_atom_radii[atom_type];
-
-        double real_x = positions[n][0];
-        double real_y = positions[n][1];
-        double real_z = positions[n][2];
-
-        for(int dx = -1; dx <= 1; dx++) {
-            for(int dy = -1; dy <= 1; dy++) {
-                for(int dz = -1; dz <= 1; dz++) {
-                    if(!periodic_boundary_conditions && (dx != 0 || dy != 0 || dz != 0)) continue;
-
-                    double x = real_x + system_size[0]*dx;
-                    double y = real_y + system_size[1]*dy;
-                    double z = real_z + system_size[2]*dz;
-
-                    double delta_x = x - cam_x;
-                    double delta_y = y - cam_y;
-                    double delta_z = z - cam_z;
-
-                    double dr2 = delta_x*delta_x + delta_y*delta_y + delta_z*delta_z;
-                    if(dr2 < 50) continue;
-                    if(dr2 > dr2_max) continue;
-                    
-                    double cam_target_times_dr = delta_x*direction.x + delta_y*direction.y + delta_z*direction.z;
-                    if(cam_target_times_dr < 0) continue;
-
-                    vertices[3*num_vertices + 0] = v0.x*scale + x;
-                    vertices[3*num_vertices + 1] = v0.y*scale + y;
-                    vertices[3*num_vertices + 2] = v0.z*scale + z;
-                    indices[num_vertices] = num_vertices;
-                    num_vertices++;
-
-                    vertices[3*num_vertices + 0] = v1.x*scale + x;
-                    vertices[3*num_vertices + 1] = v1.y*scale + y;
-                    vertices[3*num_vertices + 2] = v1.z*scale + z;
-                    indices[num_vertices] = num_vertices;
-                    num_vertices++;
-
-                    vertices[3*num_vertices + 0] = v2.x*scale + x;
-                    vertices[3*num_vertices + 1] = v2.y*scale + y;
-                    vertices[3*num_vertices + 2] = v2.z*scale + z;
-                    indices[num_vertices] = num_vertices;
-                    num_vertices++;
-
-                    vertices[3*num_vertices + 0] = v3.x*scale + x;
-                    vertices[3*num_vertices + 1] = v3.y*scale + y;
-                    vertices[3*num_vertices + 2] = v3.z*scale + z;
-                    indices[num_vertices] = num_vertices;
-                    num_vertices++;
-
-                    colors[4*num_atoms + 0] = color_list[atom_type][0];
-                    colors[4*num_atoms + 1] = color_list[atom_type][1];
-                    colors[4*num_atoms + 2] = color_list[atom_type][2];
-                    colors[4*num_atoms + 3] = 1.0;
-                    
-                    num_atoms++;
-                }
-            }
-        }
-    }
-    glNormal3f(direction.x, direction.y, direction.z);
-    // glNormalPointer(GL_FLOAT, 6*sizeof(GLfloat), (float*)(3*sizeof(GLfloat)));
-
-    glBindBuffer(GL_ARRAY_BUFFER, vertices_id);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(GLfloat)*3*num_vertices, NULL, GL_DYNAMIC_DRAW);
-    glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(GLfloat)*3*num_vertices, vertices);
-
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indices_id);
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(GLuint)*num_vertices, NULL, GL_STATIC_DRAW);
-    glBufferSubData(GL_ELEMENT_ARRAY_BUFFER, 0, sizeof(GLuint)*num_vertices, indices);
-
-    glEnableClientState(GL_VERTEX_ARRAY);
-    glEnableClientState(GL_COLOR_ARRAY);
-
-    glVertexPointer(3, GL_FLOAT, 3*sizeof(GLfloat), NULL);
-    glColorPointer (4, GL_FLOAT, 4, NULL);
-    
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indices_id);
-    glBindBuffer(GL_ARRAY_BUFFER, vertices_id);
-    glDrawElements(GL_QUADS, num_vertices, GL_UNSIGNED_INT, 0);
-
-    glDisableClientState(GL_VERTEX_ARRAY);
-}
\ No newline at end of file
@@ -1,11 +1,11 @@
 #include <GL/glfw.h>      // Include OpenGL Framework library
 #include <CBitMap.h>
+#include <MDBillboards.h>
 #include <vector>
 using std::vector;
 
 class MDOpenGL;
 class CVector;
-#define MAX_NUM_ATOMS 1000000
 
 // internal texture structure
 class MDOpenGLTexture {
@@ -24,10 +24,10 @@ private:
 	GLuint		indices_id;
 	GLuint		normals_id;
 	GLuint		colors_id;
-	float        *vertices;
-	float        *colors;
 	float        *normals;
-	int          *indices;
+	MDBillboardBuffers buffers;           // Filled by the kernels in MDBillboards.h
+	vector<GLfloat> billboard_tex_coords; // The corners of a quad repeated, grows with the number of billboards
+	GLfloat      billboard_normal[3];
 public:
 	CBitMap bmp;
 	GLuint texture_id;
@@ -38,8 +38,8 @@ public:
 	void create_sphere1(string name, int w);
 	void create_sphere2(string name, int w);
 	void load_texture(CBitMap* bmp, MDOpenGLTexture* texture, bool has_alpha);
-	void render_billboards(MDOpenGL &opengl, vector<int> &visible_atom_indices, vector<int> &atom_types, vector<vector<float> > &positions, bool draw_water, double color_cutoff, double dr2_max, vector<float> system_size, bool periodic_boundary_conditions, double water_dr2_max);
-	void render_billboards2(MDOpenGL &opengl, vector<int> &visible_atom_indices, vector<int> &atom_types, vector<vector<float> > &positions, bool draw_water, double color_cutoff, double dr2_max, vector<float> system_size, bool periodic_boundary_conditions);
-	void render_billboards3(MDOpenGL &opengl, vector<int> &visible_atom_indices, vector<int> &atom_types, vector<vector<float> > &positions, bool draw_water, double color_cutoff, double dr2_max, vector<float> system_size, bool periodic_boundary_conditions);
+	int build_billboards(MDOpenGL &opengl, int render_mode, vector<long> &visible_atom_indices, vector<TypeRange> &type_ranges, vector<vector<float> > &positions, vector<float> &ambient_occlusion, bool draw_water, double color_cutoff, double dr2_max, vector<float> system_size, bool periodic_boundary_conditions, double water_dr2_max);
+	void submit_billboards(int render_mode, int num_vertices);
+	void render_billboards(MDOpenGL &opengl, int render_mode, vector<long> &visible_atom_indices, vector<TypeRange> &type_ranges, vector<vector<float> > &positions, vector<float> &ambient_occlusion, bool draw_water, double color_cutoff, double dr2_max, vector<float> system_size, bool periodic_boundary_conditions, double water_dr2_max);
 	void prepare_billboards3();
 };
\ No newline at end of file
@@ -0,0 +1,341 @@
+#include <MappedTrajectory.h>
+#include <mts0_io.h>
+#include <TaskPool.h>
+#include <TraceRecorder.h>
+#include <iostream>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+using std::ifstream;
+using std::ios;
+using std::cout;
+using std::endl;
+
+#define COPY_CHUNK_SIZE 65536
+
+MappedTrajectory::MappedTrajectory() {
+    readahead = 0;
+    readahead_bytes = 0;
+    flags = 0;
+    file = -1;
+    data = 0;
+    file_size = 0;
+    table_size = 0;
+}
+
+MappedTrajectory::~MappedTrajectory() {
+    close();
+}
+
+bool MappedTrajectory::open(string filename_) {
+    close();
+    filename = filename_;
+    file = ::open(filename.c_str(), O_RDONLY);
+    struct stat file_status;
+    if(file < 0 || fstat(file, &file_status) != 0) {
+        cout << "Error in MappedTrajectory::open(): Failed to open file " << filename << endl;
+        close();
+        return false;
+    }
+    file_size = file_status.st_size;
+
+    // Read-only file pages are never written to swap, under memory pressure they are dropped and read again
+    if(file_size > 0) data = (char*)mmap(0, file_size, PROT_READ, MAP_SHARED, file, 0);
+    if(data == 0 || data == MAP_FAILED) {
+        cout << "Error in MappedTrajectory::open(): Failed to map " << file_size << " bytes of " << filename << endl;
+        data = 0;
+        close();
+        return false;
+    }
+
+    const int header_size = 4 + 3*sizeof(int);
+    int header[3] = {0, 0, 0}; // version, number of timesteps, flags
+    if(file_size >= header_size) memcpy(header, data + 4, sizeof(header));
+    if(file_size < header_size || memcmp(data, "MDTR", 4) != 0) {
+        cout << "Error in MappedTrajectory::open(): " << filename << " is not a mapped trajectory" << endl;
+        close();
+        return false;
+    }
+    if(header[0] != MAPPED_TRAJECTORY_VERSION) {
+        cout << "Error in MappedTrajectory::open(): " << filename << " has version " << header[0] << ", expected " << MAPPED_TRAJECTORY_VERSION << endl;
+        close();
+        return false;
+    }
+    flags = header[2];
+
+    // A timestep past the end of the file would be a SIGBUS when it is copied, so the whole table is checked here
+    bool complete = header[1] >= 0 && header_size + long(header[1])*sizeof(MappedTimestepEntry) <= file_size;
+    if(complete) {
+        entries.resize(header[1]);
+        if(header[1] > 0) memcpy(&entries[0], data + header_size, header[1]*sizeof(MappedTimestepEntry));
+    }
+    for(int i=0; i<entries.size() && complete; i++) {
+        complete = entries[i].num_atoms >= 0 && entries[i].offset >= 0 && entries[i].offset + entries[i].get_size() <= file_size;
+    }
+    if(!complete) {
+        cout << "Error in MappedTrajectory::open(): " << filename << " is truncated" << endl;
+        close();
+        return false;
+    }
+    advised.assign(entries.size(), 0);
+
+    return true;
+}
+
+void MappedTrajectory::close() {
+    if(data) munmap(data, file_size);
+    if(file >= 0) ::close(file);
+    data = 0;
+    file = -1;
+    file_size = 0;
+    flags = 0;
+    entries.clear();
+    advised.clear();
+}
+
+MappedTimestepEntry *MappedTrajectory::get(int timestep_index) {
+    // Binary search, entries are sorted
+    int low = 0, high = entries.size();
+    while(low < high) {
+        int middle = (low + high)/2;
+        if(entries[middle].timestep < timestep_index) low = middle + 1;
+        else high = middle;
+    }
+    if(low < entries.size() && entries[low].timestep == timestep_index) return &entries[low];
+    return 0;
+}
+
+// Applies advice to the pages holding [offset, offset + size)
+static void advise_range(char *data, long offset, long size, int advice) {
+    if(size == 0) return;
+    long page_size = sysconf(_SC_PAGESIZE);
+    long begin = offset - offset % page_size;
+    madvise(data + begin, offset + size - begin, advice);
+}
+
+// Counts the atoms of each chunk that are kept, then copies them to the chunk's offset
+class CopyMappedAtoms {
+public:
+  float *positions;
+  long *atom_ids;
+  int *atom_types;
+  Timestep *timestep;
+  vector<long> *chunk_offsets;
+  long num_atoms;
+  bool counting;
+
+  void operator()(int begin, int end, int worker) {
+    for(int chunk=begin; chunk<end; chunk++) {
+      long first = get_chunk_begin(chunk, COPY_CHUNK_SIZE);
+      long last = get_chunk_end(chunk, COPY_CHUNK_SIZE, num_atoms);
+      long offset = (*chunk_offsets)[chunk];
+      long count = 0;
+      for(long n=first; n<last; n++) {
+        if(timestep->is_skipped(atom_types[n])) continue;
+        if(!counting) {
+          vector<float> &position = timestep->positions[offset + count];
+          position.resize(3);
+          for(int k=0; k<3; k++) position[k] = positions[3*n + k];
+          timestep->atom_ids[offset + count] = atom_ids[n];
+          timestep->atom_types[offset + count] = atom_types[n];
+        }
+        count++;
+      }
+      if(counting) (*chunk_offsets)[chunk] = count;
+    }
+  }
+};
+
+// Replaces the atoms of the timestep with those of the entry, leaving out skipped types. Afterwards the pages of
+// the entry are unmapped from the process, the copy is what is drawn.
+void MappedTrajectory::copy_timestep(MappedTimestepEntry *entry, Timestep *timestep, bool *skip_types) {
+    TraceSpan span("copy_mapped", entry->timestep);
+    timestep->set_skip_types(skip_types);
+    timestep->set_h_matrix(entry->h_matrix);
+
+    long num_atoms = entry->num_atoms;
+    int num_chunks = get_num_chunks(num_atoms, COPY_CHUNK_SIZE);
+    vector<long> chunk_offsets(num_chunks);
+    CopyMappedAtoms copy;
+    copy.atom_ids = (long*)(data + entry->offset);
+    copy.positions = (float*)(copy.atom_ids + num_atoms);
+    copy.atom_types = (int*)(copy.positions + 3*num_atoms);
+    copy.timestep = timestep;
+    copy.chunk_offsets = &chunk_offsets;
+    copy.num_atoms = num_atoms;
+    copy.counting = true;
+    parallel_for(0, num_chunks, 1, copy);
+
+    long num_kept = 0;
+    for(int chunk=0; chunk<num_chunks; chunk++) {
+        long count = chunk_offsets[chunk];
+        chunk_offsets[chunk] = num_kept;
+        num_kept += count;
+    }
+    timestep->positions.resize(num_kept);
+    timestep->atom_ids.resize(num_kept);
+    timestep->atom_types.resize(num_kept);
+    copy.counting = false;
+    parallel_for(0, num_chunks, 1, copy);
+    advise_range(data, entry->offset, entry->get_size(), MADV_DONTNEED);
+}
+
+void MappedTrajectory::release(int entry_index) {
+    MappedTimestepEntry &entry = entries[entry_index];
+    advise_range(data, entry.offset, entry.get_size(), MADV_DONTNEED);
+#ifdef POSIX_FADV_DONTNEED
+    posix_fadvise(file, entry.offset, entry.get_size(), POSIX_FADV_DONTNEED);
+#endif
+    advised[entry_index] = 0;
+}
+
+// Hints the timesteps ahead of the playhead and releases the ones it has left behind. direction is +1 or -1.
+void MappedTrajectory::advise(int timestep_index, int step, int direction) {
+    MappedTimestepEntry *current = get(timestep_index);
+    if(!current) return;
+    vector<char> in_window(entries.size(), 0);
+    in_window[current - &entries[0]] = 1;
+    advised[current - &entries[0]] = 1;
+
+    // Prefetched timesteps may take at most half of the memory that is available without swapping
+    long available = get_available_memory();
+    readahead_bytes = 0;
+    int index = timestep_index;
+    for(int i=0; i<readahead; i++) {
+        MappedTimestepEntry *next = get(index + max(step, 1)*direction);
+        if(!next) {
+            // Playback bounces at the ends like Mts0_io::get_next_timestep
+            direction *= -1;
+            next = get(index + max(step, 1)*direction);
+        }
+        if(!next) break;
+        index = next->timestep;
+        int entry_index = next - &entries[0];
+        if(in_window[entry_index]) continue;
+        if(available >= 0 && readahead_bytes + next->get_size() > available/2) break;
+        if(!advised[entry_index]) advise_range(data, next->offset, next->get_size(), MADV_WILLNEED);
+        advised[entry_index] = 1;
+        in_window[entry_index] = 1;
+        readahead_bytes += next->get_size();
+    }
+
+    for(int entry_index=0; entry_index<entries.size(); entry_index++) {
+        if(advised[entry_index] && !in_window[entry_index]) release(entry_index);
+    }
+}
+
+// Bytes of the timestep that are in memory, so that a copy would not wait for the disk
+long MappedTrajectory::get_resident_bytes(MappedTimestepEntry *entry) {
+    long page_size = sysconf(_SC_PAGESIZE);
+    long begin = entry->offset - entry->offset % page_size;
+    long size = entry->offset + entry->get_size() - begin;
+    if(size == 0) return 0;
+    long num_pages = (size + page_size - 1)/page_size;
+    vector<unsigned char> resident(num_pages);
+#ifdef __APPLE__
+    if(mincore(data + begin, size, (char*)&resident[0]) != 0) return 0;
+#else
+    if(mincore(data + begin, size, &resident[0]) != 0) return 0;
+#endif
+    long num_resident = 0;
+    for(long page=0; page<num_pages; page++) num_resident += resident[page] & 1;
+    return min(num_resident*page_size, entry->get_size());
+}
+
+bool MappedTrajectory::create(string filename_, int num_timesteps, int flags_) {
+    close();
+    filename = filename_;
+    flags = flags_;
+    output.open(filename.c_str(), ios::out | ios::binary);
+    if(!output) {
+        cout << "Error in MappedTrajectory::create(): Failed to open file " << filename << endl;
+        return false;
+    }
+
+    // The table is written by finish(), this reserves its space
+    int header[3] = {MAPPED_TRAJECTORY_VERSION, num_timesteps, flags};
+    output.write("MDTR", 4);
+    output.write(reinterpret_cast<char*>(header), sizeof(header));
+    vector<char> table(num_timesteps*sizeof(MappedTimestepEntry), 0);
+    if(num_timesteps > 0) output.write(&table[0], table.size());
+    table_size = num_timesteps;
+    return bool(output);
+}
+
+bool MappedTrajectory::append(int timestep_index, Timestep *timestep) {
+    if(entries.size() == table_size) {
+        cout << "Error in MappedTrajectory::append(): " << filename << " was created for " << entries.size() << " timesteps" << endl;
+        return false;
+    }
+    MappedTimestepEntry entry;
+    entry.timestep = timestep_index;
+    entry.padding = 0;
+    entry.num_atoms = timestep->get_number_of_atoms();
+    for(int k=0;k<2;k++) {
+        for(int i=0;i<3;i++) {
+            for(int j=0;j<3;j++) entry.h_matrix[9*k + 3*i + j] = timestep->h_matrix[k][i][j];
+        }
+    }
+
+    long position = output.tellp();
+    entry.offset = (position + MAPPED_TRAJECTORY_ALIGNMENT - 1)/MAPPED_TRAJECTORY_ALIGNMENT*MAPPED_TRAJECTORY_ALIGNMENT;
+    vector<char> padding(entry.offset - position, 0);
+    if(padding.size() > 0) output.write(&padding[0], padding.size());
+
+    if(entry.num_atoms > 0) output.write(reinterpret_cast<char*>(&timestep->atom_ids[0]), entry.num_atoms*sizeof(long));
+
+    // Positions in blocks, they are not contiguous in the Timestep
+    vector<float> block;
+    block.reserve(3*COPY_CHUNK_SIZE);
+    for(long n=0; n<entry.num_atoms; n++) {
+        for(int k=0;k<3;k++) block.push_back(timestep->positions[n][k]);
+        if(block.size() == 3*COPY_CHUNK_SIZE || n == entry.num_atoms-1) {
+            output.write(reinterpret_cast<char*>(&block[0]), block.size()*sizeof(float));
+            block.clear();
+        }
+    }
+    if(entry.num_atoms > 0) output.write(reinterpret_cast<char*>(&timestep->atom_types[0]), entry.num_atoms*sizeof(int));
+    if(!output) {
+        cout << "Error in MappedTrajectory::append(): Failed to write timestep " << timestep_index << " to " << filename << endl;
+        return false;
+    }
+    entries.push_back(entry);
+    return true;
+}
+
+bool MappedTrajectory::finish() {
+    int header[3] = {MAPPED_TRAJECTORY_VERSION, int(entries.size()), flags};
+    output.seekp(4);
+    output.write(reinterpret_cast<char*>(header), sizeof(header));
+    if(entries.size() > 0) output.write(reinterpret_cast<char*>(&entries[0]), entries.size()*sizeof(MappedTimestepEntry));
+    output.close();
+    entries.clear();
+    if(output.fail()) {
+        cout << "Error in MappedTrajectory::finish(): Failed to write " << filename << endl;
+        return false;
+    }
+    return true;
+}
+
+long get_process_resident_bytes() {
+    ifstream file("/proc/self/statm");
+    long size = 0, resident = -1;
+    file >> size >> resident;
+    if(!file) return -1;
+    return resident*sysconf(_SC_PAGESIZE);
+}
+
+long get_available_memory() {
+    ifstream file("/proc/meminfo");
+    string name;
+    long value;
+    while(file >> name >> value) {
+        if(name.compare("MemAvailable:") == 0) return 1024*value; // kB
+        file.ignore(1000, '\n');
+    }
+    return -1;
+}
@@ -0,0 +1,85 @@
+/*
+MappedTrajectory.cpp MappedTrajectory.h
+
+Out-of-core playback of trajectories larger than memory. md_convert writes all timesteps of an mts0
+trajectory into one file, as loaded (positions in Ångström, grouped by type and in Morton order if
+morton_order is set). The file is memory mapped read-only, so the operating system pages timesteps in
+when they are copied out and can drop them again under memory pressure, they are clean file pages.
+Once a timestep has been copied its pages are unmapped from the process again, so that the atoms are
+resident once (in the Timestep) and not twice, they stay in the page cache until the memory is needed.
+
+advise() is called with the playhead after every load. The next readahead timesteps in the direction of
+playback get MADV_WILLNEED so that they are read in the background, and timesteps that fall behind the
+playhead are released from the mapping and, where posix_fadvise exists, from the page cache. readahead
+is lowered when MemAvailable could not hold it.
+
+md_convert writes the file with create(), append() per timestep and finish().
+
+Binary layout: the magic "MDTR", then ints version, number of timesteps and flags (MAPPED_*), then one
+MappedTimestepEntry per timestep. Each timestep starts on a page boundary at its offset with num_atoms longs of
+atom ids, num_atoms*3 floats of positions and num_atoms ints of atom types. Version 1 had int atom ids after the
+positions, version 2 had no flags.
+*/
+
+#pragma once
+#include <vector>
+#include <string>
+#include <fstream>
+
+using std::vector;
+using std::string;
+using std::ofstream;
+
+#define MAPPED_TRAJECTORY_VERSION 3
+#define MAPPED_MORTON_ORDER 1             // Flag, the atoms of every timestep are in Morton order
+#define MAPPED_TRAJECTORY_ALIGNMENT 4096
+
+class Timestep;
+
+class MappedTimestepEntry {
+public:
+  int timestep;
+  int padding;
+  long num_atoms;
+  long offset;                            // Bytes from the start of the file
+  float h_matrix[18];                     // Same layout as read_mts(): h_matrix[9*k + 3*i + j]
+
+  long get_size() { return num_atoms*(3*sizeof(float) + sizeof(long) + sizeof(int)); }
+};
+
+class MappedTrajectory {
+public:
+  string filename;
+  vector<MappedTimestepEntry> entries;    // In increasing timestep order
+  int readahead;                          // Timesteps hinted ahead of the playhead
+  long readahead_bytes;                   // Bytes hinted by the last advise()
+  int flags;                              // MAPPED_* flags from the header
+
+  MappedTrajectory();
+  ~MappedTrajectory();
+  bool open(string filename_);
+  void close();
+  MappedTimestepEntry *get(int timestep_index); // 0 if the timestep is not in the file
+  void copy_timestep(MappedTimestepEntry *entry, Timestep *timestep, bool *skip_types);
+  void advise(int timestep_index, int step, int direction);
+  long get_resident_bytes(MappedTimestepEntry *entry);
+
+  bool is_morton_ordered() { return flags & MAPPED_MORTON_ORDER; }
+
+  bool create(string filename_, int num_timesteps, int flags_);
+  bool append(int timestep_index, Timestep *timestep);
+  bool finish();
+
+private:
+  int file;
+  char *data;
+  long file_size;
+  vector<char> advised;                   // Per entry, set while it is hinted or mapped in
+  ofstream output;
+  int table_size;                         // Timesteps that create() made room for
+
+  void release(int entry_index);
+};
+
+long get_process_resident_bytes();        // -1 where /proc/self/statm does not exist
+long get_available_memory();              // MemAvailable from /proc/meminfo, -1 if unknown
@@ -0,0 +1,150 @@
+#include <NodePack.h>
+#include <iostream>
+#include <fstream>
+#include <algorithm>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+using std::ifstream;
+using std::ofstream;
+using std::ios;
+using std::cout;
+using std::endl;
+using std::min;
+
+#define PACK_COPY_BUFFER_SIZE (1 << 20)
+
+static long align_offset(long offset) {
+    return (offset + NODE_PACK_ALIGNMENT - 1)/NODE_PACK_ALIGNMENT*NODE_PACK_ALIGNMENT;
+}
+
+NodePack::NodePack() {
+    file = -1;
+}
+
+NodePack::~NodePack() {
+    close();
+}
+
+bool NodePack::open(string filename_) {
+    close();
+    filename = filename_;
+    file = ::open(filename.c_str(), O_RDONLY);
+    if(file < 0) {
+        if(errno != ENOENT) cout << "Error in NodePack::open(): Failed to open file " << filename << endl;
+        return false;
+    }
+
+    const int header_size = 4 + 2*sizeof(int);
+    char header[header_size];
+    if(pread(file, header, header_size, 0) != header_size || header[0] != 'M' || header[1] != 'D' || header[2] != 'P' || header[3] != 'K') {
+        cout << "Error in NodePack::open(): " << filename << " is not a node pack" << endl;
+        close();
+        return false;
+    }
+    int version = *(int*)(header + 4);
+    int num_nodes = *(int*)(header + 8);
+    if(version != NODE_PACK_VERSION) {
+        cout << "Error in NodePack::open(): " << filename << " has version " << version << ", expected " << NODE_PACK_VERSION << endl;
+        close();
+        return false;
+    }
+
+    struct stat file_status;
+    long directory_size = long(num_nodes)*sizeof(NodePackEntry);
+    bool complete = num_nodes >= 0 && fstat(file, &file_status) == 0;
+    if(complete) {
+        nodes.resize(num_nodes);
+        complete = num_nodes == 0 || pread(file, &nodes[0], directory_size, header_size) == directory_size;
+    }
+    for(int node_id=0; node_id<nodes.size() && complete; node_id++) {
+        complete = nodes[node_id].offset >= 0 && nodes[node_id].size >= 0 && nodes[node_id].offset + nodes[node_id].size <= file_status.st_size;
+    }
+    if(!complete) {
+        cout << "Error in NodePack::open(): " << filename << " is truncated" << endl;
+        close();
+        return false;
+    }
+
+    return true;
+}
+
+void NodePack::close() {
+    if(file >= 0) ::close(file);
+    file = -1;
+    nodes.clear();
+}
+
+string NodePack::get_filename(string mts0_directory) {
+    while(mts0_directory.size() > 1 && mts0_directory[mts0_directory.size()-1] == '/') mts0_directory.erase(mts0_directory.size()-1);
+    return mts0_directory + ".pack";
+}
+
+// Writes to a temporary file that is renamed when complete, so readers never see a partial pack
+bool NodePack::write(string mts0_directory, int num_nodes, string filename_) {
+    const int header_size = 4 + 2*sizeof(int);
+    vector<NodePackEntry> entries(num_nodes);
+    vector<string> node_filenames(num_nodes);
+    long offset = align_offset(header_size + long(num_nodes)*sizeof(NodePackEntry));
+    char node_filename[5000];
+    for(int node_id=0; node_id<num_nodes; node_id++) {
+        sprintf(node_filename, "%s/mt%04d", mts0_directory.c_str(), node_id);
+        node_filenames[node_id] = string(node_filename);
+        struct stat file_status;
+        if(stat(node_filename, &file_status) != 0) {
+            cout << "Error in NodePack::write(): Node file " << node_filename << " is missing" << endl;
+            return false;
+        }
+        entries[node_id].offset = offset;
+        entries[node_id].size = file_status.st_size;
+        offset = align_offset(offset + file_status.st_size);
+    }
+
+    string temporary_filename = filename_ + ".tmp";
+    ofstream output(temporary_filename.c_str(), ios::out | ios::binary);
+    if(!output) {
+        cout << "Error in NodePack::write(): Failed to open file " << temporary_filename << endl;
+        return false;
+    }
+    int header[2] = {NODE_PACK_VERSION, num_nodes};
+    output.write("MDPK", 4);
+    output.write(reinterpret_cast<char*>(header), sizeof(header));
+    if(num_nodes > 0) output.write(reinterpret_cast<char*>(&entries[0]), num_nodes*sizeof(NodePackEntry));
+
+    vector<char> buffer(PACK_COPY_BUFFER_SIZE);
+    vector<char> padding(NODE_PACK_ALIGNMENT, 0);
+    long position = header_size + long(num_nodes)*sizeof(NodePackEntry);
+    for(int node_id=0; node_id<num_nodes && output; node_id++) {
+        output.write(&padding[0], entries[node_id].offset - position);
+        ifstream input(node_filenames[node_id].c_str(), ios::in | ios::binary);
+        long remaining = entries[node_id].size;
+        while(remaining > 0 && input) {
+            input.read(&buffer[0], min(remaining, long(PACK_COPY_BUFFER_SIZE)));
+            output.write(&buffer[0], input.gcount());
+            remaining -= input.gcount();
+        }
+        if(remaining != 0) {
+            cout << "Error in NodePack::write(): Failed to read " << node_filenames[node_id] << endl;
+            output.close();
+            remove(temporary_filename.c_str());
+            return false;
+        }
+        position = entries[node_id].offset + entries[node_id].size;
+    }
+    output.close();
+    if(!output) {
+        cout << "Error in NodePack::write(): Failed to write " << temporary_filename << endl;
+        remove(temporary_filename.c_str());
+        return false;
+    }
+
+    if(rename(temporary_filename.c_str(), filename_.c_str()) != 0) {
+        cout << "Error in NodePack::write(): Failed to rename " << temporary_filename << " to " << filename_ << endl;
+        remove(temporary_filename.c_str());
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,44 @@
+/*
+NodePack.cpp NodePack.h
+
+All node files of one timestep in a single file. A timestep of a large run is hundreds or thousands
+of small mt%04d files, which is slow on filesystems with expensive metadata operations and for
+backups. md_pack writes <timestep>/mts0.pack next to the mts0 directory of every timestep, and
+Timestep::load_nodes() reads a pack instead of the node files when there is one, with a single open
+for the whole timestep. The node files are copied byte for byte, so they are read exactly as before
+and can be restored by copying the byte ranges in the directory back out.
+
+Binary layout: the magic "MDPK", then ints version and number of nodes, then one NodePackEntry per
+node. Each node file starts on a NODE_PACK_ALIGNMENT boundary at its offset.
+*/
+
+#pragma once
+#include <vector>
+#include <string>
+
+using std::vector;
+using std::string;
+
+#define NODE_PACK_VERSION 1
+#define NODE_PACK_ALIGNMENT 4096
+
+class NodePackEntry {
+public:
+  long offset;                          // Bytes from the start of the pack
+  long size;                            // Size of the node file
+};
+
+class NodePack {
+public:
+  string filename;
+  int file;                             // -1 when not open
+  vector<NodePackEntry> nodes;          // Indexed by node id
+
+  NodePack();
+  ~NodePack();
+  bool open(string filename_);          // Quietly false if there is no pack
+  void close();
+
+  static string get_filename(string mts0_directory); // <timestep>/mts0.pack for <timestep>/mts0/
+  static bool write(string mts0_directory, int num_nodes, string filename_);
+};
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <math.h>
+#include <stdio.h>
+#include <algorithm>
+
+// Feedback controller that scales dr2_max, water_dr2_max and color_cutoff down from their ini values
+// when rendering takes longer than the target frame time, and back up when there is time to spare.
+// The number of drawn atoms grows as dr2^1.5, so each adjustment aims for 85% of the target with
+// that cost model. A dead band between 70% and 100% of the target, a settling period after each
+// change and a limit on how fast the quality may rise keep the visibility radius from popping.
+class QualityGovernor
+{
+    public:
+        bool enabled;
+        double max_dr2_max;            // The ini values, the governor never goes above these
+        double max_water_dr2_max;
+        double max_color_cutoff;
+        double min_quality;            // Lowest allowed fraction of the ini values
+        double quality;                // Fraction of the ini values used for the current frame
+
+        double smoothed_frame_time;    // Exponential moving average of the measured render times
+        double lower_band;             // Raise quality below this fraction of the target frame time
+        double upper_band;             // Lower quality above this fraction of the target frame time
+        int settle_frames;             // Frames to wait after a change before measuring again
+        int frames_since_change;
+
+        QualityGovernor()
+        {
+            enabled = false;
+            max_dr2_max = 3500;
+            max_water_dr2_max = 3500;
+            max_color_cutoff = 2000;
+            min_quality = 0.1;
+            quality = 1.0;
+            smoothed_frame_time = 0;
+            lower_band = 0.7;
+            upper_band = 1.0;
+            settle_frames = 10;
+            frames_since_change = 0;
+        }
+
+        void set_limits(double dr2_max_, double water_dr2_max_, double color_cutoff_)
+        {
+            max_dr2_max = dr2_max_;
+            max_water_dr2_max = water_dr2_max_;
+            max_color_cutoff = color_cutoff_;
+        }
+
+        void set_enabled(bool enabled_)
+        {
+            enabled = enabled_;
+            quality = 1.0;
+            smoothed_frame_time = 0;
+            frames_since_change = 0;
+        }
+
+        double get_dr2_max()       { return quality*max_dr2_max; }
+        double get_water_dr2_max() { return quality*max_water_dr2_max; }
+        double get_color_cutoff()  { return quality*max_color_cutoff; }
+
+        // Call once per frame with the time spent depth sorting, building the billboards and drawing them,
+        // where drawing is the longer of the GL submission and the GPU time since the two overlap.
+        // Loading, culling and the fps limiter's sleep do not depend on the quality and are left out.
+        void update(double frame_time, double target_frame_time)
+        {
+            if (!enabled) return;
+            smoothed_frame_time = smoothed_frame_time == 0 ? frame_time : 0.9*smoothed_frame_time + 0.1*frame_time;
+            if (++frames_since_change < settle_frames) return;
+
+            double ratio = smoothed_frame_time/target_frame_time;
+            double new_quality = quality;
+            if (ratio > upper_band) new_quality = quality*std::max(pow(0.85/ratio, 2.0/3), 0.8);
+            else if (ratio < lower_band) new_quality = quality*std::min(pow(0.85/ratio, 2.0/3), 1.05);
+            new_quality = std::min(std::max(new_quality, min_quality), 1.0);
+
+            if (new_quality != quality)
+            {
+                quality = new_quality;
+                frames_since_change = 0;
+            }
+        }
+
+        // One line for the HUD
+        void describe(char *line)
+        {
+            sprintf(line, "quality %3.0f%%  dr2_max %.0f  water %.0f  color %.0f", 100*quality, get_dr2_max(), get_water_dr2_max(), get_color_cutoff());
+        }
+};
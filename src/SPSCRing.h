@@ -0,0 +1,76 @@
+/*
+SPSCRing.h
+
+Bounded lock-free ring buffer for exactly one producer thread and one consumer thread. push() and
+pop() never block and never take a lock: the producer publishes a slot with a release store of
+tail and the consumer frees it with a release store of head, each reading the other index with an
+acquire load. Each side caches the other side's index and only reloads it when the ring looks
+full (or empty), so in steady state a handoff touches one shared cache line per side.
+Capacity is rounded up to a power of two.
+
+  SPSCRing<Frame> ring(8);
+  ring.push(frame);              // producer thread, false if full
+  if(ring.pop(frame)) ...        // consumer thread, false if empty
+*/
+
+#pragma once
+#include <vector>
+
+#define SPSC_CACHE_LINE 64
+
+template<class T>
+class SPSCRing {
+public:
+  unsigned int capacity;
+  unsigned int mask;
+  std::vector<T> slots;
+
+  // Written by the consumer
+  char pad0[SPSC_CACHE_LINE];
+  unsigned int head;
+  unsigned int cached_tail;
+
+  // Written by the producer
+  char pad1[SPSC_CACHE_LINE];
+  unsigned int tail;
+  unsigned int cached_head;
+  char pad2[SPSC_CACHE_LINE];
+
+  SPSCRing(unsigned int min_capacity) {
+    capacity = 1;
+    while(capacity < min_capacity) capacity *= 2;
+    mask = capacity - 1;
+    slots.resize(capacity);
+    head = 0;
+    cached_tail = 0;
+    tail = 0;
+    cached_head = 0;
+  }
+
+  // Producer only
+  bool push(const T &value) {
+    if(tail - cached_head == capacity) {
+      cached_head = __atomic_load_n(&head, __ATOMIC_ACQUIRE);
+      if(tail - cached_head == capacity) return false;
+    }
+    slots[tail & mask] = value;
+    __atomic_store_n(&tail, tail + 1, __ATOMIC_RELEASE);
+    return true;
+  }
+
+  // Consumer only
+  bool pop(T &value) {
+    if(head == cached_tail) {
+      cached_tail = __atomic_load_n(&tail, __ATOMIC_ACQUIRE);
+      if(head == cached_tail) return false;
+    }
+    value = slots[head & mask];
+    __atomic_store_n(&head, head + 1, __ATOMIC_RELEASE);
+    return true;
+  }
+
+  // Approximate when called while the other thread is active
+  unsigned int size() {
+    return __atomic_load_n(&tail, __ATOMIC_ACQUIRE) - __atomic_load_n(&head, __ATOMIC_ACQUIRE);
+  }
+};
@@ -0,0 +1,277 @@
+#include <TaskPool.h>
+#include <TraceRecorder.h>
+#include <iostream>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sched.h>
+#include <algorithm>
+
+using std::cout;
+using std::endl;
+using std::max;
+using std::min;
+
+#define ARENA_BLOCK_SIZE (1 << 20)
+#define ARENA_ALIGNMENT 64
+#define WAIT_SPIN_ROUNDS 64      // Empty rounds a waiting worker yields before it sleeps
+
+TaskPool *TaskPool::pool = 0;
+static __thread int current_worker_index = -1;
+static pthread_mutex_t pool_creation_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+TaskGroup::TaskGroup() {
+    pending = 0;
+}
+
+TaskGroup::~TaskGroup() {
+    if(pending > 0) wait();
+}
+
+void TaskGroup::run(PoolTask *task) {
+    task->group = this;
+    __sync_fetch_and_add(&pending, 1);
+    TaskPool::instance().submit(task);
+}
+
+void TaskGroup::wait() {
+    TaskPool &pool = TaskPool::instance();
+    int worker = TaskPool::current_worker();
+
+    if(worker >= 0) {
+        // A worker waiting for its own subtasks keeps running tasks so the pool never deadlocks. With nothing
+        // to run it yields for a few rounds, since the subtasks often finish soon, and then sleeps.
+        int empty_rounds = 0;
+        while(__sync_fetch_and_add(&pending, 0) > 0) {
+            if(pool.run_one_task(worker)) empty_rounds = 0;
+            else if(++empty_rounds < WAIT_SPIN_ROUNDS) sched_yield();
+            else {
+                pool.wait_for_work(worker, &pending);
+                empty_rounds = 0;
+            }
+        }
+        return;
+    }
+
+    pthread_mutex_lock(&pool.done_mutex);
+    while(__sync_fetch_and_add(&pending, 0) > 0) pthread_cond_wait(&pool.group_done, &pool.done_mutex);
+    pthread_mutex_unlock(&pool.done_mutex);
+}
+
+WorkerArena::WorkerArena() {
+    current_block = -1;
+    used = 0;
+}
+
+WorkerArena::~WorkerArena() {
+    for(int i=0; i<blocks.size(); i++) free(blocks[i]);
+}
+
+void *WorkerArena::allocate(size_t bytes) {
+    bytes = (bytes + ARENA_ALIGNMENT - 1) & ~size_t(ARENA_ALIGNMENT - 1);
+    if(current_block < 0 || used + bytes > block_sizes[current_block]) {
+        // Move on to the next block, replacing it if it is too small for this allocation
+        current_block++;
+        used = 0;
+        if(current_block == blocks.size() || block_sizes[current_block] < bytes) {
+            size_t size = bytes > ARENA_BLOCK_SIZE ? bytes : ARENA_BLOCK_SIZE;
+            void *block = 0;
+            if(posix_memalign(&block, ARENA_ALIGNMENT, size) != 0) {
+                cout << "Error in WorkerArena::allocate(): Out of memory allocating " << size << " bytes" << endl;
+                exit(1);
+            }
+            if(current_block == blocks.size()) {
+                blocks.push_back((char*)block);
+                block_sizes.push_back(size);
+            } else {
+                free(blocks[current_block]);
+                blocks[current_block] = (char*)block;
+                block_sizes[current_block] = size;
+            }
+        }
+    }
+
+    void *memory = blocks[current_block] + used;
+    used += bytes;
+    return memory;
+}
+
+TaskPool::TaskPool(int num_workers_) {
+    num_workers = num_workers_;
+    queued_tasks = 0;
+    sleeping_workers = 0;
+    pthread_mutex_init(&sleep_mutex, 0);
+    pthread_cond_init(&work_available, 0);
+    pthread_mutex_init(&done_mutex, 0);
+    pthread_cond_init(&group_done, 0);
+
+    queues.resize(num_workers + 1);
+    for(int i=0; i<=num_workers; i++) {
+        queues[i] = new WorkerQueue();
+        queues[i]->num_tasks = 0;
+        pthread_mutex_init(&queues[i]->mutex, 0);
+    }
+    arenas.resize(num_workers);
+    for(int worker=0; worker<num_workers; worker++) arenas[worker] = new WorkerArena();
+    stats.resize(num_workers);
+    reset_stats();
+
+    // Published before the workers start, so their instance() calls see the pool without taking pool_creation_mutex
+    pool = this;
+    threads.resize(num_workers);
+    for(int worker=0; worker<num_workers; worker++) {
+        pthread_create(&threads[worker], 0, worker_main, (void*)(long)worker);
+    }
+}
+
+TaskPool &TaskPool::initialize(int num_threads) {
+    pthread_mutex_lock(&pool_creation_mutex);
+    if(!pool) {
+        if(num_threads <= 0) num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+        if(num_threads <= 0) num_threads = 1;
+        new TaskPool(num_threads);
+    }
+    pthread_mutex_unlock(&pool_creation_mutex);
+    return *pool;
+}
+
+TaskPool &TaskPool::instance() {
+    if(pool) return *pool;
+    return initialize(0);
+}
+
+int TaskPool::current_worker() {
+    return current_worker_index;
+}
+
+void *TaskPool::worker_main(void *argument) {
+    TaskPool::instance().run_worker((long)argument);
+    return 0;
+}
+
+void TaskPool::submit(PoolTask *task) {
+    int worker = current_worker_index;
+    WorkerQueue *queue = queues[worker >= 0 ? worker : num_workers];
+    pthread_mutex_lock(&queue->mutex);
+    queue->tasks.push_back(task);
+    __sync_fetch_and_add(&queue->num_tasks, 1);
+    pthread_mutex_unlock(&queue->mutex);
+
+    // Both counters are updated with full barriers, so either the sleeping worker sees the task or we see the sleeper
+    __sync_fetch_and_add(&queued_tasks, 1);
+    if(__sync_fetch_and_add(&sleeping_workers, 0) > 0) {
+        pthread_mutex_lock(&sleep_mutex);
+        pthread_cond_signal(&work_available);
+        pthread_mutex_unlock(&sleep_mutex);
+    }
+}
+
+PoolTask *TaskPool::find_task(int worker) {
+    PoolTask *task = 0;
+
+    // Newest task from our own deque
+    WorkerQueue *queue = queues[worker];
+    pthread_mutex_lock(&queue->mutex);
+    if(queue->tasks.size() > 0) {
+        task = queue->tasks.back();
+        queue->tasks.pop_back();
+        __sync_fetch_and_sub(&queue->num_tasks, 1);
+    }
+    pthread_mutex_unlock(&queue->mutex);
+
+    // Oldest task from the external queue or another worker
+    for(int i=0; i<num_workers && !task; i++) {
+        int victim = (worker + num_workers - i) % (num_workers + 1);
+        if(victim == worker) continue;
+        queue = queues[victim];
+        if(__sync_fetch_and_add(&queue->num_tasks, 0) == 0) continue; // Skip empty queues without taking their lock
+        pthread_mutex_lock(&queue->mutex);
+        if(queue->tasks.size() > 0) {
+            task = queue->tasks.front();
+            queue->tasks.pop_front();
+            __sync_fetch_and_sub(&queue->num_tasks, 1);
+            if(victim != num_workers) stats[worker].tasks_stolen++;
+        }
+        pthread_mutex_unlock(&queue->mutex);
+    }
+
+    if(task) __sync_fetch_and_sub(&queued_tasks, 1);
+    return task;
+}
+
+bool TaskPool::run_one_task(int worker) {
+    PoolTask *task = find_task(worker);
+    if(!task) return false;
+
+    TaskGroup *group = task->group;
+    task->execute(worker);
+    delete task;
+    stats[worker].tasks_executed++;
+
+    // The group may be destroyed by its waiter as soon as pending reaches zero, so it is not touched afterwards.
+    // The waiter is either a thread outside the pool on group_done or a worker sleeping in wait_for_work().
+    if(__sync_sub_and_fetch(&group->pending, 1) == 0) {
+        pthread_mutex_lock(&done_mutex);
+        pthread_cond_broadcast(&group_done);
+        pthread_mutex_unlock(&done_mutex);
+        if(__sync_fetch_and_add(&sleeping_workers, 0) > 0) {
+            pthread_mutex_lock(&sleep_mutex);
+            pthread_cond_broadcast(&work_available);
+            pthread_mutex_unlock(&sleep_mutex);
+        }
+    }
+    return true;
+}
+
+void TaskPool::wait_for_work(int worker, int *pending) {
+    double idle_start = TraceRecorder::now();
+    pthread_mutex_lock(&sleep_mutex);
+    // Both counters are updated with full barriers, so either submit() and run_one_task() see this sleeper
+    // or we see their task or finished group
+    __sync_fetch_and_add(&sleeping_workers, 1);
+    while(__sync_fetch_and_add(&queued_tasks, 0) == 0 && (!pending || __sync_fetch_and_add(pending, 0) > 0)) {
+        pthread_cond_wait(&work_available, &sleep_mutex);
+    }
+    __sync_fetch_and_sub(&sleeping_workers, 1);
+    pthread_mutex_unlock(&sleep_mutex);
+    stats[worker].idle_time += TraceRecorder::now() - idle_start;
+}
+
+// Workers live until the process exits
+void TaskPool::run_worker(int worker) {
+    current_worker_index = worker;
+    TraceRecorder::set_thread_name("pool_worker");
+
+    while(true) {
+        if(!run_one_task(worker)) wait_for_work(worker, 0);
+    }
+}
+
+void TaskPool::reset_stats() {
+    for(int worker=0; worker<num_workers; worker++) {
+        stats[worker].tasks_executed = 0;
+        stats[worker].tasks_stolen = 0;
+        stats[worker].idle_time = 0;
+    }
+    stats_start_time = TraceRecorder::now();
+}
+
+double TaskPool::utilization(int worker) {
+    double elapsed = TraceRecorder::now() - stats_start_time;
+    if(elapsed <= 0) return 0;
+    return max(0.0, 1 - stats[worker].idle_time/elapsed);
+}
+
+void TaskPool::describe(char *line) {
+    double total = 0, lowest = 1, highest = 0;
+    long tasks_executed = 0, tasks_stolen = 0;
+    for(int worker=0; worker<num_workers; worker++) {
+        double busy = utilization(worker);
+        total += busy;
+        lowest = min(lowest, busy);
+        highest = max(highest, busy);
+        tasks_executed += stats[worker].tasks_executed;
+        tasks_stolen += stats[worker].tasks_stolen;
+    }
+    sprintf(line, "Task pool: %d workers %.0f%% busy (%.0f-%.0f%%), %ld tasks, %ld stolen", num_workers, 100*total/num_workers, 100*lowest, 100*highest, tasks_executed, tasks_stolen);
+}
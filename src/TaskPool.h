@@ -0,0 +1,168 @@
+/*
+TaskPool.cpp TaskPool.h
+
+Work-stealing thread pool shared by all parallel stages (loading, culling, ambient occlusion,
+depth sorting, the software renderer and ray tracer, frame encoding). There is one pool per
+process with one worker per core, so stages that run at the same time from different threads
+(render thread, loader thread) share the cores instead of oversubscribing them.
+
+Every worker owns a deque: it pushes and pops new tasks at the back, idle workers steal from the
+front of the other deques. Tasks submitted from threads outside the pool go to a shared queue.
+parallel_for() splits its range in halves, keeping one half and pushing the other, so large
+pieces are stolen first and small ones run where their data is.
+
+  TaskGroup group;
+  group.run(new MyTask());   // PoolTask subclass, deleted by the pool after execute()
+  group.wait();              // Workers help running tasks while waiting and sleep when there are none, other threads sleep
+
+  parallel_for(0, n, 1024, body);  // body(begin, end, worker) on ranges of at most 1024
+
+Each worker has a WorkerArena for scratch memory that only lives inside one task (ArenaScope),
+and statistics on tasks run, tasks stolen and time spent idle.
+*/
+
+#pragma once
+#include <vector>
+#include <deque>
+#include <pthread.h>
+
+using std::vector;
+using std::deque;
+
+class TaskGroup;
+
+class PoolTask {
+public:
+  TaskGroup *group;
+  virtual ~PoolTask() { }
+  virtual void execute(int worker) = 0;
+};
+
+class TaskGroup {
+public:
+  int pending;  // Tasks submitted but not finished
+
+  TaskGroup();
+  ~TaskGroup();
+  void run(PoolTask *task);
+  void wait();
+};
+
+// Bump allocator for per-task scratch memory. Pointers stay valid until the ArenaScope that was open when
+// they were allocated closes. Blocks are never moved; a block past the current one only holds memory of
+// closed scopes, so allocate() may free it and replace it with a larger one.
+class WorkerArena {
+public:
+  vector<char*> blocks;
+  vector<size_t> block_sizes;
+  int current_block;
+  size_t used;
+
+  WorkerArena();
+  ~WorkerArena();
+  void *allocate(size_t bytes);
+};
+
+class ArenaScope {
+public:
+  WorkerArena &arena;
+  int block;
+  size_t used;
+
+  ArenaScope(WorkerArena &arena_) : arena(arena_) {
+    block = arena.current_block;
+    used = arena.used;
+  }
+
+  ~ArenaScope() {
+    arena.current_block = block;
+    arena.used = used;
+  }
+};
+
+// Touched by its own worker only, padded so that workers do not share cache lines
+class WorkerStats {
+public:
+  long tasks_executed;
+  long tasks_stolen;
+  double idle_time;
+  char padding[64];
+};
+
+class WorkerQueue {
+public:
+  pthread_mutex_t mutex;
+  deque<PoolTask*> tasks;
+  int num_tasks;   // tasks.size(), changed under the mutex but read atomically without it
+  char padding[64];
+};
+
+class TaskPool {
+private:
+  static TaskPool *pool;
+  vector<WorkerQueue*> queues;   // One per worker, the last one is for tasks from outside the pool
+  vector<pthread_t> threads;
+  int queued_tasks;              // Tasks in the queues, not yet picked up
+  int sleeping_workers;
+  pthread_mutex_t sleep_mutex;
+  pthread_cond_t work_available;
+
+  TaskPool(int num_workers_);
+  PoolTask *find_task(int worker);
+  void run_worker(int worker);
+  static void *worker_main(void *argument);
+
+public:
+  int num_workers;
+  vector<WorkerArena*> arenas;
+  vector<WorkerStats> stats;
+  double stats_start_time;
+  pthread_mutex_t done_mutex;    // Signalled when a task group finishes
+  pthread_cond_t group_done;
+
+  // Creates the pool, 0 threads means one per core. Later calls and instance() reuse the same pool.
+  static TaskPool &initialize(int num_threads);
+  static TaskPool &instance();
+  static int current_worker();   // -1 on threads that are not pool workers
+
+  void submit(PoolTask *task);
+  bool run_one_task(int worker);
+  void wait_for_work(int worker, int *pending); // Sleeps until a task is queued or *pending is 0 (pending may be 0)
+  WorkerArena &arena(int worker) { return *arenas[worker]; }
+  void reset_stats();
+  double utilization(int worker); // Fraction of the time since reset_stats() spent running tasks
+  void describe(char *line);      // One line summary of the statistics for the HUD
+};
+
+template<class Body>
+class ParallelForTask : public PoolTask {
+public:
+  Body *body;
+  int begin, end, grain;
+
+  ParallelForTask(Body *body_, int begin_, int end_, int grain_) {
+    body = body_;
+    begin = begin_;
+    end = end_;
+    grain = grain_;
+  }
+
+  void execute(int worker) {
+    // Hand out the upper halves for other workers to steal and keep the lower half
+    while(end - begin > grain) {
+      int middle = begin + (end - begin)/2;
+      group->run(new ParallelForTask<Body>(body, middle, end, grain));
+      end = middle;
+    }
+    (*body)(begin, end, worker);
+  }
+};
+
+// Calls body(begin, end, worker) on pieces of [begin, end) of at most grain elements and returns when all are done
+template<class Body>
+void parallel_for(int begin, int end, int grain, Body &body) {
+  if(end <= begin) return;
+  TaskGroup group;
+  group.run(new ParallelForTask<Body>(&body, begin, end, grain > 0 ? grain : 1));
+  group.wait();
+}
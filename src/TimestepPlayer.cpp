@@ -0,0 +1,346 @@
+#include <TimestepPlayer.h>
+#include <TraceRecorder.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <omp.h>
+
+#define CLOCK_TICK_MICROSECONDS 2000
+#define LOADER_WAKEUP_MICROSECONDS 10000 // The loader also wakes up this often to delete recycled timesteps
+#define READY_FRAMES_CAPACITY 4
+#define RECYCLED_TIMESTEPS_CAPACITY 16
+
+static void *clock_thread_main(void *player) {
+    ((TimestepPlayer*)player)->run_clock();
+    return 0;
+}
+
+static void *loader_thread_main(void *player) {
+    ((TimestepPlayer*)player)->run_loader();
+    return 0;
+}
+
+TimestepPlayer::TimestepPlayer(Mts0_io *mts0_io_, double dt_, double ps_per_second_, long max_num_atoms_, float dr2_max_) : ready_frames(READY_FRAMES_CAPACITY), recycled_timesteps(RECYCLED_TIMESTEPS_CAPACITY) {
+    mts0_io = mts0_io_;
+    dt = dt_;
+    ps_per_second = ps_per_second_;
+    max_num_atoms = max_num_atoms_;
+    dr2_max = dr2_max_;
+    paused = true;
+    time_direction = 1;
+    simulation_time = 0;
+    requested_timestep = 0;
+    loaded_timestep = 0;
+    loading = false;
+    streaming = false;
+    displayed_timestep = 0;
+    num_loaded = 0;
+    num_skipped = 0;
+    num_dropped = 0;
+    load_time = 0;
+    resident_bytes = -1;
+    mapped_resident_fraction = 0;
+    skip_hidden_water = mts0_io->skip_hidden_water;
+    current_timestep = 0;
+    published_timestep = 0;
+    published_index = 0;
+    spare_timestep = 0;
+    streamed_from_timestep = 0;
+    cam_x = 0; cam_y = 0; cam_z = 0;
+    running = false;
+    pthread_mutex_init(&mutex, 0);
+    pthread_cond_init(&request_changed, 0);
+}
+
+TimestepPlayer::~TimestepPlayer() {
+    if(running) stop();
+    pthread_mutex_destroy(&mutex);
+    pthread_cond_destroy(&request_changed);
+}
+
+// Loads the first timestep on the calling thread so that there is always something to draw, then starts the threads
+void TimestepPlayer::start(float cam_x_, float cam_y_, float cam_z_) {
+    set_camera(cam_x_, cam_y_, cam_z_);
+    current_timestep = mts0_io->get_timestep(0, cam_x, cam_y, cam_z, max_num_atoms, dr2_max);
+    load_time = mts0_io->load_time;
+    resident_bytes = mts0_io->resident_bytes;
+    mapped_resident_fraction = mts0_io->mapped_resident_fraction;
+    num_loaded = 1;
+    published_timestep = current_timestep;
+    published_index = 0;
+
+    running = true;
+    pthread_create(&clock_thread, 0, clock_thread_main, this);
+    pthread_create(&loader_thread, 0, loader_thread_main, this);
+}
+
+void TimestepPlayer::stop() {
+    pthread_mutex_lock(&mutex);
+    running = false;
+    pthread_cond_broadcast(&request_changed);
+    pthread_mutex_unlock(&mutex);
+    pthread_join(clock_thread, 0);
+    pthread_join(loader_thread, 0);
+
+    // Both threads are gone, so this thread may act as producer and consumer of both rings
+    TimestepFrame frame;
+    while(ready_frames.pop(frame)) pending_recycle.push_back(frame.timestep);
+    if(current_timestep) pending_recycle.push_back(current_timestep);
+    streamed_from_timestep = 0;
+    release_recycled_timesteps();
+    for(int i=0; i<pending_recycle.size(); i++) mts0_io->release_timestep(pending_recycle[i]);
+    pending_recycle.clear();
+    current_timestep = 0;
+    if(spare_timestep) mts0_io->release_timestep(spare_timestep);
+    spare_timestep = 0;
+}
+
+// Called by the render thread every frame, takes no locks
+Timestep *TimestepPlayer::get_newest_timestep() {
+    TimestepFrame frame;
+    int num_popped = 0;
+    while(ready_frames.pop(frame)) {
+        pending_recycle.push_back(current_timestep);
+        current_timestep = frame.timestep;
+        displayed_timestep = frame.index;
+        load_time = frame.load_time;
+        resident_bytes = frame.resident_bytes;
+        mapped_resident_fraction = frame.mapped_resident_fraction;
+        num_popped++;
+    }
+    if(num_popped > 1) num_dropped += num_popped - 1;
+
+    while(pending_recycle.size() > 0 && recycled_timesteps.push(pending_recycle.back())) pending_recycle.pop_back();
+
+    return current_timestep;
+}
+
+// Loader thread (the consumer of recycled_timesteps). The timestep a streamed one was copied from is kept as
+// the next spare, it only lacks the region appended since.
+void TimestepPlayer::release_recycled_timesteps() {
+    Timestep *timestep;
+    while(recycled_timesteps.pop(timestep)) {
+        if(timestep == streamed_from_timestep && !spare_timestep) {
+            timestep->append_copy(*published_timestep);
+            spare_timestep = timestep;
+            streamed_from_timestep = 0;
+        } else mts0_io->release_timestep(timestep);
+    }
+}
+
+void TimestepPlayer::set_camera(float cam_x_, float cam_y_, float cam_z_) {
+    pthread_mutex_lock(&mutex);
+    cam_x = cam_x_;
+    cam_y = cam_y_;
+    cam_z = cam_z_;
+    pthread_mutex_unlock(&mutex);
+}
+
+void TimestepPlayer::set_paused(bool paused_) {
+    pthread_mutex_lock(&mutex);
+    paused = paused_;
+    pthread_mutex_unlock(&mutex);
+}
+
+void TimestepPlayer::reverse() {
+    pthread_mutex_lock(&mutex);
+    time_direction *= -1;
+    pthread_mutex_unlock(&mutex);
+}
+
+void TimestepPlayer::scale_speed(double factor) {
+    pthread_mutex_lock(&mutex);
+    ps_per_second *= factor;
+    pthread_mutex_unlock(&mutex);
+}
+
+// True while playing, while a requested timestep has not reached the render thread yet or while nodes near the
+// camera are being streamed. Called by the render thread to decide whether it may sleep until the next input event.
+bool TimestepPlayer::is_busy() {
+    pthread_mutex_lock(&mutex);
+    bool busy = !paused || loading || streaming || requested_timestep != loaded_timestep;
+    pthread_mutex_unlock(&mutex);
+    // The loader pushes before it clears loading under the mutex, so a finished load is seen here
+    return busy || ready_frames.size() > 0;
+}
+
+// Loads the requested timestep again, for when the displayed one was read with a different type filter
+void TimestepPlayer::reload() {
+    pthread_mutex_lock(&mutex);
+    loaded_timestep = -1;
+    pthread_cond_signal(&request_changed);
+    pthread_mutex_unlock(&mutex);
+}
+
+void TimestepPlayer::set_step(int step) {
+    pthread_mutex_lock(&mutex);
+    mts0_io->step = step;
+    pthread_mutex_unlock(&mutex);
+}
+
+// Takes effect with the next timestep the loader thread starts on
+void TimestepPlayer::set_skip_hidden_water(bool skip_hidden_water_) {
+    pthread_mutex_lock(&mutex);
+    skip_hidden_water = skip_hidden_water_;
+    pthread_mutex_unlock(&mutex);
+}
+
+// Mts0_io::is_missing_types() with the setting of the next load
+bool TimestepPlayer::is_missing_types(Timestep *timestep) {
+    pthread_mutex_lock(&mutex);
+    bool skip_water = skip_hidden_water;
+    pthread_mutex_unlock(&mutex);
+    return mts0_io->is_missing_types(timestep, skip_water);
+}
+
+// For the window title
+void TimestepPlayer::get_clock(double &simulation_time_, double &ps_per_second_, int &num_skipped_) {
+    pthread_mutex_lock(&mutex);
+    simulation_time_ = simulation_time;
+    ps_per_second_ = ps_per_second;
+    num_skipped_ = num_skipped;
+    pthread_mutex_unlock(&mutex);
+}
+
+void TimestepPlayer::run_clock() {
+    TraceRecorder::set_thread_name("clock");
+    int max_timestep = mts0_io->get_max_timestep();
+    double max_time = max_timestep*dt/1000;
+    double last_time = omp_get_wtime();
+
+    while(true) {
+        usleep(CLOCK_TICK_MICROSECONDS);
+        double now = omp_get_wtime();
+        double elapsed = now - last_time;
+        last_time = now;
+
+        pthread_mutex_lock(&mutex);
+        if(!running) {
+            pthread_mutex_unlock(&mutex);
+            break;
+        }
+
+        if(!paused) {
+            simulation_time += time_direction*ps_per_second*elapsed;
+            // Bounce at both ends like Mts0_io::get_next_timestep
+            if(simulation_time > max_time) {
+                simulation_time = max(2*max_time - simulation_time, 0.0);
+                time_direction = -1;
+            }
+            if(simulation_time < 0) {
+                simulation_time = min(-simulation_time, max_time);
+                time_direction = 1;
+            }
+        }
+
+        // Nearest timestep that exists on disk
+        int step = max(mts0_io->step, 1);
+        int timestep = step*int(simulation_time*1000/dt/step + 0.5);
+        timestep = min(timestep, step*(max_timestep/step));
+        if(timestep != requested_timestep) {
+            if(requested_timestep != loaded_timestep) num_skipped++; // The previous request was never started
+            requested_timestep = timestep;
+            pthread_cond_signal(&request_changed);
+        }
+        pthread_mutex_unlock(&mutex);
+    }
+}
+
+// Loader thread. Hands a loaded timestep to the render thread, false if the player stopped first.
+bool TimestepPlayer::publish(TimestepFrame &frame) {
+    // The render thread empties the ring every frame, so it is only full if rendering stalls
+    bool published;
+    while(!(published = ready_frames.push(frame))) {
+        pthread_mutex_lock(&mutex);
+        bool still_running = running;
+        pthread_mutex_unlock(&mutex);
+        if(!still_running) break;
+        release_recycled_timesteps();
+        usleep(1000);
+    }
+    if(published) {
+        if(frame.timestep != spare_timestep) {
+            // A new load, the copies of the previous timestep are of no use anymore
+            if(spare_timestep) mts0_io->release_timestep(spare_timestep);
+            spare_timestep = 0;
+            streamed_from_timestep = 0;
+        } else streamed_from_timestep = published_timestep;
+        published_timestep = frame.timestep;
+        published_index = frame.index;
+    } else mts0_io->release_timestep(frame.timestep);
+    if(frame.timestep == spare_timestep) spare_timestep = 0;
+    release_recycled_timesteps();
+    return published;
+}
+
+// Loader thread. The published timestep is not recycled before a newer one is published, and the render
+// thread does not change its atoms, so it can be read here while it is drawn. The region is streamed into the
+// spare copy, which is made once per loaded timestep. While the previous copy is still drawn this waits for it.
+void TimestepPlayer::stream_region() {
+    pthread_mutex_lock(&mutex);
+    float x = cam_x, y = cam_y, z = cam_z;
+    pthread_mutex_unlock(&mutex);
+
+    vector<int> missing_node_ids;
+    mts0_io->find_missing_nodes(published_timestep, x, y, z, dr2_max, missing_node_ids);
+    // Cleared only after the last region has been pushed, so is_busy() sees it in ready_frames
+    pthread_mutex_lock(&mutex);
+    streaming = missing_node_ids.size() > 0;
+    pthread_mutex_unlock(&mutex);
+    if(missing_node_ids.size() == 0) return;
+    if(!spare_timestep) {
+        if(streamed_from_timestep) return;
+        spare_timestep = new Timestep(*published_timestep);
+    }
+
+    TimestepFrame frame;
+    frame.timestep = spare_timestep;
+    if(!mts0_io->stream_region(frame.timestep, x, y, z, max_num_atoms, dr2_max)) return;
+    frame.index = published_index;
+    frame.load_time = mts0_io->load_time;
+    frame.resident_bytes = mts0_io->resident_bytes;
+    frame.mapped_resident_fraction = mts0_io->mapped_resident_fraction;
+    publish(frame);
+}
+
+void TimestepPlayer::run_loader() {
+    TraceRecorder::set_thread_name("loader");
+
+    pthread_mutex_lock(&mutex);
+    while(true) {
+        while(running && requested_timestep == loaded_timestep) {
+            struct timeval now;
+            gettimeofday(&now, 0);
+            long microseconds = now.tv_usec + LOADER_WAKEUP_MICROSECONDS;
+            struct timespec timeout;
+            timeout.tv_sec = now.tv_sec + microseconds/1000000;
+            timeout.tv_nsec = 1000*(microseconds % 1000000);
+            pthread_cond_timedwait(&request_changed, &mutex, &timeout);
+
+            pthread_mutex_unlock(&mutex);
+            release_recycled_timesteps();
+            if(mts0_io->region_of_interest) stream_region();
+            pthread_mutex_lock(&mutex);
+        }
+        if(!running) break;
+
+        int timestep_index = requested_timestep;
+        loaded_timestep = requested_timestep;
+        loading = true;
+        mts0_io->skip_hidden_water = skip_hidden_water;
+        float x = cam_x, y = cam_y, z = cam_z;
+        pthread_mutex_unlock(&mutex);
+
+        TimestepFrame frame;
+        frame.timestep = mts0_io->get_timestep(timestep_index, x, y, z, max_num_atoms, dr2_max);
+        frame.index = timestep_index;
+        frame.load_time = mts0_io->load_time;
+        frame.resident_bytes = mts0_io->resident_bytes;
+        frame.mapped_resident_fraction = mts0_io->mapped_resident_fraction;
+        publish(frame);
+
+        pthread_mutex_lock(&mutex);
+        num_loaded++;
+        loading = false;
+    }
+    pthread_mutex_unlock(&mutex);
+}
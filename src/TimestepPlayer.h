@@ -0,0 +1,100 @@
+/*
+TimestepPlayer.cpp TimestepPlayer.h
+
+Plays back a trajectory in simulated time, independent of the render frame rate. Three threads
+cooperate:
+  clock thread  - advances the simulation time at ps_per_second (bouncing at the first and last
+                  timestep) and publishes the timestep that should be shown now
+  loader thread - loads the newest requested timestep through Mts0_io (reading, ambient occlusion,
+                  culling) and publishes it; requests that arrive while loading are coalesced, so
+                  slow I/O drops timesteps instead of slowing down the clock. While idle it
+                  also reads the nodes a region of interest timestep is missing near the camera
+                  (Mts0_io::stream_region) into a second copy of it and publishes that like a new
+                  load. The copy it replaced comes back through the recycled ring, takes over the
+                  appended atoms and is extended next, so neither copy is made again per region
+  render thread - calls get_newest_timestep() every frame, which pops loaded timesteps from a
+                  lock-free ring and never takes a lock or waits for the disk
+While the threads run, the state they share with the render thread (the clock, the counters and
+the mts0_io settings step and skip_hidden_water) is only touched under the mutex, through the
+methods below. Timesteps the render thread is done with, including loaded ones that were superseded before
+they were shown, go back to the loader thread through a second ring and are deleted there.
+*/
+
+#pragma once
+#include <vector>
+#include <pthread.h>
+#include <mts0_io.h>
+#include <SPSCRing.h>
+
+using std::vector;
+
+class TimestepFrame {
+public:
+  Timestep *timestep;
+  int index;
+  double load_time;
+  long resident_bytes;
+  double mapped_resident_fraction;
+};
+
+class TimestepPlayer {
+public:
+  Mts0_io *mts0_io;
+  double dt;                   // Femtoseconds per timestep index (ini value dt)
+  double ps_per_second;        // Playback speed
+  bool paused;
+  int time_direction;
+  double simulation_time;      // Picoseconds
+  int requested_timestep;      // Written by the clock thread
+  int loaded_timestep;         // Last timestep the loader thread started on
+  bool loading;                // The loader thread is between taking a request and publishing it
+  bool streaming;              // The loader thread found nodes missing near the camera and has not read them all yet
+  int displayed_timestep;      // Timestep returned by the last get_newest_timestep()
+  int num_loaded;              // Written by the loader thread
+  int num_skipped;             // Requested timesteps that were never loaded because a newer one was requested
+  int num_dropped;             // Loaded timesteps that were superseded before the render thread showed them
+  double load_time;            // Seconds spent loading the displayed timestep
+  long resident_bytes;         // Mts0_io::resident_bytes after loading the displayed timestep
+  double mapped_resident_fraction;
+  bool skip_hidden_water;      // Copied to mts0_io->skip_hidden_water by the loader thread when it takes a request
+
+  SPSCRing<TimestepFrame> ready_frames;      // Loader thread -> render thread
+  SPSCRing<Timestep*> recycled_timesteps;    // Render thread -> loader thread
+  Timestep *current_timestep;                // Owned by the render thread
+  Timestep *published_timestep;              // Loader thread, the newest timestep pushed to ready_frames
+  int published_index;
+  Timestep *spare_timestep;                  // Loader thread, a copy of published_timestep to stream the next region into, or 0
+  Timestep *streamed_from_timestep;          // Loader thread, the timestep the last streamed one was copied from, until it is recycled
+  vector<Timestep*> pending_recycle;         // Render thread, waiting for room in recycled_timesteps
+
+  float cam_x, cam_y, cam_z;   // Camera position used for culling new timesteps
+  long max_num_atoms;
+  float dr2_max;
+
+  bool running;
+  pthread_mutex_t mutex;
+  pthread_cond_t request_changed;
+  pthread_t clock_thread;
+  pthread_t loader_thread;
+
+  TimestepPlayer(Mts0_io *mts0_io_, double dt_, double ps_per_second_, long max_num_atoms_, float dr2_max_);
+  ~TimestepPlayer();
+  void start(float cam_x_, float cam_y_, float cam_z_);
+  void stop();
+  Timestep *get_newest_timestep();
+  void set_camera(float cam_x_, float cam_y_, float cam_z_);
+  void set_paused(bool paused_);
+  void reverse();
+  void scale_speed(double factor);
+  bool is_busy();
+  void reload();
+  void set_step(int step);
+  void set_skip_hidden_water(bool skip_hidden_water_);
+  bool is_missing_types(Timestep *timestep);
+  void get_clock(double &simulation_time_, double &ps_per_second_, int &num_skipped_);
+  void run_clock();
+  void run_loader();
+  bool publish(TimestepFrame &frame);
+  void stream_region();
+  void release_recycled_timesteps();
+};
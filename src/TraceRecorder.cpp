@@ -0,0 +1,107 @@
+#include <TraceRecorder.h>
+#include <fstream>
+#include <iostream>
+#include <omp.h>
+
+using std::ofstream;
+using std::cout;
+using std::endl;
+
+bool TraceRecorder::enabled = false;
+
+static TraceBuffer *trace_buffers = 0; // Lock-free list of all thread buffers
+static int num_trace_buffers = 0;
+static double trace_start_time = omp_get_wtime();
+static __thread TraceBuffer *thread_buffer = 0;
+
+static TraceBuffer *get_thread_buffer() {
+    if(thread_buffer) return thread_buffer;
+
+    TraceBuffer *buffer = new TraceBuffer();
+    buffer->thread_id = __sync_fetch_and_add(&num_trace_buffers, 1);
+    buffer->thread_name = 0;
+    buffer->first_chunk = 0; // Allocated with the first event, threads that only name themselves need none
+    buffer->last_chunk = 0;
+
+    // Push onto the global list
+    do {
+        buffer->next = __atomic_load_n(&trace_buffers, __ATOMIC_RELAXED);
+    } while(!__sync_bool_compare_and_swap(&trace_buffers, buffer->next, buffer));
+
+    thread_buffer = buffer;
+    return buffer;
+}
+
+double TraceRecorder::now() {
+    return omp_get_wtime();
+}
+
+void TraceRecorder::record(const char *name, int arg, double start, double end) {
+    TraceBuffer *buffer = get_thread_buffer();
+    TraceChunk *chunk = buffer->last_chunk;
+    if(chunk == 0 || chunk->count == TRACE_CHUNK_SIZE) {
+        TraceChunk *new_chunk = new TraceChunk();
+        new_chunk->count = 0;
+        new_chunk->next = 0;
+        // Release: the new chunk is initialized before write_json can reach it
+        __atomic_store_n(chunk ? &chunk->next : &buffer->first_chunk, new_chunk, __ATOMIC_RELEASE);
+        buffer->last_chunk = new_chunk;
+        chunk = new_chunk;
+    }
+
+    TraceEvent &event = chunk->events[chunk->count];
+    event.name = name;
+    event.arg = arg;
+    event.start = start;
+    event.end = end;
+    // Release: publish the event only after it is written, so write_json can run while other threads record
+    __atomic_store_n(&chunk->count, chunk->count + 1, __ATOMIC_RELEASE);
+}
+
+void TraceRecorder::set_thread_name(const char *name) {
+    __atomic_store_n(&get_thread_buffer()->thread_name, name, __ATOMIC_RELEASE);
+}
+
+void TraceRecorder::write_json(string filename) {
+    ofstream file(filename.c_str());
+    if(!file) {
+        cout << "Error in TraceRecorder::write_json(): Failed to open file " << filename << endl;
+        return;
+    }
+
+    file.precision(15);
+    file << "{\"traceEvents\":[\n";
+    bool first_event = true;
+    int num_events = 0;
+
+    // Fields the recording threads may be writing are read with acquire loads
+    TraceBuffer *first_buffer = __atomic_load_n(&trace_buffers, __ATOMIC_ACQUIRE);
+    for(TraceBuffer *buffer = first_buffer; buffer != 0; buffer = buffer->next) {
+        const char *thread_name = __atomic_load_n(&buffer->thread_name, __ATOMIC_ACQUIRE);
+        if(thread_name) {
+            file << (first_event ? "" : ",\n") << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << buffer->thread_id << ",\"args\":{\"name\":\"" << thread_name << "\"}}";
+            first_event = false;
+        }
+
+        // Every chunk carries its own count, so a chunk that is being filled or linked while this runs
+        // is read up to the last complete event
+        TraceChunk *chunk = __atomic_load_n(&buffer->first_chunk, __ATOMIC_ACQUIRE);
+        while(chunk != 0) {
+            int count = __atomic_load_n(&chunk->count, __ATOMIC_ACQUIRE); // The events below count are complete
+            for(int i=0; i<count; i++) {
+                TraceEvent &event = chunk->events[i];
+                file << (first_event ? "" : ",\n") << "{\"name\":\"" << event.name << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << buffer->thread_id;
+                file << ",\"ts\":" << 1e6*(event.start - trace_start_time) << ",\"dur\":" << 1e6*(event.end - event.start);
+                if(event.arg >= 0) file << ",\"args\":{\"arg\":" << event.arg << "}";
+                file << "}";
+                first_event = false;
+                num_events++;
+            }
+            chunk = __atomic_load_n(&chunk->next, __ATOMIC_ACQUIRE);
+        }
+    }
+
+    file << "\n]}\n";
+    file.close();
+    cout << "Wrote " << num_events << " trace events to " << filename << endl;
+}
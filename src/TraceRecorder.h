@@ -0,0 +1,70 @@
+/*
+TraceRecorder.cpp TraceRecorder.h
+
+Records named time spans from any thread and writes them as Chrome trace event JSON
+(open in chrome://tracing or ui.perfetto.dev). Every thread appends to its own buffer, so
+recording takes no locks; buffers are registered once per thread with a compare-and-swap.
+When tracing is disabled a TraceSpan costs one branch.
+
+  TraceSpan span("read_mts", node_id);  // recorded from here to the end of the scope
+*/
+
+#pragma once
+#include <string>
+
+using std::string;
+
+#define TRACE_CHUNK_SIZE 65536
+
+class TraceEvent {
+public:
+  const char *name; // Must point to a string literal
+  int arg;          // Optional argument shown in the trace, -1 if unused
+  double start, end;
+};
+
+class TraceChunk {
+public:
+  TraceEvent events[TRACE_CHUNK_SIZE];
+  int count;        // Events written, raised only after the event is complete
+  TraceChunk *next; // Set only after this chunk is full and the new one is initialized
+};
+
+// Owned and written by a single thread
+class TraceBuffer {
+public:
+  int thread_id;
+  const char *thread_name;
+  TraceChunk *first_chunk; // 0 until the first event is recorded
+  TraceChunk *last_chunk;
+  TraceBuffer *next;
+};
+
+class TraceRecorder {
+public:
+  static bool enabled;
+
+  static void record(const char *name, int arg, double start, double end);
+  static void set_thread_name(const char *name);
+  static void write_json(string filename);
+  static double now();
+};
+
+class TraceSpan {
+public:
+  const char *name;
+  int arg;
+  bool recording; // Tracing was enabled when the span started
+  double start;
+
+  TraceSpan(const char *name_, int arg_ = -1) {
+    name = name_;
+    arg = arg_;
+    recording = TraceRecorder::enabled;
+    start = recording ? TraceRecorder::now() : 0;
+  }
+
+  ~TraceSpan() {
+    if(recording) TraceRecorder::record(name, arg, start, TraceRecorder::now());
+  }
+};
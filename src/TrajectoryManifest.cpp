@@ -0,0 +1,271 @@
+#include <TrajectoryManifest.h>
+#include <mts0_io.h>
+#include <TaskPool.h>
+#include <NodePack.h>
+#include <fstream>
+#include <iostream>
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+using std::ifstream;
+using std::ofstream;
+using std::ios;
+using std::cout;
+using std::endl;
+
+static const char *type_names[MANIFEST_NUM_TYPES] = {"Si", "A", "H", "O", "Na", "Cl", "X"};
+
+long TimestepManifest::get_number_of_atoms() {
+    long num_atoms = 0;
+    for(int i=0; i<nodes.size(); i++) num_atoms += nodes[i].num_atoms;
+    return num_atoms;
+}
+
+long TimestepManifest::get_file_size() {
+    long file_size = 0;
+    for(int i=0; i<nodes.size(); i++) file_size += nodes[i].file_size;
+    return file_size;
+}
+
+long TimestepManifest::get_atom_count(int node_id, bool *skip_types) {
+    NodeManifest &node = nodes[node_id];
+    long num_atoms = node.num_atoms;
+    for(int type=1; type<=MANIFEST_NUM_TYPES; type++) {
+        if(skip_types[type]) num_atoms -= node.type_counts[type-1];
+    }
+    return num_atoms;
+}
+
+// Index of the first atom of each node when the nodes are stored one after the other from first_atom.
+// Returns the index after the last node.
+long TimestepManifest::get_node_offsets(vector<int> &node_ids, bool *skip_types, long first_atom, vector<long> &node_offsets) {
+    node_offsets.resize(node_ids.size());
+    long num_atoms = first_atom;
+    for(int i=0; i<node_ids.size(); i++) {
+        node_offsets[i] = num_atoms;
+        num_atoms += get_atom_count(node_ids[i], skip_types);
+    }
+    return num_atoms;
+}
+
+// Counts are stored as 64 bit ints whatever the size of long
+static void write_count(ofstream &file, long value) {
+    int64_t field = value;
+    file.write(reinterpret_cast<char*>(&field), sizeof(field));
+}
+
+static long read_count(ifstream &file) {
+    int64_t field = 0;
+    file.read(reinterpret_cast<char*>(&field), sizeof(field));
+    return field;
+}
+
+static void write_node(ofstream &file, NodeManifest &node) {
+    write_count(file, node.num_atoms);
+    write_count(file, node.file_size);
+    file.write(reinterpret_cast<char*>(node.bounds_min), sizeof(node.bounds_min));
+    file.write(reinterpret_cast<char*>(node.bounds_max), sizeof(node.bounds_max));
+    for(int type=0; type<MANIFEST_NUM_TYPES; type++) write_count(file, node.type_counts[type]);
+}
+
+static void read_node(ifstream &file, NodeManifest &node) {
+    node.num_atoms = read_count(file);
+    node.file_size = read_count(file);
+    file.read(reinterpret_cast<char*>(node.bounds_min), sizeof(node.bounds_min));
+    file.read(reinterpret_cast<char*>(node.bounds_max), sizeof(node.bounds_max));
+    for(int type=0; type<MANIFEST_NUM_TYPES; type++) node.type_counts[type] = read_count(file);
+}
+
+TrajectoryManifest::TrajectoryManifest() {
+    nx = 0;
+    ny = 0;
+    nz = 0;
+}
+
+bool TrajectoryManifest::load(string filename) {
+    ifstream file(filename.c_str(), ios::in | ios::binary);
+    char magic[4];
+    int32_t header[6] = {0, 0, 0, 0, 0, 0}; // byte order, version, nx, ny, nz, number of timesteps
+    file.read(magic, 4);
+    file.read(reinterpret_cast<char*>(header), sizeof(header));
+    if(!file || magic[0] != 'M' || magic[1] != 'D' || magic[2] != 'T' || magic[3] != 'M') {
+        cout << "Error in TrajectoryManifest::load(): " << filename << " is not a trajectory manifest" << endl;
+        return false;
+    }
+    if(header[0] != MANIFEST_BYTE_ORDER) {
+        cout << "Error in TrajectoryManifest::load(): " << filename << " was written with another byte order (or is older than version 2), it should be regenerated" << endl;
+        return false;
+    }
+    if(header[1] != MANIFEST_VERSION) {
+        cout << "Error in TrajectoryManifest::load(): " << filename << " has version " << header[1] << ", expected " << MANIFEST_VERSION << endl;
+        return false;
+    }
+
+    nx = header[2];
+    ny = header[3];
+    nz = header[4];
+    int num_nodes = nx*ny*nz;
+    timesteps.resize(header[5]);
+    for(int t=0; t<timesteps.size() && file; t++) {
+        TimestepManifest &timestep = timesteps[t];
+        int32_t timestep_index = 0;
+        file.read(reinterpret_cast<char*>(&timestep_index), sizeof(timestep_index));
+        timestep.timestep = timestep_index;
+        file.read(reinterpret_cast<char*>(timestep.h_matrix), sizeof(timestep.h_matrix));
+        timestep.nodes.resize(num_nodes);
+        for(int node_id=0; node_id<num_nodes; node_id++) read_node(file, timestep.nodes[node_id]);
+    }
+    if(!file) {
+        cout << "Error in TrajectoryManifest::load(): " << filename << " is truncated" << endl;
+        timesteps.clear();
+        return false;
+    }
+
+    return true;
+}
+
+bool TrajectoryManifest::save(string filename) {
+    ofstream file(filename.c_str(), ios::out | ios::binary);
+    if(!file) {
+        cout << "Error in TrajectoryManifest::save(): Failed to open file " << filename << endl;
+        return false;
+    }
+
+    int32_t header[6] = {MANIFEST_BYTE_ORDER, MANIFEST_VERSION, nx, ny, nz, int32_t(timesteps.size())};
+    file.write("MDTM", 4);
+    file.write(reinterpret_cast<char*>(header), sizeof(header));
+    for(int t=0; t<timesteps.size(); t++) {
+        TimestepManifest &timestep = timesteps[t];
+        int32_t timestep_index = timestep.timestep;
+        file.write(reinterpret_cast<char*>(&timestep_index), sizeof(timestep_index));
+        file.write(reinterpret_cast<char*>(timestep.h_matrix), sizeof(timestep.h_matrix));
+        for(int node_id=0; node_id<timestep.nodes.size(); node_id++) write_node(file, timestep.nodes[node_id]);
+    }
+    file.close();
+    if(!file) {
+        cout << "Error in TrajectoryManifest::save(): Failed to write " << filename << endl;
+        return false;
+    }
+
+    return true;
+}
+
+// Reads one node file per task and summarizes its atoms
+class ScanNodes {
+public:
+  string mts0_directory;
+  int nx, ny, nz;
+  float *h_matrix;
+  TimestepManifest *timestep_manifest;
+  NodePack *pack;         // File sizes come from here when the timestep is packed
+  int num_missing;
+
+  void operator()(int begin, int end, int worker) {
+    char filename[5000];
+    for(int node_id=begin; node_id<end; node_id++) {
+      NodeManifest &node = timestep_manifest->nodes[node_id];
+      sprintf(filename, "%s/mt%04d", mts0_directory.c_str(), node_id);
+      struct stat file_status;
+      if(pack->file >= 0) node.file_size = pack->nodes[node_id].size;
+      else if(stat(filename, &file_status) == 0) node.file_size = file_status.st_size;
+      else {
+        __sync_fetch_and_add(&num_missing, 1);
+        continue;
+      }
+
+      vector<int> node_ids(1, node_id);
+      Timestep node_timestep(mts0_directory, nx, ny, nz, node_ids, h_matrix);
+      node.num_atoms = node_timestep.positions.size();
+      for(int k=0; k<3; k++) {
+        node.bounds_min[k] = 1e30;
+        node.bounds_max[k] = -1e30;
+      }
+      for(int type=0; type<MANIFEST_NUM_TYPES; type++) node.type_counts[type] = 0;
+
+      for(long i=0; i<node.num_atoms; i++) {
+        for(int k=0; k<3; k++) {
+          float x = node_timestep.positions[i][k];
+          if(x < node.bounds_min[k]) node.bounds_min[k] = x;
+          if(x > node.bounds_max[k]) node.bounds_max[k] = x;
+        }
+        int type = node_timestep.atom_types[i] - 1;
+        if(type >= 0 && type < MANIFEST_NUM_TYPES) node.type_counts[type]++;
+      }
+    }
+  }
+};
+
+bool TrajectoryManifest::scan_timestep(string mts0_directory, int timestep_index) {
+    int num_nodes = nx*ny*nz;
+    TimestepManifest timestep;
+    timestep.timestep = timestep_index;
+    timestep.nodes.resize(num_nodes);
+
+    // Timestep keeps the h-matrix of the last node it reads
+    if(!read_node_h_matrix(mts0_directory, num_nodes-1, timestep.h_matrix)) {
+        cout << "Error in TrajectoryManifest::scan_timestep(): Failed to read h-matrix of node " << num_nodes-1 << " in " << mts0_directory << endl;
+        return false;
+    }
+    NodePack pack;
+    if(pack.open(NodePack::get_filename(mts0_directory)) && pack.nodes.size() != num_nodes) {
+        cout << "Error in TrajectoryManifest::scan_timestep(): " << pack.filename << " has " << pack.nodes.size() << " nodes, not " << num_nodes << endl;
+        return false;
+    }
+
+    ScanNodes scan;
+    scan.mts0_directory = mts0_directory;
+    scan.nx = nx; scan.ny = ny; scan.nz = nz;
+    scan.h_matrix = timestep.h_matrix;
+    scan.timestep_manifest = &timestep;
+    scan.pack = &pack;
+    scan.num_missing = 0;
+    parallel_for(0, num_nodes, 1, scan);
+    if(scan.num_missing > 0) {
+        cout << "Error in TrajectoryManifest::scan_timestep(): " << scan.num_missing << " node files missing in " << mts0_directory << endl;
+        return false;
+    }
+
+    timesteps.push_back(timestep);
+    return true;
+}
+
+TimestepManifest *TrajectoryManifest::get(int timestep_index) {
+    // Binary search, timesteps are sorted
+    int low = 0, high = timesteps.size();
+    while(low < high) {
+        int middle = (low + high)/2;
+        if(timesteps[middle].timestep < timestep_index) low = middle + 1;
+        else high = middle;
+    }
+    if(low < timesteps.size() && timesteps[low].timestep == timestep_index) return &timesteps[low];
+    return 0;
+}
+
+void TrajectoryManifest::print_statistics() {
+    if(timesteps.size() == 0) return;
+
+    long min_atoms = -1, max_atoms = 0;
+    double total_bytes = 0;
+    for(int t=0; t<timesteps.size(); t++) {
+        long num_atoms = timesteps[t].get_number_of_atoms();
+        if(min_atoms < 0 || num_atoms < min_atoms) min_atoms = num_atoms;
+        if(num_atoms > max_atoms) max_atoms = num_atoms;
+        total_bytes += timesteps[t].get_file_size();
+    }
+
+    TimestepManifest &first = timesteps[0];
+    cout << "Trajectory: " << timesteps.size() << " timesteps (" << first.timestep << " - " << timesteps.back().timestep << "), " << nx*ny*nz << " nodes, ";
+    if(min_atoms == max_atoms) cout << max_atoms << " atoms";
+    else cout << min_atoms << " - " << max_atoms << " atoms";
+    cout << ", " << total_bytes/(1024*1024*1024) << " GB on disk" << endl;
+    cout << "System size: " << first.h_matrix[0]*Timestep::bohr << " x " << first.h_matrix[4]*Timestep::bohr << " x " << first.h_matrix[8]*Timestep::bohr << " Å" << endl;
+
+    cout << "Atoms by type in timestep " << first.timestep << ":";
+    for(int type=0; type<MANIFEST_NUM_TYPES; type++) {
+        long count = 0;
+        for(int i=0; i<first.nodes.size(); i++) count += first.nodes[i].type_counts[type];
+        if(count > 0) cout << " " << type_names[type] << " " << count;
+    }
+    cout << endl;
+}
@@ -0,0 +1,62 @@
+/*
+TrajectoryManifest.cpp TrajectoryManifest.h
+
+Index of an mts0 trajectory, written once by md_manifest so that loads can be planned without
+opening the node files. For every timestep it holds the h-matrix (as kept by Timestep, from the
+last node) and for every mt%04d file the atom count, the file size, the bounding box of the atom
+positions (Ångström, after the node origin is added) and the number of atoms of each type.
+
+Mts0_io uses it to size the atom arrays before reading, to pick region of interest nodes by
+their actual bounds instead of their domain boxes, and to print trajectory statistics at startup.
+
+Binary layout: the magic "MDTM", then 32 bit ints MANIFEST_BYTE_ORDER, version, nx, ny, nz and the
+number of timesteps. Each timestep is a 32 bit timestep index and 18 floats of h-matrix, followed by
+nx*ny*nz nodes, each with the fields of NodeManifest in order and the counts as 64 bit ints. Fields
+are written one at a time in the byte order of the writer, a file from a machine of the other byte
+order is rejected by the check of MANIFEST_BYTE_ORDER.
+*/
+
+#pragma once
+#include <vector>
+#include <string>
+
+using std::vector;
+using std::string;
+
+#define MANIFEST_VERSION 2
+#define MANIFEST_BYTE_ORDER 0x01020304
+#define MANIFEST_NUM_TYPES 7
+
+class NodeManifest {
+public:
+  long num_atoms;
+  long file_size;                         // Bytes
+  float bounds_min[3];                    // Ångström, empty nodes have bounds_min > bounds_max
+  float bounds_max[3];
+  long type_counts[MANIFEST_NUM_TYPES];   // Indexed by atom type - 1
+};
+
+class TimestepManifest {
+public:
+  int timestep;
+  float h_matrix[18];                     // Same layout as read_mts(): h_matrix[9*k + 3*i + j]
+  vector<NodeManifest> nodes;
+
+  long get_number_of_atoms();
+  long get_file_size();
+  long get_atom_count(int node_id, bool *skip_types); // Atoms of the node left after skipping types, skip_types is indexed by type
+  long get_node_offsets(vector<int> &node_ids, bool *skip_types, long first_atom, vector<long> &node_offsets);
+};
+
+class TrajectoryManifest {
+public:
+  int nx, ny, nz;
+  vector<TimestepManifest> timesteps;     // In increasing timestep order
+
+  TrajectoryManifest();
+  bool load(string filename);
+  bool save(string filename);
+  bool scan_timestep(string mts0_directory, int timestep_index); // Reads all node files of one timestep and appends its entry
+  TimestepManifest *get(int timestep_index); // 0 if the timestep is not in the manifest
+  void print_statistics();
+};
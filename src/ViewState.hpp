@@ -0,0 +1,48 @@
+#pragma once
+
+#include <CVector.h>
+
+class Timestep;
+
+// What a frame of the viewer depends on that can change without a key press: the camera, the
+// timestep on screen and the adaptive quality. The main loop compares the state of the next
+// frame with the one it drew last and skips culling, quad generation and the buffer swap when
+// they are equal. Settings changed from the keyboard mark the scene dirty instead of being tracked here.
+class ViewState
+{
+    public:
+        CVector position;
+        double rot_x, rot_y;
+        Timestep *timestep;
+        int timestep_index;    // Timestep objects are reused, so the pointer alone does not identify the data
+        double quality;
+
+        ViewState()
+        {
+            rot_x = 0;
+            rot_y = 0;
+            timestep = 0;
+            timestep_index = -1;
+            quality = 0;
+        }
+
+        ViewState(CVector position_, double rot_x_, double rot_y_, Timestep *timestep_, int timestep_index_, double quality_)
+        {
+            position = position_;
+            rot_x = rot_x_;
+            rot_y = rot_y_;
+            timestep = timestep_;
+            timestep_index = timestep_index_;
+            quality = quality_;
+        }
+
+        bool operator==(const ViewState &other) const
+        {
+            return position.x == other.position.x && position.y == other.position.y && position.z == other.position.z
+                && rot_x == other.rot_x && rot_y == other.rot_y
+                && timestep == other.timestep && timestep_index == other.timestep_index
+                && quality == other.quality;
+        }
+
+        bool operator!=(const ViewState &other) const { return !(*this == other); }
+};
@@ -8,8 +8,18 @@
 #include <mts0_io.h>
 #include <CIniFile.h>
 #include <time.h>
+#include <string.h>
 #include <CBitMap.h>
 #include <MDTexture.h>
+#include <DepthSort.h>
+#include <FrameProfiler.hpp>
+#include <TraceRecorder.h>
+#include <CameraPath.h>
+#include <QualityGovernor.hpp>
+#include <TimestepPlayer.h>
+#include <TaskPool.h>
+#include <IoRing.h>
+#include <ViewState.hpp>
 
 #define SI_TYPE 1
 #define A_TYPE 2
@@ -19,6 +29,10 @@
 #define CL_TYPE 6
 #define X_TYPE 7
 
+// After an input event the loop keeps running this long before it may sleep, so that work the
+// input started on other threads (e.g. the clock thread requesting a new timestep) is seen
+#define INPUT_GRACE_SECONDS 0.1
+
 #define NA_MASS 22.989769
 #define CL_MASS 35.453
 
@@ -32,6 +46,7 @@ bool paused = true;
 bool record_video = false;
 int frame = 0;
 bool draw_water = true;
+bool skip_hidden_water = false; // Leave water out of timesteps loaded while it is hidden
 double dr2_max = 3500;
 double water_dr2_max = 3500;
 double color_cutoff = 2000;
@@ -39,9 +54,24 @@ MDTexture texture;
 MDOpenGL mdopengl;
 int render_mode = 1;
 bool periodic_boundary_conditions = false;
+bool depth_sort = false;
+DepthSort depth_sorter;
+FrameProfiler profiler;
+QualityGovernor governor;
+char pool_statistics[200] = ""; // Task pool utilization over the last second, for the HUD
+int load_stage, cull_stage, sort_stage, build_stage, submit_stage, swap_stage, readback_stage, total_stage;
+string trace_file;
+CameraPath camera_path;
+string camera_path_file;
+bool recording_camera_path = false;
+bool playing_camera_path = false;
+double camera_path_start_time = 0;
 int step = 1;
 int time_direction = 1; //-1 to run time backwards
 Mts0_io *mts0_io;
+TimestepPlayer *player = 0; // Loads timesteps on its own threads at playback_speed ps/s, 0 for one timestep per frame
+bool scene_dirty = true;     // Redraw even if the ViewState is unchanged, set by keys and window refreshes
+double last_input_time = 0;
 
 unsigned char *buffer = new unsigned char[4000*4000];
 CBitMap *bmp = new CBitMap();
@@ -66,17 +96,61 @@ void drawScene(Mts0_io *mts0_io, MDOpenGL &mdopengl, Timestep *timestep)
     glTranslatef( -mdopengl.camera->position.x, -mdopengl.camera->position.y, -mdopengl.camera->position.z );
 
     vector<vector<float> > &positions = timestep->positions;
-    vector<int> &atom_types = timestep->atom_types;
-    vector<int> &indices = timestep->visible_atom_indices;
+    vector<long> &indices = timestep->visible_atom_indices;
+    vector<float> &ambient_occlusion = timestep->ambient_occlusion;
     CVector up_on_screen = mdopengl.coord_to_ray(0,mdopengl.window_height/2.0);
-    if(render_mode == 1) texture.render_billboards(mdopengl, indices, atom_types, positions, draw_water, color_cutoff, dr2_max, system_size, periodic_boundary_conditions, water_dr2_max);
-    if(render_mode == 2) texture.render_billboards2(mdopengl, indices, atom_types, positions, draw_water, color_cutoff, dr2_max, system_size, periodic_boundary_conditions);
-    if(render_mode == 3) texture.render_billboards3(mdopengl, indices, atom_types, positions, draw_water, color_cutoff, dr2_max, system_size, periodic_boundary_conditions);
+
+    // Opaque billboards front-to-back so the depth test rejects hidden fragments early, blended ones back-to-front
+    if(depth_sort) {
+        ScopedTimer timer(profiler, sort_stage);
+        TraceSpan span("depth_sort");
+        CVector &position = mdopengl.camera->position;
+        CVector &direction = mdopengl.camera->target;
+        depth_sorter.sort(indices, positions, position.x, position.y, position.z, direction.x, direction.y, direction.z, render_mode != 2);
+        // Blending needs the global order, the opaque modes only need it within each type
+        if(render_mode == 2) timestep->split_visible_into_type_runs();
+        else timestep->group_visible_by_type();
+    }
+
+    int num_vertices;
+    {
+        ScopedTimer timer(profiler, build_stage);
+        TraceSpan span("build_billboards", render_mode);
+        num_vertices = texture.build_billboards(mdopengl, render_mode, indices, timestep->visible_type_ranges, positions, ambient_occlusion, draw_water, governor.get_color_cutoff(), governor.get_dr2_max(), system_size, periodic_boundary_conditions, governor.get_water_dr2_max());
+    }
+
+    profiler.begin_gpu();
+    {
+        ScopedTimer timer(profiler, submit_stage);
+        TraceSpan span("gl_submit", render_mode);
+        texture.submit_billboards(render_mode, num_vertices);
+    }
+    profiler.end_gpu();
+
+    profiler.hud_lines.clear();
+    if(governor.enabled) {
+        char line[200];
+        governor.describe(line);
+        profiler.hud_lines.push_back(string(line));
+    }
+    TaskPool &pool = TaskPool::instance();
+    if(TraceRecorder::now() - pool.stats_start_time > 1) {
+        pool.describe(pool_statistics);
+        pool.reset_stats();
+    }
+    if(pool_statistics[0]) profiler.hud_lines.push_back(string(pool_statistics));
+    profiler.draw_hud(mdopengl.window_width, mdopengl.window_height);
 
     // ----- Stop Drawing Stuff! ------ 
-    glfwSwapBuffers(); // Swap the buffers to display the scene (so we don't have to watch it being drawn!)
+    {
+        ScopedTimer timer(profiler, swap_stage);
+        TraceSpan span("swap_buffers");
+        glfwSwapBuffers(); // Swap the buffers to display the scene (so we don't have to watch it being drawn!)
+    }
 
     if(record_video) {
+        ScopedTimer timer(profiler, readback_stage);
+        TraceSpan span("readback", frame);
         GLenum format = GL_RGBA;
 
         glFinish(); // Make sure everything is drawn
@@ -99,8 +173,16 @@ void handle_mouse_move(int mouse_x, int mouse_y) {
     mdopengl.camera->handle_mouse_move(mouse_x, mouse_y);
 }
 
+// Callback function for when the window contents were damaged, e.g. uncovered
+void handle_window_refresh() {
+    scene_dirty = true;
+}
+
 // Callback function to handle keypresses
 void handle_keypress(int theKey, int theAction) {
+    scene_dirty = true;
+    last_input_time = glfwGetTime();
+
     // If a key is pressed, toggle the relevant key-press flag
     if (theAction == GLFW_PRESS)
     {
@@ -126,12 +208,21 @@ void handle_keypress(int theKey, int theAction) {
             break;
         case 'T':
             time_direction *= -1;
+            if(player) player->reverse();
+            break;
+        case ',':
+            if(player) player->scale_speed(0.5);
+            break;
+        case '.':
+            if(player) player->scale_speed(2.0);
             break;
         case 'P':
-            mts0_io->step++;
+            if(player) player->set_step(mts0_io->step + 1);
+            else mts0_io->step++;
             break;
         case 'M':
-            mts0_io->step--;
+            if(player) player->set_step(mts0_io->step - 1);
+            else mts0_io->step--;
             break;
         case 'B':
             periodic_boundary_conditions = !periodic_boundary_conditions;
@@ -141,9 +232,39 @@ void handle_keypress(int theKey, int theAction) {
             break;
         case ' ':
             paused = !paused;
+            if(player) player->set_paused(paused);
             break;
         case 'R':
             draw_water = !draw_water;
+            if(player) player->set_skip_hidden_water(skip_hidden_water && !draw_water);
+            else mts0_io->skip_hidden_water = skip_hidden_water && !draw_water;
+            break;
+        case 'Z':
+            depth_sort = !depth_sort;
+            break;
+        case 'H':
+            profiler.show_hud = !profiler.show_hud;
+            break;
+        case 'Q':
+            governor.set_enabled(!governor.enabled);
+            break;
+        case 'J':
+            if(TraceRecorder::enabled) TraceRecorder::write_json(trace_file);
+            break;
+        case 'C':
+            // Start recording a new camera path, or stop and save the current one
+            recording_camera_path = !recording_camera_path;
+            playing_camera_path = false;
+            if(recording_camera_path) camera_path.clear();
+            else camera_path.save_binary(camera_path_file);
+            camera_path_start_time = glfwGetTime();
+            break;
+        case 'K':
+            // Play back the last recorded camera path, or the one in camera_path_file
+            if(recording_camera_path) break;
+            playing_camera_path = !playing_camera_path;
+            if(playing_camera_path && camera_path.get_number_of_keyframes() == 0) playing_camera_path = camera_path.load(camera_path_file);
+            camera_path_start_time = glfwGetTime();
             break;
         case '1':
             render_mode = 1;
@@ -202,57 +323,190 @@ int main(int argc, char **argv)
     water_dr2_max = ini.getdouble("water_dr2_max");
     color_cutoff = ini.getdouble("color_cutoff");
     double dt = ini.getdouble("dt");
+    bool decoupled_playback = ini.getbool("decoupled_playback");
+    double playback_speed = ini.getdouble("playback_speed");
     periodic_boundary_conditions = ini.getbool("periodic_boundary_conditions");
     step = ini.getint("step");
     bool full_screen = ini.getbool("full_screen");
     record_video = ini.getbool("record_video");
+    depth_sort = ini.getbool("depth_sort");
+    double ambient_occlusion_radius = ini.getdouble("ambient_occlusion_radius");
+    string profile_csv = ini.getstring("profile_csv");
+    profiler.show_hud = ini.getbool("show_hud");
+    load_stage = profiler.add_stage("load");
+    cull_stage = profiler.add_stage("cull");
+    sort_stage = profiler.add_stage("sort");
+    build_stage = profiler.add_stage("build");
+    submit_stage = profiler.add_stage("submit");
+    swap_stage = profiler.add_stage("swap");
+    readback_stage = profiler.add_stage("readback");
+    total_stage = profiler.add_stage("total");
+    if(profile_csv.compare("none") != 0) profiler.open_csv(profile_csv);
+    governor.set_limits(dr2_max, water_dr2_max, color_cutoff);
+    governor.set_enabled(ini.getbool("adaptive_quality"));
+    governor.min_quality = ini.getdouble("adaptive_quality_min");
+    trace_file = ini.getstring("trace_file");
+    TraceRecorder::enabled = trace_file.compare("none") != 0;
+    TraceRecorder::set_thread_name("main");
+    TaskPool::initialize(ini.getint("num_threads"));
+    IoRing::enabled = ini.getbool("io_uring");
+    camera_path_file = ini.getstring("camera_path_file");
 
-    mts0_io = new Mts0_io(nx,ny,nz,max_timestep, foldername_base, preload, step);
+    mts0_io = new Mts0_io(nx,ny,nz,max_timestep, foldername_base, preload, step, ambient_occlusion_radius, ini.getstring("trajectory_manifest"));
+    mts0_io->region_of_interest = ini.getbool("region_of_interest_loading");
+    mts0_io->region_margin = ini.getdouble("region_of_interest_margin");
+    mts0_io->set_skip_types(ini.getstring("skip_types"));
+    skip_hidden_water = ini.getbool("skip_hidden_water");
+    mts0_io->morton_order = ini.getbool("morton_order");
+    mts0_io->open_mapped_trajectory(ini.getstring("mapped_trajectory"), ini.getint("mapped_readahead"));
     sprintf(window_title, "Molecular Dynamics Visualizer (MDV) - [%.2f fps] - t = %.2f ps (timestep %d - step: %d)",60.0, 0.0, mts0_io->current_timestep, mts0_io->step);
 
     mdopengl.initialize(ini.getint("screen_width"),ini.getint("screen_height"), string(window_title), handle_keypress, handle_mouse_move, full_screen, camera_speed);
+    glfwSetWindowRefreshCallback(handle_window_refresh);
     GLenum error = glewInit();
+    glutInit(&argc, argv);
+    profiler.init_gpu_timer();
 
-    current_timestep_object = mts0_io->get_next_timestep(time_direction, mdopengl.camera->position.x, mdopengl.camera->position.y, mdopengl.camera->position.z, 2000000, dr2_max);
+    if(decoupled_playback) {
+        player = new TimestepPlayer(mts0_io, dt, playback_speed, 2000000, dr2_max);
+        player->set_paused(paused);
+        player->start(mdopengl.camera->position.x, mdopengl.camera->position.y, mdopengl.camera->position.z);
+        current_timestep_object = player->get_newest_timestep();
+    } else {
+        current_timestep_object = mts0_io->get_next_timestep(time_direction, mdopengl.camera->position.x, mdopengl.camera->position.y, mdopengl.camera->position.z, 2000000, dr2_max);
+    }
     system_size = current_timestep_object->get_lx_ly_lz();
 
     texture.load_png("sphere2.png", "sphere1");
     // texture.create_sphere1("sphere1", 1000);
     // texture.create_sphere2("sphere2", 1000);
-    // texture.prepare_billboards3();
+    texture.prepare_billboards3(); // Vertex buffers of render mode 3
     
     bool running = true;
     int frames_since_update = 0;
+    ViewState drawn_view_state;
 
     bmp->Create(ini.getint("screen_width"),ini.getint("screen_height"));
 
     while (running)
     {
-        if(!paused) current_timestep_object = mts0_io->get_next_timestep(time_direction, mdopengl.camera->position.x, mdopengl.camera->position.y, mdopengl.camera->position.z, 2000000, dr2_max);
-        if(++frames_since_update > 500) {
-            frames_since_update = 0;
-            current_timestep_object->update_visible_atom_list(mdopengl.camera->position.x, mdopengl.camera->position.y, mdopengl.camera->position.z, 2000000, dr2_max);
+        double frame_start_time = glfwGetTime();
+        if(player) {
+            // Loading and culling happen on the loader thread, just pick up the newest timestep
+            player->set_camera(mdopengl.camera->position.x, mdopengl.camera->position.y, mdopengl.camera->position.z);
+            current_timestep_object = player->get_newest_timestep();
+        } else if(!paused) {
+            current_timestep_object = mts0_io->get_next_timestep(time_direction, mdopengl.camera->position.x, mdopengl.camera->position.y, mdopengl.camera->position.z, 2000000, dr2_max);
+            profiler.add(load_stage, mts0_io->load_time);
+            profiler.add(cull_stage, current_timestep_object->cull_time);
+        }
+
+        // A timestep read while water was hidden is read again once it is shown
+        if(player ? player->is_missing_types(current_timestep_object) : mts0_io->is_missing_types(current_timestep_object)) {
+            if(player) {
+                if(!player->is_busy()) player->reload();
+            } else {
+                Timestep *reloaded_timestep = mts0_io->get_timestep(mts0_io->current_timestep, mdopengl.camera->position.x, mdopengl.camera->position.y, mdopengl.camera->position.z, 2000000, dr2_max);
+                mts0_io->release_timestep(current_timestep_object);
+                current_timestep_object = reloaded_timestep;
+                profiler.add(load_stage, mts0_io->load_time);
+                scene_dirty = true;
+            }
         }
 
         // Calculate our camera movement
-        mdopengl.camera->move(system_size, periodic_boundary_conditions);
- 
-        // Draw our scene
-        drawScene(mts0_io,mdopengl,current_timestep_object);
- 
+        if(playing_camera_path) {
+            CVector position, rotation;
+            double time = glfwGetTime() - camera_path_start_time;
+            camera_path.sample(camera_path.times[0] + time, position, rotation);
+            mdopengl.camera->set_state(position, rotation);
+            if(time > camera_path.get_duration()) playing_camera_path = false;
+        } else mdopengl.camera->move(system_size, periodic_boundary_conditions);
+
+        if(recording_camera_path) {
+            CVector rotation(mdopengl.camera->get_rot_x(), mdopengl.camera->get_rot_y(), 0);
+            camera_path.add_keyframe(glfwGetTime() - camera_path_start_time, mdopengl.camera->position, rotation);
+        }
+
+        // Read the nodes the camera has come close to, if only a region of the timestep was loaded.
+        // The player does this on its loader thread.
+        if(!player && mts0_io->region_of_interest) {
+            if(mts0_io->stream_region(current_timestep_object, mdopengl.camera->position.x, mdopengl.camera->position.y, mdopengl.camera->position.z, 2000000, dr2_max)) {
+                profiler.add(load_stage, mts0_io->load_time);
+                scene_dirty = true;
+            }
+        }
+
+        // Only draw when something on screen can have changed
+        int timestep_index = player ? player->displayed_timestep : mts0_io->current_timestep;
+        ViewState view_state(mdopengl.camera->position, mdopengl.camera->get_rot_x(), mdopengl.camera->get_rot_y(), current_timestep_object, timestep_index, governor.quality);
+        if(scene_dirty || record_video || view_state != drawn_view_state) {
+            scene_dirty = false;
+            drawn_view_state = view_state;
+            if(++frames_since_update > 500) {
+                frames_since_update = 0;
+                current_timestep_object->update_visible_atom_list(mdopengl.camera->position.x, mdopengl.camera->position.y, mdopengl.camera->position.z, 2000000, dr2_max);
+                profiler.add(cull_stage, current_timestep_object->cull_time);
+            }
+
+            // Draw our scene
+            drawScene(mts0_io,mdopengl,current_timestep_object);
+            profiler.add(total_stage, glfwGetTime() - frame_start_time);
+            profiler.end_frame();
+            // Only the stages whose cost the quality controls, a slow load or streamed region must not lower it.
+            // The GPU draws while the billboards are submitted, so the slower of the two counts.
+            double draw_time = profiler.last(submit_stage);
+            if(profiler.gpu_timer_available) draw_time = max(draw_time, profiler.last(profiler.gpu_stage));
+            double render_time = profiler.last(sort_stage) + profiler.last(build_stage) + draw_time;
+            governor.update(render_time, 1.0/mdopengl.fps_manager.get_target_fps());
+        } else glfwPollEvents(); // Otherwise done by glfwSwapBuffers
+
+        // With nothing moving on its own, sleep until the next input event instead of redrawing at the target frame rate
+        Camera *camera = mdopengl.camera;
+        bool moving = camera->holding_forward || camera->holding_backward || camera->holding_left_strafe || camera->holding_right_strafe;
+        bool playing = player ? player->is_busy() : !paused;
+        bool animating = playing || moving || playing_camera_path || recording_camera_path || record_video || glfwGetTime() - last_input_time < INPUT_GRACE_SECONDS;
+        if(!animating && !scene_dirty) {
+            TraceSpan span("idle");
+            glfwWaitEvents();
+            mdopengl.fps_manager.frame_start_time = glfwGetTime(); // Waiting for input does not count as frame time
+        } else {
+            // Call our fps manager to limit the FPS
+            mdopengl.fps_manager.enforce_fps();
+        }
+
         // exit if ESC was pressed or window was closed
         running = !glfwGetKey(GLFW_KEY_ESC) && glfwGetWindowParam(GLFW_OPENED);
- 
-        // Call our fps manager to limit the FPS
-        mdopengl.fps_manager.enforce_fps();
         double fps = mdopengl.fps_manager.average_fps;
 
-        // Calculate the current time in pico seconds to show in the title bar
-        double t_in_ps = mts0_io->current_timestep*dt/1000;
-        sprintf(window_title, "Molecular Dynamics Visualizer (MDV) - [%.2f fps] - t = %.2f ps (timestep %d - step: %d)",fps, t_in_ps, mts0_io->current_timestep, mts0_io->step);
+        // Simulation time in picoseconds, step and memory use for the title bar. With the player, mts0_io belongs to
+        // the loader thread and the memory use comes from the displayed frame instead.
+        long resident_bytes;
+        double mapped_resident_fraction;
+        if(player) {
+            double t_in_ps, ps_per_second;
+            int num_skipped;
+            player->get_clock(t_in_ps, ps_per_second, num_skipped);
+            resident_bytes = player->resident_bytes;
+            mapped_resident_fraction = player->mapped_resident_fraction;
+            sprintf(window_title, "Molecular Dynamics Visualizer (MDV) - [%.2f fps] - t = %.2f ps (timestep %d - step: %d - %.2f ps/s - %d skipped)",fps, t_in_ps, player->displayed_timestep, mts0_io->step, ps_per_second, num_skipped + player->num_dropped);
+        } else {
+            resident_bytes = mts0_io->resident_bytes;
+            mapped_resident_fraction = mts0_io->mapped_resident_fraction;
+            double t_in_ps = mts0_io->current_timestep*dt/1000;
+            sprintf(window_title, "Molecular Dynamics Visualizer (MDV) - [%.2f fps] - t = %.2f ps (timestep %d - step: %d)",fps, t_in_ps, mts0_io->current_timestep, mts0_io->step);
+        }
+        if(depth_sort) sprintf(window_title + strlen(window_title), " - depth sort %.1f ms/M atoms", 1000*depth_sorter.sort_time_per_million_atoms);
+        if(mts0_io->mapped_trajectory && resident_bytes >= 0) sprintf(window_title + strlen(window_title), " - %.0f MB resident, %.0f%% paged in before load", resident_bytes/(1024.0*1024), 100*mapped_resident_fraction);
         mdopengl.set_window_title(string(window_title));
     }
  
+    if(player) {
+        player->stop();
+        delete player;
+    }
+    if(TraceRecorder::enabled) TraceRecorder::write_json(trace_file);
+
     // Clean up GLFW and exit
     glfwTerminate();
  
@@ -0,0 +1,140 @@
+// Deterministic benchmark. Replays a camera path over a fixed range of preloaded timesteps for each
+// render mode, with frame throttling off and glFinish after every frame, and reports
+// min/mean/p99 frame time and atoms per second.
+#include <MDOpenGL.h>
+#include <iostream>
+#include <string>
+#include <algorithm>
+#include <Camera.h>
+#include <mts0_io.h>
+#include <CIniFile.h>
+#include <CUtil.h>
+#include <MDTexture.h>
+#include <CameraPath.h>
+#include <TaskPool.h>
+#include <IoRing.h>
+
+#define WARMUP_FRAMES 10
+
+using std::string;
+using std::cout;
+using std::endl;
+
+MDTexture texture;
+MDOpenGL mdopengl;
+
+// No interactive input while benchmarking
+void handle_keypress(int theKey, int theAction) { }
+void handle_mouse_move(int mouse_x, int mouse_y) { }
+
+void draw_frame(Timestep *timestep, int render_mode, bool draw_water, double color_cutoff, double dr2_max, vector<float> system_size, bool periodic_boundary_conditions, double water_dr2_max) {
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    glMatrixMode(GL_MODELVIEW);
+    glLoadIdentity();
+    glRotatef(mdopengl.camera->get_rot_x(), 1.0f, 0.0f, 0.0f);
+    glRotatef(mdopengl.camera->get_rot_y(), 0.0f, 1.0f, 0.0f);
+    glTranslatef( -mdopengl.camera->position.x, -mdopengl.camera->position.y, -mdopengl.camera->position.z );
+
+    texture.render_billboards(mdopengl, render_mode, timestep->visible_atom_indices, timestep->visible_type_ranges, timestep->positions, timestep->ambient_occlusion, draw_water, color_cutoff, dr2_max, system_size, periodic_boundary_conditions, water_dr2_max);
+    glFinish();
+}
+
+int main(int argc, char **argv)
+{
+    CIniFile ini;
+    ini.load("md_visualizer.ini");
+    int nx = ini.getint("nx");
+    int ny = ini.getint("ny");
+    int nz = ini.getint("nz");
+    string foldername_base = ini.getstring("foldername_base");
+    double dr2_max = ini.getdouble("dr2_max");
+    double water_dr2_max = ini.getdouble("water_dr2_max");
+    double color_cutoff = ini.getdouble("color_cutoff");
+    bool periodic_boundary_conditions = ini.getbool("periodic_boundary_conditions");
+    double ambient_occlusion_radius = ini.getdouble("ambient_occlusion_radius");
+    string camera_path_file = ini.getstring("benchmark_camera_path");
+    int first_timestep = ini.getint("benchmark_first_timestep");
+    int last_timestep = ini.getint("benchmark_last_timestep");
+    int num_frames = ini.getint("benchmark_frames");
+    vector<string> render_mode_list;
+    CUtil::Tokenize(ini.getstring("benchmark_render_modes"), render_mode_list, " ");
+    bool morton_order = ini.getbool("morton_order");
+    bool draw_water = true;
+    TaskPool::initialize(ini.getint("num_threads"));
+    IoRing::enabled = ini.getbool("io_uring");
+
+    if(num_frames <= 0) {
+        cout << "benchmark_frames must be positive, got " << num_frames << endl;
+        exit(1);
+    }
+    if(render_mode_list.size() == 0) {
+        cout << "No render modes in benchmark_render_modes" << endl;
+        exit(1);
+    }
+
+    CameraPath camera_path;
+    if(!camera_path.load(camera_path_file)) {
+        cout << "No keyframes in camera path " << camera_path_file << endl;
+        exit(1);
+    }
+
+    // Everything is loaded up front so that I/O is not part of the measurement
+    vector<Timestep*> timesteps;
+    char mts0_directory[5000];
+    for(int timestep=first_timestep; timestep<=last_timestep; timestep++) {
+        sprintf(mts0_directory, "%s/%06d/mts0/",foldername_base.c_str(), timestep);
+        Timestep *new_timestep = new Timestep(string(mts0_directory), nx, ny, nz);
+        if(morton_order) new_timestep->sort_by_morton_code();
+        if(ambient_occlusion_radius > 0) new_timestep->compute_ambient_occlusion(ambient_occlusion_radius);
+        timesteps.push_back(new_timestep);
+        cout << "Loaded timestep " << timestep << " with " << new_timestep->get_number_of_atoms() << " atoms" << endl;
+    }
+    vector<float> system_size = timesteps[0]->get_lx_ly_lz();
+
+    mdopengl.initialize(ini.getint("screen_width"),ini.getint("screen_height"), string("MDV benchmark"), handle_keypress, handle_mouse_move, false, 1.0);
+    GLenum error = glewInit();
+
+    texture.load_png("sphere2.png", "sphere1");
+    texture.create_sphere2("sphere2", 512);
+    texture.prepare_billboards3();
+
+    cout << endl << "Atom order: " << (morton_order ? "Morton" : "node files") << endl;
+    cout << "mode   frames   min (ms)  mean (ms)   p99 (ms)   M atoms/s" << endl;
+    for(int mode_index=0; mode_index<render_mode_list.size(); mode_index++) {
+        int render_mode = atoi(render_mode_list[mode_index].c_str());
+        if(render_mode < 1 || render_mode > 3) {
+            cout << "Skipping unknown render mode " << render_mode_list[mode_index] << endl;
+            continue;
+        }
+        vector<double> frame_times;
+        double num_atoms = 0;
+
+        for(int frame=-WARMUP_FRAMES; frame<num_frames; frame++) {
+            CVector position, rotation;
+            camera_path.sample(camera_path.times[0] + camera_path.get_duration()*max(frame, 0)/max(num_frames - 1.0, 1.0), position, rotation);
+            mdopengl.camera->set_state(position, rotation);
+            Timestep *timestep = timesteps[max(frame, 0) % timesteps.size()];
+
+            double t0 = glfwGetTime();
+            timestep->update_visible_atom_list(position.x, position.y, position.z, 2000000, dr2_max);
+            draw_frame(timestep, render_mode, draw_water, color_cutoff, dr2_max, system_size, periodic_boundary_conditions, water_dr2_max);
+            double frame_time = glfwGetTime() - t0;
+            glfwSwapBuffers();
+
+            if(frame < 0) continue;
+            frame_times.push_back(frame_time);
+            num_atoms += timestep->visible_atom_indices.size();
+        }
+
+        if(frame_times.size() == 0) continue;
+        double total_time = 0;
+        for(int i=0; i<frame_times.size(); i++) total_time += frame_times[i];
+        std::sort(frame_times.begin(), frame_times.end());
+        int p99_index = min(int(0.99*frame_times.size()), int(frame_times.size()) - 1);
+
+        printf("%4d %8d %10.3f %10.3f %10.3f %11.3f\n", render_mode, int(frame_times.size()), 1000*frame_times[0], 1000*total_time/frame_times.size(), 1000*frame_times[p99_index], num_atoms/total_time/1e6);
+    }
+
+    glfwTerminate();
+    return 0;
+}
@@ -0,0 +1,61 @@
+// Converts the trajectory in md_visualizer.ini to one file for out-of-core playback (see MappedTrajectory.h).
+//   md_convert [output file]
+// Every step'th timestep from 0 to max_timestep is loaded like the viewer would, with the trajectory manifest
+// if there is one and in Morton order if morton_order is set, and appended. The file records the Morton order so
+// that playback does not sort again. Only one timestep is in memory at a time. Atom types are all written,
+// skip_types is applied when the file is read. The output defaults to mapped_trajectory in the ini file.
+#include <iostream>
+#include <string>
+#include <stdio.h>
+#include <omp.h>
+#include <mts0_io.h>
+#include <MappedTrajectory.h>
+#include <TaskPool.h>
+#include <IoRing.h>
+#include <CIniFile.h>
+
+using std::string;
+using std::cout;
+using std::endl;
+
+int main(int argc, char **argv)
+{
+    CIniFile ini;
+    ini.load("md_visualizer.ini");
+    int nx = ini.getint("nx");
+    int ny = ini.getint("ny");
+    int nz = ini.getint("nz");
+    int max_timestep = ini.getint("max_timestep");
+    int step = ini.getint("step");
+    string foldername_base = ini.getstring("foldername_base");
+    string output_file = argc > 1 ? string(argv[1]) : ini.getstring("mapped_trajectory");
+    TaskPool &pool = TaskPool::initialize(ini.getint("num_threads"));
+    IoRing::enabled = ini.getbool("io_uring");
+
+    if(output_file.compare("none") == 0) {
+        cout << "Error: No output file, give one as argument or set mapped_trajectory in md_visualizer.ini" << endl;
+        return 1;
+    }
+    if(step < 1) step = 1;
+
+    Mts0_io mts0_io(nx, ny, nz, max_timestep, foldername_base, false, step, 0, ini.getstring("trajectory_manifest"));
+    mts0_io.morton_order = ini.getbool("morton_order");
+
+    cout << "Converting timesteps 0 - " << max_timestep << " of " << foldername_base << " on " << pool.num_workers << " threads" << endl;
+    double t0 = omp_get_wtime();
+    MappedTrajectory trajectory;
+    if(!trajectory.create(output_file, max_timestep/step + 1, mts0_io.morton_order ? MAPPED_MORTON_ORDER : 0)) return 1;
+    double total_bytes = 0;
+    for(int timestep=0; timestep<=max_timestep; timestep+=step) {
+        Timestep *loaded = mts0_io.get_timestep(timestep, 0, 0, 0, 0, 0);
+        if(!trajectory.append(timestep, loaded)) return 1;
+        total_bytes += trajectory.entries.back().get_size();
+        cout << "Converted timestep " << timestep << ": " << loaded->get_number_of_atoms() << " atoms" << endl;
+        mts0_io.release_timestep(loaded);
+    }
+
+    if(!trajectory.finish()) return 1;
+    cout << "Wrote " << total_bytes/(1024*1024*1024) << " GB to " << output_file << " in " << omp_get_wtime() - t0 << " s" << endl;
+
+    return 0;
+}
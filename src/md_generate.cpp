@@ -0,0 +1,296 @@
+// Synthetic trajectory generator. Writes max_timestep+1 timesteps of nx*ny*nz mts0 node files
+// (%06d/mts0/mt%04d, the Fortran record layout read by Timestep::read_mts) into generate_foldername_base,
+// so that the loaders and renderers can be benchmarked at any scale without production dumps.
+// A silica slab fills the bottom generate_silica_fraction of the box, the rest is water with a
+// generate_nacl_fraction of the molecules replaced by NaCl pairs. Every atom oscillates around its
+// initial position with amplitude generate_displacement (Ångström), so any timestep can be
+// written independently and all (timestep, node) files are generated in parallel on the TaskPool.
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <math.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <omp.h>
+#include <pthread.h>
+#include <mts0_io.h>
+#include <TaskPool.h>
+#include <CIniFile.h>
+
+using std::string;
+using std::cout;
+using std::endl;
+
+#define ATOMS_PER_CUBIC_ANGSTROM 0.1
+// The atom count of a node is a 32-bit int, records of more than 2 GB are written as subrecords
+#define MAX_ATOMS_PER_NODE 2147483647L
+#define GENERATE_SLICE_ATOMS (1L << 20)
+
+pthread_mutex_t output_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+inline unsigned int xorshift(unsigned int &seed) {
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    return seed;
+}
+
+inline double random_uniform(unsigned int &seed) {
+    return xorshift(seed)*(1.0/4294967296.0);
+}
+
+// Fortran record of a known length, written in pieces so that a large record never has to be in memory
+// at once. Like gfortran, records of 2 GB and more are split into subrecords whose leading length is
+// negative if more follow and whose trailing length is negative if others came before.
+class RecordWriter {
+public:
+  RecordWriter(ofstream &file_, long bytes_) : file(file_) {
+    bytes = bytes_;
+    offset = 0;
+    begin_subrecord();
+  }
+
+  void write(void *value, long length) {
+    char *data = reinterpret_cast<char*>(value);
+    while(length > 0) {
+      if(offset == subrecord_end) {
+        end_subrecord();
+        begin_subrecord();
+      }
+      long piece = min(length, subrecord_end - offset);
+      file.write(data, piece);
+      data += piece;
+      length -= piece;
+      offset += piece;
+    }
+  }
+
+  // All bytes of the record must have been written
+  void finish() {
+    end_subrecord();
+  }
+
+private:
+  ofstream &file;
+  long bytes, offset, subrecord_begin, subrecord_end;
+
+  void begin_subrecord() {
+    const long max_subrecord_bytes = 2147483639;
+    subrecord_begin = offset;
+    subrecord_end = offset + min(bytes - offset, max_subrecord_bytes);
+    int length = subrecord_end - subrecord_begin;
+    int leading = subrecord_end < bytes ? -length : length;
+    file.write(reinterpret_cast<char*>(&leading), sizeof(int));
+  }
+
+  void end_subrecord() {
+    int length = subrecord_end - subrecord_begin;
+    int trailing = subrecord_begin > 0 ? -length : length;
+    file.write(reinterpret_cast<char*>(&trailing), sizeof(int));
+  }
+};
+
+void write_record(ofstream &file, void *value, long bytes) {
+    RecordWriter record(file, bytes);
+    record.write(value, bytes);
+    record.finish();
+}
+
+void make_directory(string directory) {
+    if(mkdir(directory.c_str(), 0755) != 0 && errno != EEXIST) {
+        cout << "Error in make_directory(): Failed to create directory " << directory << endl;
+        exit(1);
+    }
+}
+
+// Places the atoms of one node at rest, molecule by molecule. Positions are in Ångström.
+void create_node_atoms(unsigned int seed, double *node_min, double *node_max, double silica_top, double nacl_fraction, int num_atoms, vector<int> &atom_types, vector<double> &positions) {
+    atom_types.resize(num_atoms);
+    positions.resize(3*long(num_atoms));
+    int n = 0;
+
+    while(n < num_atoms) {
+        double center[3];
+        for(int k=0;k<3;k++) center[k] = node_min[k] + (node_max[k] - node_min[k])*random_uniform(seed);
+
+        // Atom types of the molecule, the first atom sits at the centre. Bond lengths in Ångström
+        int molecule_types[3];
+        double bond_length;
+        int molecule_size;
+        if(center[2] < silica_top) {
+            molecule_types[0] = SI_TYPE; molecule_types[1] = O_TYPE; molecule_types[2] = O_TYPE;
+            bond_length = 1.6;
+            molecule_size = 3;
+        } else if(random_uniform(seed) < nacl_fraction) {
+            molecule_types[0] = NA_TYPE; molecule_types[1] = CL_TYPE;
+            bond_length = 2.8;
+            molecule_size = 2;
+        } else {
+            molecule_types[0] = O_TYPE; molecule_types[1] = H_TYPE; molecule_types[2] = H_TYPE;
+            bond_length = 0.96;
+            molecule_size = 3;
+        }
+
+        for(int i=0; i<molecule_size && n < num_atoms; i++, n++) {
+            atom_types[n] = molecule_types[i];
+            for(int k=0;k<3;k++) {
+                double offset = i == 0 ? 0 : bond_length*(2*random_uniform(seed) - 1)/sqrt(3.0);
+                positions[3*long(n)+k] = center[k] + offset;
+            }
+        }
+    }
+}
+
+// One (timestep, node) file per job
+class GenerateNodeFiles {
+public:
+  string foldername_base;
+  int nx, ny, nz, num_nodes, num_jobs;
+  long num_atoms, atoms_per_node;
+  double system_length, silica_fraction, nacl_fraction, displacement;
+  double *h_matrix;
+  int jobs_done;
+
+  void operator()(int begin, int end, int worker) {
+    for(int job=begin; job<end; job++) {
+      int timestep = job/num_nodes;
+      int node_id = job % num_nodes;
+      int node_index[3] = {node_id/(ny*nz), (node_id/nz) % ny, node_id % nz};
+      int node_count[3] = {nx, ny, nz};
+
+      // The remainder of num_atoms/num_nodes goes to the first nodes
+      long first_atom = node_id*atoms_per_node + min(long(node_id), num_atoms % num_nodes);
+      int num_atoms_local = atoms_per_node + (node_id < num_atoms % num_nodes ? 1 : 0);
+
+      double node_min[3], node_max[3];
+      for(int k=0;k<3;k++) {
+        node_min[k] = system_length*node_index[k]/node_count[k];
+        node_max[k] = system_length*(node_index[k]+1)/node_count[k];
+      }
+
+      // Same seed for a node in every timestep, so that the atoms only move by the displacement
+      vector<int> atom_types;
+      vector<double> positions;
+      unsigned int seed = 2463534242u ^ (unsigned int)(node_id*2654435761u);
+      create_node_atoms(seed, node_min, node_max, silica_fraction*system_length, nacl_fraction, num_atoms_local, atom_types, positions);
+
+      char filename[5000];
+      sprintf(filename, "%s/%06d/mts0/mt%04d", foldername_base.c_str(), timestep, node_id);
+      ofstream file(filename, ios::out | ios::binary);
+      if(!file) {
+        cout << "Error in md_generate: Failed to open file " << filename << endl;
+        exit(1);
+      }
+      write_record(file, &num_atoms_local, sizeof(int));
+
+      // The records are computed and written GENERATE_SLICE_ATOMS atoms at a time
+      ArenaScope scope(TaskPool::instance().arena(worker));
+      long slice_atoms = max(1L, min(long(num_atoms_local), GENERATE_SLICE_ATOMS));
+      double *slice = (double*)scope.arena.allocate(3*slice_atoms*sizeof(double));
+
+      RecordWriter atom_record(file, long(num_atoms_local)*sizeof(double));
+      for(long first=0; first<num_atoms_local; first+=slice_atoms) {
+        long count = min(slice_atoms, num_atoms_local - first);
+        for(long i=0; i<count; i++) slice[i] = atom_types[first+i] + (first_atom + first + i + 1)*1e-11;
+        atom_record.write(slice, count*sizeof(double));
+      }
+      atom_record.finish();
+
+      // The phase space record is all positions, then all velocities. Both blocks draw the same phases.
+      RecordWriter phase_space_record(file, 6*long(num_atoms_local)*sizeof(double));
+      for(int block=0; block<2; block++) {
+        unsigned int phase_seed = seed ^ 0x9e3779b9u;
+        for(long first=0; first<num_atoms_local; first+=slice_atoms) {
+          long count = min(slice_atoms, num_atoms_local - first);
+          for(long i=0; i<count; i++) {
+            for(int k=0;k<3;k++) {
+              double phase = 2*M_PI*random_uniform(phase_seed);
+              if(block == 0) {
+                double position = positions[3*(first+i)+k] + displacement*sin(0.3*timestep + phase);
+                // Node files store positions in reduced units relative to the node origin
+                slice[3*i+k] = position/system_length - double(node_index[k])/node_count[k];
+              } else slice[3*i+k] = 0.3*displacement*cos(0.3*timestep + phase);
+            }
+          }
+          phase_space_record.write(slice, 3*count*sizeof(double));
+        }
+      }
+      phase_space_record.finish();
+      write_record(file, h_matrix, 18*sizeof(double));
+      file.close();
+
+      int done = __sync_add_and_fetch(&jobs_done, 1);
+      if(node_id == num_nodes-1 || done == num_jobs) {
+        pthread_mutex_lock(&output_mutex);
+        cout << "Wrote " << done << " of " << num_jobs << " node files" << endl;
+        pthread_mutex_unlock(&output_mutex);
+      }
+    }
+  }
+};
+
+int main(int argc, char **argv)
+{
+    CIniFile ini;
+    ini.load("md_visualizer.ini");
+    int nx = ini.getint("nx");
+    int ny = ini.getint("ny");
+    int nz = ini.getint("nz");
+    int max_timestep = ini.getint("max_timestep");
+    string foldername_base = ini.getstring("generate_foldername_base");
+    long num_atoms = long(ini.getdouble("generate_num_atoms"));
+    double silica_fraction = ini.getdouble("generate_silica_fraction");
+    double nacl_fraction = ini.getdouble("generate_nacl_fraction");
+    double displacement = ini.getdouble("generate_displacement");
+    TaskPool &pool = TaskPool::initialize(ini.getint("num_threads"));
+
+    int num_nodes = nx*ny*nz;
+    long atoms_per_node = num_atoms/num_nodes;
+    if(atoms_per_node + 1 > MAX_ATOMS_PER_NODE) {
+        cout << "Error: " << atoms_per_node << " atoms per node do not fit in an mts0 record, increase nx, ny or nz." << endl;
+        exit(1);
+    }
+
+    // Cubic box at liquid water density
+    double system_length = pow(num_atoms/ATOMS_PER_CUBIC_ANGSTROM, 1.0/3);
+    double h_matrix[18];
+    for(int i=0;i<18;i++) h_matrix[i] = 0;
+    for(int k=0;k<2;k++) {
+        for(int i=0;i<3;i++) h_matrix[9*k + 4*i] = system_length/Timestep::bohr;
+    }
+
+    cout << "Generating " << max_timestep+1 << " timesteps of " << num_atoms << " atoms (" << num_nodes << " nodes, " << system_length << " Å box) in " << foldername_base << " on " << pool.num_workers << " threads" << endl;
+
+    char directory[5000];
+    make_directory(foldername_base);
+    for(int timestep=0; timestep<=max_timestep; timestep++) {
+        sprintf(directory, "%s/%06d", foldername_base.c_str(), timestep);
+        make_directory(string(directory));
+        sprintf(directory, "%s/%06d/mts0", foldername_base.c_str(), timestep);
+        make_directory(string(directory));
+    }
+
+    double t0 = omp_get_wtime();
+    int num_jobs = (max_timestep+1)*num_nodes;
+
+    GenerateNodeFiles generate;
+    generate.foldername_base = foldername_base;
+    generate.nx = nx; generate.ny = ny; generate.nz = nz;
+    generate.num_nodes = num_nodes;
+    generate.num_jobs = num_jobs;
+    generate.num_atoms = num_atoms;
+    generate.atoms_per_node = atoms_per_node;
+    generate.system_length = system_length;
+    generate.silica_fraction = silica_fraction;
+    generate.nacl_fraction = nacl_fraction;
+    generate.displacement = displacement;
+    generate.h_matrix = h_matrix;
+    generate.jobs_done = 0;
+    parallel_for(0, num_jobs, 1, generate);
+
+    double generate_time = omp_get_wtime() - t0;
+    double bytes = double(num_atoms)*(max_timestep+1)*56;
+    cout << "Generated " << (max_timestep+1)*num_atoms << " atoms in " << generate_time << " s (" << bytes/generate_time/1e6 << " MB/s)" << endl;
+    return 0;
+}
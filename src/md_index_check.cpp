@@ -0,0 +1,314 @@
+// Checks the atom index and offset arithmetic of the data path with atom counts above 2^31, without
+// allocating atoms for them.
+//   md_index_check [scratch file]
+// Covers the chunking of the loops over all atoms (culling, partitioning, ambient occlusion, copying out of a
+// mapped trajectory), the visible type ranges, the culling and billboard kernels of the viewer run over a sparse
+// position array, the node offsets planned from a manifest and the timestep table of a mapped trajectory.
+// The mapped trajectory is a sparse file of about 72 GB, written to the scratch file (md_index_check.<pid>.mdtr
+// in $TMPDIR or /tmp by default) and removed again on exit. Prints every failed check and exits with 1 if there were any.
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <string>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <mts0_io.h>
+#include <TrajectoryManifest.h>
+#include <MappedTrajectory.h>
+#include <MDBillboards.h>
+
+using std::cout;
+using std::endl;
+
+#define CHECK_CHUNK_SIZE 65536
+#define TWO_TO_31 2147483648L
+
+int num_failed = 0;
+string scratch_file;
+
+void check(bool passed, string description) {
+    if(passed) return;
+    cout << "FAILED: " << description << endl;
+    num_failed++;
+}
+
+// The chunks of num_atoms must cover every atom exactly once, also when parallel_for hands out ranges of chunks
+void check_chunks(long num_atoms) {
+    char description[200];
+    sprintf(description, "chunks of %ld atoms", num_atoms);
+    int num_chunks = get_num_chunks(num_atoms, CHECK_CHUNK_SIZE);
+    check(num_chunks > 0 && get_chunk_begin(num_chunks-1, CHECK_CHUNK_SIZE) < num_atoms, string(description) + ", last chunk is empty");
+    check(get_chunk_end(num_chunks-1, CHECK_CHUNK_SIZE, num_atoms) == num_atoms, string(description) + ", last chunk does not end at the last atom");
+
+    const int grain = 7;
+    long covered = 0;
+    long next = 0;
+    for(int begin=0; begin<num_chunks; begin+=grain) {
+        int end = min(begin + grain, num_chunks);
+        long first = get_chunk_begin(begin, CHECK_CHUNK_SIZE);
+        long last = get_chunk_end(end-1, CHECK_CHUNK_SIZE, num_atoms);
+        if(first != next) break;
+        covered += last - first;
+        next = last;
+    }
+    check(covered == num_atoms, string(description) + ", ranges of chunks do not cover the atoms");
+}
+
+// Type of the atom at index n, from the type runs
+int find_type(vector<TypeRange> &type_runs, long n) {
+    for(int run=0; run<type_runs.size(); run++) {
+        if(n >= type_runs[run].begin && n < type_runs[run].end) return type_runs[run].type;
+    }
+    return -1;
+}
+
+void check_type_ranges() {
+    // One run per type, then the runs of a streamed region appended after them
+    long starts[NUM_ATOM_TYPES+2] = {0, 0, 1200000000L, TWO_TO_31, 2*TWO_TO_31 + 5, 2*TWO_TO_31 + 5, 5000000000L, 6000000000L, 6500000000L};
+    vector<TypeRange> type_runs;
+    for(int type=0; type<=NUM_ATOM_TYPES; type++) {
+        TypeRange type_run;
+        type_run.type = type;
+        type_run.begin = starts[type];
+        type_run.end = starts[type+1];
+        if(type_run.end > type_run.begin) type_runs.push_back(type_run);
+    }
+    int region_types[3] = {SI_TYPE, H_TYPE, O_TYPE};
+    for(int i=0; i<3; i++) {
+        TypeRange type_run;
+        type_run.type = region_types[i];
+        type_run.begin = type_runs.back().end;
+        type_run.end = type_run.begin + 700000000L;
+        type_runs.push_back(type_run);
+    }
+
+    // Atoms on both sides of every run boundary
+    vector<long> atom_indices;
+    for(int run=0; run<type_runs.size(); run++) {
+        for(long n=type_runs[run].end-2; n<=type_runs[run].end+1; n++) {
+            if(n >= 0 && n < type_runs.back().end && (atom_indices.size() == 0 || n > atom_indices.back())) atom_indices.push_back(n);
+        }
+    }
+
+    vector<TypeRange> type_ranges;
+    Timestep::find_type_ranges(atom_indices, type_runs, type_ranges);
+    long num_ranged = 0;
+    for(int i=0; i<type_ranges.size(); i++) {
+        TypeRange &range = type_ranges[i];
+        for(long index=range.begin; index<range.end; index++) {
+            if(find_type(type_runs, atom_indices[index]) != range.type) {
+                char description[200];
+                sprintf(description, "type range %d holds atom %ld of type %d", range.type, atom_indices[index], find_type(type_runs, atom_indices[index]));
+                check(false, string(description));
+            }
+        }
+        num_ranged += range.end - range.begin;
+    }
+    check(num_ranged == atom_indices.size(), "type ranges do not cover the visible atoms");
+}
+
+// Position of one atom of SparsePositions, positions[n][k] as for a timestep
+class SparsePosition {
+public:
+    float x;
+    float operator[](int k) const { return k == 0 ? x : 0; }
+};
+
+// Positions of num_atoms atoms without storing them: the atoms on both sides of every multiple of 2^30 and the
+// last atoms are between 10 and 11 Å from the origin, all others 1000 Å away
+class SparsePositions {
+public:
+    long num_atoms;
+
+    bool is_near(long n) const {
+        long offset = n & (TWO_TO_31/2 - 1);
+        return offset < 2 || offset >= TWO_TO_31/2 - 2 || n >= num_atoms - 2;
+    }
+    SparsePosition operator[](long n) const {
+        SparsePosition position;
+        position.x = is_near(n) ? 10 + (n % 1000)*0.001 : 1000;
+        return position;
+    }
+};
+
+template<int render_mode>
+void check_billboards(SparsePositions &positions, vector<long> &visible_atom_indices, vector<TypeRange> &type_ranges) {
+    MDBillboardFrame frame;
+    frame.cam_x = frame.cam_y = frame.cam_z = 0;
+    frame.direction[0] = 1; frame.direction[1] = 0; frame.direction[2] = 0;
+    double corners[4][3] = {{0, 1, 1}, {0, -1, 1}, {0, -1, -1}, {0, 1, -1}};
+    memcpy(frame.corners, corners, sizeof(corners));
+    frame.one_over_color_cutoff = 1.0/1000;
+    frame.dr2_max = frame.water_dr2_max = 1000;
+    for(int k=0; k<3; k++) frame.system_size[k] = 100;
+
+    MDBillboardBuffers buffers;
+    vector<float> vertices(4*3*MAX_NUM_ATOMS);
+    vector<float> colors(4*MAX_NUM_ATOMS);
+    vector<int> indices(4*MAX_NUM_ATOMS);
+    buffers.vertices = &vertices[0];
+    buffers.colors = &colors[0];
+    buffers.indices = &indices[0];
+    vector<float> ambient_occlusion;
+    int num_vertices = dispatch_billboards<render_mode>(frame, buffers, visible_atom_indices, type_ranges, positions, ambient_occlusion, true, false);
+
+    char description[200];
+    sprintf(description, "render mode %d billboards, %d vertices for %ld visible atoms", render_mode, num_vertices, long(visible_atom_indices.size()));
+    if(num_vertices != 4*visible_atom_indices.size()) {
+        check(false, string(description));
+        return;
+    }
+    // The corners have no x component, so every vertex of a quad has the x coordinate of its atom
+    float *quad_vertices = render_mode == 3 ? buffers.vertices : &buffers.billboard_vertices[0];
+    for(long i=0; i<visible_atom_indices.size(); i++) {
+        float x = positions[visible_atom_indices[i]][0];
+        for(int corner=0; corner<4; corner++) {
+            if(quad_vertices[12*i + 3*corner] != x) {
+                sprintf(description, "render mode %d billboard %ld is not at atom %ld", render_mode, i, visible_atom_indices[i]);
+                check(false, string(description));
+                return;
+            }
+        }
+    }
+}
+
+// Culls a timestep of more than 2^32 atoms with the culling of the viewer, types the visible atoms and builds
+// their billboards
+void check_visible_atoms() {
+    SparsePositions positions;
+    positions.num_atoms = 2*TWO_TO_31 + 5;
+
+    vector<long> expected;
+    for(long boundary=0; boundary<=positions.num_atoms; boundary+=TWO_TO_31/2) {
+        for(long n=boundary-2; n<boundary+2; n++) {
+            if(n >= 0 && n < positions.num_atoms - 2) expected.push_back(n);
+        }
+    }
+    for(long n=positions.num_atoms-2; n<positions.num_atoms; n++) expected.push_back(n);
+
+    vector<long> visible_atom_indices;
+    cull_atoms(positions, positions.num_atoms, 0, 0, 0, 1000, visible_atom_indices);
+    check(visible_atom_indices == expected, "culling of 2^32 + 5 atoms, visible atoms are not the atoms near the camera");
+
+    TypeRange type_runs[3] = {{SI_TYPE, 0, TWO_TO_31}, {H_TYPE, TWO_TO_31, 2*TWO_TO_31}, {O_TYPE, 2*TWO_TO_31, positions.num_atoms}};
+    vector<TypeRange> runs(type_runs, type_runs + 3);
+    vector<TypeRange> type_ranges;
+    Timestep::find_type_ranges(visible_atom_indices, runs, type_ranges);
+    long num_ranged = 0;
+    for(int i=0; i<type_ranges.size(); i++) {
+        for(long index=type_ranges[i].begin; index<type_ranges[i].end; index++) {
+            if(find_type(runs, visible_atom_indices[index]) != type_ranges[i].type) check(false, "type ranges of the visible atoms of 2^32 + 5 atoms");
+        }
+        num_ranged += type_ranges[i].end - type_ranges[i].begin;
+    }
+    check(num_ranged == visible_atom_indices.size(), "type ranges do not cover the visible atoms of 2^32 + 5 atoms");
+
+    check_billboards<1>(positions, visible_atom_indices, type_ranges);
+    check_billboards<2>(positions, visible_atom_indices, type_ranges);
+    check_billboards<3>(positions, visible_atom_indices, type_ranges);
+}
+
+void check_node_offsets() {
+    long node_atoms[5] = {1500000000L, TWO_TO_31, 7, 0, 3000000000L};
+    TimestepManifest manifest;
+    manifest.nodes.resize(5);
+    for(int node_id=0; node_id<5; node_id++) {
+        NodeManifest &node = manifest.nodes[node_id];
+        node.num_atoms = node_atoms[node_id];
+        for(int type=1; type<=MANIFEST_NUM_TYPES; type++) node.type_counts[type-1] = 0;
+        node.type_counts[H_TYPE-1] = node.num_atoms/3;
+        node.type_counts[O_TYPE-1] = node.num_atoms/6;
+        node.type_counts[SI_TYPE-1] = node.num_atoms - node.type_counts[H_TYPE-1] - node.type_counts[O_TYPE-1];
+    }
+    bool skip_types[NUM_ATOM_TYPES+1];
+    for(int type=0; type<=NUM_ATOM_TYPES; type++) skip_types[type] = false;
+    skip_types[O_TYPE] = true;
+
+    int order[5] = {4, 0, 1, 3, 2};
+    vector<int> node_ids(order, order + 5);
+    long first_atom = TWO_TO_31 + 3;
+    vector<long> node_offsets;
+    long end = manifest.get_node_offsets(node_ids, skip_types, first_atom, node_offsets);
+
+    long expected = first_atom;
+    for(int i=0; i<node_ids.size(); i++) {
+        NodeManifest &node = manifest.nodes[node_ids[i]];
+        char description[200];
+        sprintf(description, "node %d starts at atom %ld, expected %ld", node_ids[i], node_offsets[i], expected);
+        check(node_offsets[i] == expected, string(description));
+        expected += node.num_atoms - node.type_counts[O_TYPE-1];
+    }
+    check(end == expected, "node offsets end at the wrong atom");
+}
+
+// Writes the table of a mapped trajectory whose second timestep has more than 2^31 atoms and starts past 4 GB,
+// with the atom data left as a hole in the file
+bool write_mapped_table(string filename, long truncate_by) {
+    MappedTimestepEntry entries[2];
+    memset(entries, 0, sizeof(entries));
+    entries[0].timestep = 0;
+    entries[0].num_atoms = 100;
+    entries[0].offset = MAPPED_TRAJECTORY_ALIGNMENT;
+    entries[1].timestep = 1;
+    entries[1].num_atoms = 3000000000L;
+    entries[1].offset = 2*TWO_TO_31 + MAPPED_TRAJECTORY_ALIGNMENT;
+    for(int i=0; i<2; i++) entries[i].h_matrix[0] = entries[i].h_matrix[4] = entries[i].h_matrix[8] = 100/Timestep::bohr;
+
+    ofstream file(filename.c_str(), ios::out | ios::binary);
+    int header[3] = {MAPPED_TRAJECTORY_VERSION, 2, 0};
+    file.write("MDTR", 4);
+    file.write(reinterpret_cast<char*>(header), sizeof(header));
+    file.write(reinterpret_cast<char*>(entries), sizeof(entries));
+    file.close();
+    return file && truncate(filename.c_str(), entries[1].offset + entries[1].get_size() - truncate_by) == 0;
+}
+
+void check_mapped_table(string filename) {
+    if(!write_mapped_table(filename, 0)) {
+        cout << "Could not write " << filename << ", skipping the mapped trajectory checks" << endl;
+        return;
+    }
+    MappedTrajectory trajectory;
+    check(trajectory.open(filename), "mapped trajectory with a timestep of 3e9 atoms was rejected");
+    MappedTimestepEntry *entry = trajectory.get(1);
+    check(entry != 0 && entry->num_atoms == 3000000000L, "timestep of 3e9 atoms is not in the table");
+    if(entry) {
+        check(entry->get_size() == 3000000000L*(3*sizeof(float) + sizeof(long) + sizeof(int)), "size of the timestep of 3e9 atoms");
+        check(trajectory.get_resident_bytes(entry) >= 0, "resident bytes of the timestep of 3e9 atoms");
+    }
+    trajectory.close();
+
+    cout << "A truncated file must be reported:" << endl;
+    if(write_mapped_table(filename, 1)) check(!trajectory.open(filename), "mapped trajectory missing its last byte was accepted");
+}
+
+// Also runs when a check exits early, the scratch file is tens of GB in size
+void remove_scratch_file() {
+    if(scratch_file.size() > 0) remove(scratch_file.c_str());
+}
+
+int main(int argc, char **argv)
+{
+    if(argc > 1) scratch_file = string(argv[1]);
+    else {
+        char filename[100];
+        sprintf(filename, "/md_index_check.%d.mdtr", int(getpid()));
+        scratch_file = string(getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp") + filename;
+    }
+    atexit(remove_scratch_file);
+
+    long num_atoms[6] = {TWO_TO_31 - 1, TWO_TO_31, TWO_TO_31 + 1, 3000000000L, 2*TWO_TO_31 + CHECK_CHUNK_SIZE, 100000000000L};
+    for(int i=0; i<6; i++) check_chunks(num_atoms[i]);
+    check_type_ranges();
+    check_visible_atoms();
+    check_node_offsets();
+    check_mapped_table(scratch_file);
+
+    if(num_failed > 0) {
+        cout << num_failed << " checks failed" << endl;
+        return 1;
+    }
+    cout << "All index checks passed" << endl;
+    return 0;
+}
@@ -0,0 +1,57 @@
+// Writes the trajectory manifest (see TrajectoryManifest.h) for the trajectory in md_visualizer.ini.
+//   md_manifest [output file]
+// Every step'th timestep from 0 to max_timestep in foldername_base is scanned, the node files of a
+// timestep in parallel on the TaskPool. The output defaults to trajectory_manifest in the ini file.
+#include <iostream>
+#include <string>
+#include <stdio.h>
+#include <omp.h>
+#include <mts0_io.h>
+#include <TrajectoryManifest.h>
+#include <TaskPool.h>
+#include <IoRing.h>
+#include <CIniFile.h>
+
+using std::string;
+using std::cout;
+using std::endl;
+
+int main(int argc, char **argv)
+{
+    CIniFile ini;
+    ini.load("md_visualizer.ini");
+    int nx = ini.getint("nx");
+    int ny = ini.getint("ny");
+    int nz = ini.getint("nz");
+    int max_timestep = ini.getint("max_timestep");
+    int step = ini.getint("step");
+    string foldername_base = ini.getstring("foldername_base");
+    string manifest_file = argc > 1 ? string(argv[1]) : ini.getstring("trajectory_manifest");
+    TaskPool &pool = TaskPool::initialize(ini.getint("num_threads"));
+    IoRing::enabled = ini.getbool("io_uring");
+
+    if(manifest_file.compare("none") == 0) {
+        cout << "Error: No output file, give one as argument or set trajectory_manifest in md_visualizer.ini" << endl;
+        return 1;
+    }
+    if(step < 1) step = 1;
+
+    cout << "Scanning timesteps 0 - " << max_timestep << " of " << foldername_base << " on " << pool.num_workers << " threads" << endl;
+    double t0 = omp_get_wtime();
+    TrajectoryManifest manifest;
+    manifest.nx = nx;
+    manifest.ny = ny;
+    manifest.nz = nz;
+    char mts0_directory[5000];
+    for(int timestep=0; timestep<=max_timestep; timestep+=step) {
+        sprintf(mts0_directory, "%s/%06d/mts0/", foldername_base.c_str(), timestep);
+        if(!manifest.scan_timestep(string(mts0_directory), timestep)) return 1;
+        cout << "Scanned timestep " << timestep << ": " << manifest.timesteps.back().get_number_of_atoms() << " atoms" << endl;
+    }
+
+    if(!manifest.save(manifest_file)) return 1;
+    cout << "Wrote " << manifest_file << " in " << omp_get_wtime() - t0 << " s" << endl;
+    manifest.print_statistics();
+
+    return 0;
+}
@@ -0,0 +1,48 @@
+// Packs the node files of every timestep of the trajectory in md_visualizer.ini into one file per timestep (see NodePack.h).
+//   md_pack
+// Every step'th timestep from 0 to max_timestep in foldername_base gets <timestep>/mts0.pack. The node files are
+// left in place, they are no longer read once the pack exists and can be removed.
+#include <iostream>
+#include <string>
+#include <stdio.h>
+#include <omp.h>
+#include <NodePack.h>
+#include <CIniFile.h>
+
+using std::string;
+using std::cout;
+using std::endl;
+
+int main(int argc, char **argv)
+{
+    CIniFile ini;
+    ini.load("md_visualizer.ini");
+    int nx = ini.getint("nx");
+    int ny = ini.getint("ny");
+    int nz = ini.getint("nz");
+    int max_timestep = ini.getint("max_timestep");
+    int step = ini.getint("step");
+    string foldername_base = ini.getstring("foldername_base");
+    if(step < 1) step = 1;
+
+    cout << "Packing timesteps 0 - " << max_timestep << " of " << foldername_base << endl;
+    double t0 = omp_get_wtime();
+    double total_bytes = 0;
+    char mts0_directory[5000];
+    for(int timestep=0; timestep<=max_timestep; timestep+=step) {
+        sprintf(mts0_directory, "%s/%06d/mts0/", foldername_base.c_str(), timestep);
+        string pack_file = NodePack::get_filename(string(mts0_directory));
+        if(!NodePack::write(string(mts0_directory), nx*ny*nz, pack_file)) return 1;
+
+        NodePack pack;
+        if(!pack.open(pack_file)) return 1;
+        long bytes = 0;
+        for(int node_id=0; node_id<pack.nodes.size(); node_id++) bytes += pack.nodes[node_id].size;
+        total_bytes += bytes;
+        cout << "Packed timestep " << timestep << ": " << pack.nodes.size() << " node files, " << bytes/(1024.0*1024) << " MB" << endl;
+    }
+
+    double seconds = omp_get_wtime() - t0;
+    cout << "Packed " << total_bytes/(1024*1024) << " MB in " << seconds << " s (" << total_bytes/(1024*1024)/seconds << " MB/s)" << endl;
+    return 0;
+}
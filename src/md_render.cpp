@@ -0,0 +1,158 @@
+// Headless batch renderer. Draws every timestep with MDSoftwareRenderer or MDRayTracer (no OpenGL needed)
+// from the camera given in md_visualizer.ini and saves the frames as frames/%06d.bmp. With render_camera_path
+// set, the camera follows the recorded path instead, resampled at render_path_fps frames per second.
+#include <iostream>
+#include <string>
+#include <omp.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <mts0_io.h>
+#include <CIniFile.h>
+#include <CBitMap.h>
+#include <CVector.h>
+#include <MDSoftwareRenderer.h>
+#include <MDRayTracer.h>
+#include <CameraPath.h>
+#include <TaskPool.h>
+#include <IoRing.h>
+
+using std::string;
+using std::cout;
+using std::endl;
+
+void make_directory(string directory) {
+    if(mkdir(directory.c_str(), 0755) != 0 && errno != EEXIST) {
+        cout << "Error in make_directory(): Failed to create directory " << directory << endl;
+        exit(1);
+    }
+}
+
+// Encodes and writes a frame on the task pool while the next frame is rendered
+class SaveFrameTask : public PoolTask {
+public:
+  CBitMap *bmp;
+  string filename;
+
+  SaveFrameTask(CBitMap *bmp_, string filename_) {
+    bmp = bmp_;
+    filename = filename_;
+  }
+
+  void execute(int worker) {
+    if(!bmp->SaveBMP(filename)) cout << "Error in SaveFrameTask::execute(): Failed to write " << filename << endl;
+  }
+};
+
+int main(int argc, char **argv)
+{
+    CIniFile ini;
+    ini.load("md_visualizer.ini");
+    int nx = ini.getint("nx");
+    int ny = ini.getint("ny");
+    int nz = ini.getint("nz");
+    bool preload = ini.getbool("preload");
+    int max_timestep = ini.getint("max_timestep");
+    string foldername_base = ini.getstring("foldername_base");
+    double dr2_max = ini.getdouble("dr2_max");
+    double water_dr2_max = ini.getdouble("water_dr2_max");
+    double color_cutoff = ini.getdouble("color_cutoff");
+    bool periodic_boundary_conditions = ini.getbool("periodic_boundary_conditions");
+    int step = ini.getint("step");
+    int width = ini.getint("screen_width");
+    int height = ini.getint("screen_height");
+    int tile_size = ini.getint("render_tile_size");
+    CVector camera_position = ini.getvector("render_camera_position");
+    CVector camera_rotation = ini.getvector("render_camera_rotation");
+    string render_backend = ini.getstring("render_backend");
+    bool raytrace = render_backend.compare("raytrace") == 0;
+    double ambient_occlusion_radius = ini.getdouble("ambient_occlusion_radius");
+    string camera_path_file = ini.getstring("render_camera_path");
+    double path_fps = ini.getdouble("render_path_fps");
+    bool draw_water = true;
+    int time_direction = 1;
+    TaskPool &pool = TaskPool::initialize(ini.getint("num_threads"));
+    IoRing::enabled = ini.getbool("io_uring");
+
+    MDSoftwareRenderer renderer(width, height, tile_size);
+    renderer.load_png("sphere2.png");
+    MDRayTracer ray_tracer(width, height, tile_size);
+    ray_tracer.samples_per_pixel = ini.getint("raytrace_samples");
+    ray_tracer.ao_samples = ini.getint("raytrace_ao_samples");
+    ray_tracer.ao_distance = ini.getdouble("raytrace_ao_distance");
+    cout << (raytrace ? "Ray tracer: " : "Software renderer: ") << width << "x" << height << " pixels, " << renderer.tiles_x*renderer.tiles_y << " tiles, " << renderer.num_threads << " threads" << endl;
+    cout << "Node files are read " << (IoRing::is_available() ? "in io_uring batches" : "with blocking calls") << endl;
+
+    Mts0_io *mts0_io = new Mts0_io(nx,ny,nz,max_timestep, foldername_base, preload, step, ambient_occlusion_radius, ini.getstring("trajectory_manifest"));
+    mts0_io->region_of_interest = ini.getbool("region_of_interest_loading");
+    mts0_io->region_margin = ini.getdouble("region_of_interest_margin");
+    mts0_io->set_skip_types(ini.getstring("skip_types"));
+    mts0_io->morton_order = ini.getbool("morton_order");
+    mts0_io->open_mapped_trajectory(ini.getstring("mapped_trajectory"), ini.getint("mapped_readahead"));
+    make_directory("frames");
+    // Two bitmaps so that one frame can be saved while the next is copied in
+    CBitMap *bitmaps[2];
+    for(int i=0; i<2; i++) {
+        bitmaps[i] = new CBitMap();
+        bitmaps[i]->Create(width, height);
+    }
+    TaskGroup save_group;
+    char filename[50];
+
+    int num_frames = max_timestep/step + 1;
+    CameraPath camera_path;
+    bool follow_camera_path = camera_path_file.compare("none") != 0;
+    if(follow_camera_path) {
+        if(!camera_path.load(camera_path_file)) exit(1);
+        num_frames = int(camera_path.get_duration()*path_fps) + 1;
+        cout << "Camera path " << camera_path_file << ": " << camera_path.get_number_of_keyframes() << " keyframes, " << num_frames << " frames at " << path_fps << " fps" << endl;
+    }
+    double total_render_time = 0;
+    double total_atoms = 0;
+
+    for(int frame=0; frame<num_frames; frame++) {
+        if(follow_camera_path) camera_path.sample(camera_path.times[0] + frame/path_fps, camera_position, camera_rotation);
+        double t0 = omp_get_wtime();
+        Timestep *timestep = mts0_io->get_next_timestep(time_direction, camera_position.x, camera_position.y, camera_position.z, 2000000, dr2_max);
+        vector<float> system_size = timestep->get_lx_ly_lz();
+        if(preload) timestep->update_visible_atom_list(camera_position.x, camera_position.y, camera_position.z, 2000000, dr2_max);
+        double load_time = omp_get_wtime() - t0;
+
+        sprintf(filename,"frames/%06d.bmp", frame);
+        CBitMap *bmp = bitmaps[frame % 2];
+        if(raytrace) {
+            ray_tracer.build_bvh(timestep, camera_position.x, camera_position.y, camera_position.z, draw_water, dr2_max, system_size, periodic_boundary_conditions, water_dr2_max);
+            ray_tracer.render(camera_position.x, camera_position.y, camera_position.z, camera_rotation.x, camera_rotation.y);
+            save_group.wait(); // The previous frame, which used the other bitmap
+            ray_tracer.copy_to_bitmap(bmp);
+            save_group.run(new SaveFrameTask(bmp, string(filename)));
+
+            double frame_time = ray_tracer.build_time + ray_tracer.render_time;
+            total_render_time += frame_time;
+            cout << "Saved frame " << filename << " (timestep " << mts0_io->current_timestep << "): load " << load_time << " s, bvh " << ray_tracer.build_time << " s, trace " << ray_tracer.render_time << " s, " << ray_tracer.rays_per_second/1e6 << " M rays/s" << endl;
+        } else {
+            renderer.render(timestep, camera_position.x, camera_position.y, camera_position.z, camera_rotation.x, camera_rotation.y, draw_water, color_cutoff, dr2_max, system_size, periodic_boundary_conditions, water_dr2_max);
+            save_group.wait(); // The previous frame, which used the other bitmap
+            renderer.copy_to_bitmap(bmp);
+            save_group.run(new SaveFrameTask(bmp, string(filename)));
+
+            total_render_time += renderer.render_time;
+            cout << "Saved frame " << filename << " (timestep " << mts0_io->current_timestep << "): load " << load_time << " s, render " << renderer.render_time << " s, " << renderer.num_splats << " splats, " << timestep->visible_atom_indices.size()/renderer.render_time/1e6 << " M atoms/s" << endl;
+        }
+        if(mts0_io->mapped_trajectory && mts0_io->resident_bytes >= 0) cout << "    " << mts0_io->resident_bytes/(1024.0*1024) << " MB resident, " << 100*mts0_io->mapped_resident_fraction << "% of the timestep was paged in before the load" << endl;
+        total_atoms += timestep->visible_atom_indices.size();
+
+        mts0_io->release_timestep(timestep); // Preload is turned off for a mapped trajectory
+    }
+
+    save_group.wait();
+
+    cout << "Rendered " << num_frames << " frames at " << num_frames/total_render_time << " fps (" << total_atoms/total_render_time/1e6 << " M atoms/s)" << endl;
+    for(int worker=0; worker<pool.num_workers; worker++) {
+        cout << "Worker " << worker << ": " << 100*pool.utilization(worker) << "% busy, " << pool.stats[worker].tasks_executed << " tasks, " << pool.stats[worker].tasks_stolen << " stolen" << endl;
+    }
+
+    for(int i=0; i<2; i++) delete bitmaps[i];
+    delete mts0_io;
+
+    return 0;
+}
@@ -0,0 +1,144 @@
+// Stress test and latency benchmark for SPSCRing, the frame handoff between the loader and render threads.
+//   md_ring_benchmark [number of messages]
+// The stress test streams sequence numbered buffers from a producer to a consumer and recycles them back
+// through a second ring, checking order and contents. The latency test bounces one message between two
+// threads and reports the one-way handoff time, next to the same ping-pong through a mutex and condition variable.
+#include <iostream>
+#include <vector>
+#include <stdlib.h>
+#include <pthread.h>
+#include <sched.h>
+#include <omp.h>
+#include <SPSCRing.h>
+
+using std::cout;
+using std::endl;
+using std::vector;
+
+#define BUFFER_SIZE 1024
+#define NUM_BUFFERS 8
+
+class StressBuffer {
+public:
+  long sequence;
+  int data[BUFFER_SIZE];
+};
+
+long num_messages = 10000000;
+
+// Busy-wait, but give up the core now and then in case the other thread shares it
+inline void spin(int &spins) {
+    if(++spins % 1000 == 0) sched_yield();
+}
+
+SPSCRing<StressBuffer*> full_buffers(4);
+SPSCRing<StressBuffer*> free_buffers(NUM_BUFFERS);
+SPSCRing<long> ping(1);
+SPSCRing<long> pong(1);
+
+void *stress_producer(void *) {
+    for(long sequence=0; sequence<num_messages; sequence++) {
+        StressBuffer *buffer;
+        int spins = 0;
+        while(!free_buffers.pop(buffer)) spin(spins);
+        buffer->sequence = sequence;
+        for(int i=0; i<BUFFER_SIZE; i++) buffer->data[i] = int(sequence) + i;
+        spins = 0;
+        while(!full_buffers.push(buffer)) spin(spins);
+    }
+    return 0;
+}
+
+void *ping_pong_echo(void *) {
+    for(long i=0; i<num_messages; i++) {
+        long value;
+        int spins = 0;
+        while(!ping.pop(value)) spin(spins);
+        spins = 0;
+        while(!pong.push(value)) spin(spins);
+    }
+    return 0;
+}
+
+// The same ping-pong with a mutex and condition variable per direction
+pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t ping_ready = PTHREAD_COND_INITIALIZER;
+pthread_cond_t pong_ready = PTHREAD_COND_INITIALIZER;
+bool has_ping = false;
+bool has_pong = false;
+
+void *mutex_echo(void *) {
+    for(long i=0; i<num_messages; i++) {
+        pthread_mutex_lock(&mutex);
+        while(!has_ping) pthread_cond_wait(&ping_ready, &mutex);
+        has_ping = false;
+        has_pong = true;
+        pthread_cond_signal(&pong_ready);
+        pthread_mutex_unlock(&mutex);
+    }
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    if(argc > 1) num_messages = atol(argv[1]);
+    pthread_t thread;
+
+    // Stress test
+    vector<StressBuffer> buffers(NUM_BUFFERS);
+    for(int i=0; i<NUM_BUFFERS; i++) free_buffers.push(&buffers[i]);
+
+    double t0 = omp_get_wtime();
+    pthread_create(&thread, 0, stress_producer, 0);
+    long errors = 0;
+    for(long sequence=0; sequence<num_messages; sequence++) {
+        StressBuffer *buffer;
+        int spins = 0;
+        while(!full_buffers.pop(buffer)) spin(spins);
+        if(buffer->sequence != sequence) errors++;
+        for(int i=0; i<BUFFER_SIZE; i+=97) {
+            if(buffer->data[i] != int(sequence) + i) errors++;
+        }
+        spins = 0;
+        while(!free_buffers.push(buffer)) spin(spins);
+    }
+    pthread_join(thread, 0);
+    double stress_time = omp_get_wtime() - t0;
+    cout << "Stress test: " << num_messages << " buffers in " << stress_time << " s (" << num_messages/stress_time/1e6 << " M/s), " << errors << " errors" << endl;
+
+    // Latency through the rings
+    t0 = omp_get_wtime();
+    pthread_create(&thread, 0, ping_pong_echo, 0);
+    for(long i=0; i<num_messages; i++) {
+        long value;
+        int spins = 0;
+        while(!ping.push(i)) spin(spins);
+        spins = 0;
+        while(!pong.pop(value)) spin(spins);
+        if(value != i) errors++;
+    }
+    pthread_join(thread, 0);
+    double ring_time = omp_get_wtime() - t0;
+
+    // Latency through a mutex, fewer round trips since they are much slower
+    long num_mutex_messages = num_messages/10;
+    long saved_num_messages = num_messages;
+    num_messages = num_mutex_messages;
+    t0 = omp_get_wtime();
+    pthread_create(&thread, 0, mutex_echo, 0);
+    for(long i=0; i<num_mutex_messages; i++) {
+        pthread_mutex_lock(&mutex);
+        has_ping = true;
+        pthread_cond_signal(&ping_ready);
+        while(!has_pong) pthread_cond_wait(&pong_ready, &mutex);
+        has_pong = false;
+        pthread_mutex_unlock(&mutex);
+    }
+    pthread_join(thread, 0);
+    double mutex_time = omp_get_wtime() - t0;
+    num_messages = saved_num_messages;
+
+    cout << "Handoff latency (one way): SPSCRing " << 1e9*ring_time/(2*num_messages) << " ns, mutex/condition variable " << 1e9*mutex_time/(2*num_mutex_messages) << " ns" << endl;
+
+    return errors > 0 ? 1 : 0;
+}
@@ -4,8 +4,33 @@
 #include <fstream>
 #include <map>
 #include <utility>
+#include <algorithm>
+#include <sstream>
+#include <omp.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <errno.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <TraceRecorder.h>
+#include <TaskPool.h>
+#include <TrajectoryManifest.h>
+#include <DepthSort.h>
+#include <MappedTrajectory.h>
+#include <IoRing.h>
+#include <NodePack.h>
 using namespace std;
 
+#define PARTITION_CHUNK_SIZE 65536
+#define MORTON_CELLS 1024
+#define AMBIENT_OCCLUSION_DENSITY 0.1   // Atoms per cubic Ångström that count as fully occluded, about that of water
+#define NODE_READS_IN_FLIGHT 32         // Node files open at a time per worker with io_uring
+#define MAX_RECORD_BYTES 2147483639L    // Longest record gfortran writes without splitting it into subrecords
+#define NODE_OPENING 0
+#define NODE_HEADER 1
+#define NODE_BODY 2
+
 string get_file_extension(string& filename){
     if(filename.find_last_of(".") != std::string::npos){
         return filename.substr(filename.find_last_of(".")+1);
@@ -22,28 +47,265 @@ string get_file_basename(string& filename){
 }
 
 char *type[] = {(char*)"Not in use", (char*)"Si",(char*)"A ",(char*)"H ",(char*)"O ",(char*)"Na",(char*)"Cl",(char*)"X "};
+                    // Not Av   Si                      Si-O       H            O      Na                   Cl
+double color_list[7][3] = {{1,1,1},{230.0/255,230.0/255,0},{0,0,1},{1.0,1.0,1.0},{1,0,0},{9.0/255,92.0/255,0},{95.0/255,216.0/255,250.0/255}};
+double visual_atom_radii[7] = {0, 1.11, 0.66, 0.35, 0.66, 1.86, 1.02};
+
+// Type of an atom in Timestep::type_runs and the visible type ranges, unknown types share type 0
+inline int type_slot(int atom_type) {
+	return atom_type > 0 && atom_type <= NUM_ATOM_TYPES ? atom_type : 0;
+}
 
-void Timestep::update_visible_atom_list(float cam_x, float cam_y, float cam_z, int number_of_visible_atoms, float dr2_max) {
+void Timestep::update_visible_atom_list(float cam_x, float cam_y, float cam_z, long number_of_visible_atoms, float dr2_max) {
+	TraceSpan span("cull");
+	double t0 = omp_get_wtime();
 	visible_atom_indices.clear();
 	visible_atom_indices.reserve(number_of_visible_atoms);
 
-	for(int n=0; n<get_number_of_atoms(); n++) {
-        double x = positions[n][0];
-        double y = positions[n][1];
-        double z = positions[n][2];
+	cull_atoms(positions, get_number_of_atoms(), cam_x, cam_y, cam_z, dr2_max, visible_atom_indices);
+
+	find_type_ranges(visible_atom_indices, type_runs, visible_type_ranges);
+	cull_time = omp_get_wtime() - t0;
+}
+
+// The non-empty type ranges of a list of increasing atom indices, which follow from the type runs of the atoms
+void Timestep::find_type_ranges(vector<long> &atom_indices, vector<TypeRange> &type_runs, vector<TypeRange> &type_ranges) {
+	type_ranges.clear();
+	for(int run=0; run<type_runs.size(); run++) {
+		TypeRange range;
+		range.type = type_runs[run].type;
+		range.begin = lower_bound(atom_indices.begin(), atom_indices.end(), type_runs[run].begin) - atom_indices.begin();
+		range.end = lower_bound(atom_indices.begin(), atom_indices.end(), type_runs[run].end) - atom_indices.begin();
+		if(range.end > range.begin) type_ranges.push_back(range);
+	}
+}
+
+// Stable counting sort of visible_atom_indices by atom type, for after the list has been reordered (depth sorting).
+// Atoms keep their relative order within each type.
+void Timestep::group_visible_by_type() {
+	long num_visible = visible_atom_indices.size();
+	long counts[NUM_ATOM_TYPES+2] = {0};
+	for(long index=0; index<num_visible; index++) counts[type_slot(atom_types[visible_atom_indices[index]])+1]++;
+	for(int type=0; type<=NUM_ATOM_TYPES; type++) counts[type+1] += counts[type];
 
-        double delta_x = x - cam_x;
-        double delta_y = y - cam_y;
-        double delta_z = z - cam_z;
+	visible_type_ranges.clear();
+	for(int type=0; type<=NUM_ATOM_TYPES; type++) {
+		if(counts[type+1] == counts[type]) continue;
+		TypeRange range;
+		range.type = type;
+		range.begin = counts[type];
+		range.end = counts[type+1];
+		visible_type_ranges.push_back(range);
+	}
+	if(visible_type_ranges.size() <= 1) return; // Already grouped
 
-        double dr2 = delta_x*delta_x + delta_y*delta_y + delta_z*delta_z;
-        if(dr2 < 50) continue;
-        if(dr2 > dr2_max) continue;
+	vector<long> grouped(num_visible);
+	for(long index=0; index<num_visible; index++) {
+		long n = visible_atom_indices[index];
+		grouped[counts[type_slot(atom_types[n])]++] = n;
+	}
+	visible_atom_indices.swap(grouped);
+}
 
-        visible_atom_indices.push_back(n);
+// Type ranges of the runs of equal type in visible_atom_indices, which keeps its order. For blending, where the
+// depth order of all visible atoms matters and grouping by type would break it.
+void Timestep::split_visible_into_type_runs() {
+	long num_visible = visible_atom_indices.size();
+	visible_type_ranges.clear();
+	for(long index=0; index<num_visible; index++) {
+		int type = type_slot(atom_types[visible_atom_indices[index]]);
+		if(visible_type_ranges.size() > 0 && visible_type_ranges.back().type == type) {
+			visible_type_ranges.back().end++;
+			continue;
+		}
+		TypeRange range;
+		range.type = type;
+		range.begin = index;
+		range.end = index + 1;
+		visible_type_ranges.push_back(range);
 	}
 }
 
+// Cell list state shared by the ambient occlusion tasks
+class AmbientOcclusionCells {
+public:
+	long num_atoms;
+	int num_cells[3], neighbour_range[3];
+	float cell_length[3], system_size[3];
+	bool minimum_image[3];
+	float radius2, one_over_radius, one_over_full_occlusion;
+	vector<vector<float> > *positions;
+	vector<int> atom_cell;
+	vector<char> cell_level;         // Cells away from the nearest cell with a new atom, empty when every atom is computed
+	vector<long> cell_start, cell_atoms;
+	vector<float> cell_positions;
+	vector<float> *ambient_occlusion;
+
+	// The atoms of cells within two cells of a new atom are listed, they can be within radius of those that are computed
+	bool is_listed(int cell) { return cell_level.size() == 0 || cell_level[cell] <= 2; }
+};
+
+class AssignAtomCells {
+public:
+	AmbientOcclusionCells *cells;
+
+	void operator()(int begin, int end, int worker) {
+		int *num_cells = cells->num_cells;
+		long n_end = get_chunk_end(end-1, CULL_CHUNK_SIZE, cells->num_atoms);
+		for(long n=get_chunk_begin(begin, CULL_CHUNK_SIZE); n<n_end; n++) {
+			int c[3];
+			for(int k=0;k<3;k++) {
+				c[k] = int(floor((*cells->positions)[n][k]/cells->cell_length[k])) % num_cells[k];
+				if(c[k] < 0) c[k] += num_cells[k];
+			}
+			cells->atom_cell[n] = (c[0]*num_cells[1] + c[1])*num_cells[2] + c[2];
+		}
+	}
+};
+
+class OccludeCells {
+public:
+	AmbientOcclusionCells *cells;
+
+	void operator()(int begin, int end, int worker) {
+		int *num_cells = cells->num_cells;
+		int *neighbour_range = cells->neighbour_range;
+		float *system_size = cells->system_size;
+		bool *minimum_image = cells->minimum_image;
+		float radius2 = cells->radius2;
+		float one_over_radius = cells->one_over_radius;
+		long *cell_start = &cells->cell_start[0];
+		float *cell_positions = &cells->cell_positions[0];
+
+		for(int cell=begin; cell<end; cell++) {
+			if(cells->cell_level.size() > 0 && cells->cell_level[cell] > 1) continue; // No atom within radius of a new one
+			int c[3] = {cell/(num_cells[1]*num_cells[2]), (cell/num_cells[2]) % num_cells[1], cell % num_cells[2]};
+
+			for(long index=cell_start[cell]; index<cell_start[cell+1]; index++) {
+				float x = cell_positions[3*index+0];
+				float y = cell_positions[3*index+1];
+				float z = cell_positions[3*index+2];
+				float occlusion = 0;
+
+				for(int i=0; i<neighbour_range[0]; i++) {
+					for(int j=0; j<neighbour_range[1]; j++) {
+						for(int l=0; l<neighbour_range[2]; l++) {
+							int neighbour[3] = {i, j, l};
+							float shift[3] = {0, 0, 0};
+							// Shift periodic images so that no minimum image test is needed per pair
+							for(int k=0;k<3;k++) {
+								if(minimum_image[k]) continue;
+								neighbour[k] += c[k] - 1;
+								if(neighbour[k] < 0) { neighbour[k] += num_cells[k]; shift[k] = -system_size[k]; }
+								if(neighbour[k] >= num_cells[k]) { neighbour[k] -= num_cells[k]; shift[k] = system_size[k]; }
+							}
+							int neighbour_cell = (neighbour[0]*num_cells[1] + neighbour[1])*num_cells[2] + neighbour[2];
+
+							for(long other=cell_start[neighbour_cell]; other<cell_start[neighbour_cell+1]; other++) {
+								float dx = cell_positions[3*other+0] + shift[0] - x;
+								float dy = cell_positions[3*other+1] + shift[1] - y;
+								float dz = cell_positions[3*other+2] + shift[2] - z;
+								if(minimum_image[0]) dx -= system_size[0]*floor(dx/system_size[0] + 0.5);
+								if(minimum_image[1]) dy -= system_size[1]*floor(dy/system_size[1] + 0.5);
+								if(minimum_image[2]) dz -= system_size[2]*floor(dz/system_size[2] + 0.5);
+								float dr2 = dx*dx + dy*dy + dz*dz;
+								if(dr2 < radius2 && other != index) occlusion += 1 - sqrt(dr2)*one_over_radius;
+							}
+						}
+					}
+				}
+				(*cells->ambient_occlusion)[cells->cell_atoms[index]] = 1 - 0.5*min(1.0f, occlusion*cells->one_over_full_occlusion);
+			}
+		}
+	}
+};
+
+// Ambient occlusion from the number of neighbours within radius, weighted by (1 - r/radius).
+// Neighbours are found with a periodic cell list and the cells are processed as TaskPool tasks.
+// The result is 1 for an isolated atom and 0.5 for an atom buried in matter of AMBIENT_OCCLUSION_DENSITY, on the
+// same scale for every timestep so that the shading does not flicker during playback.
+// After append_atoms(), first_new_atom limits the work to the appended atoms and the atoms within radius of them,
+// counting the neighbours on both sides of the seam. The other atoms keep their values.
+void Timestep::compute_ambient_occlusion(float radius, long first_new_atom) {
+	TraceSpan span("ambient_occlusion");
+	long num_atoms = get_number_of_atoms();
+	if(ambient_occlusion.size() != first_new_atom) first_new_atom = 0; // The atoms before have no values to keep
+	if(first_new_atom == num_atoms) return;
+	int num_chunks = get_num_chunks(num_atoms, CULL_CHUNK_SIZE);
+	vector<float> system_size = get_lx_ly_lz();
+	ambient_occlusion.resize(num_atoms);
+
+	AmbientOcclusionCells cells;
+	cells.num_atoms = num_atoms;
+	cells.positions = &positions;
+	cells.ambient_occlusion = &ambient_occlusion;
+	for(int k=0;k<3;k++) {
+		cells.system_size[k] = system_size[k];
+		cells.num_cells[k] = max(1, int(system_size[k]/radius));
+		cells.cell_length[k] = system_size[k]/cells.num_cells[k];
+		// With fewer than three cells in a direction we loop over every cell in that direction and use the minimum image convention instead
+		cells.minimum_image[k] = cells.num_cells[k] < 3;
+	}
+	int *num_cells = cells.num_cells;
+	int total_cells = num_cells[0]*num_cells[1]*num_cells[2];
+	for(int k=0;k<3;k++) cells.neighbour_range[k] = cells.minimum_image[k] ? num_cells[k] : 3;
+
+	cells.atom_cell.resize(num_atoms);
+	AssignAtomCells assign_atom_cells;
+	assign_atom_cells.cells = &cells;
+	parallel_for(0, num_chunks, 1, assign_atom_cells);
+
+	// Grow the cells holding new atoms twice by their neighbours, the cells are at least radius long
+	if(first_new_atom > 0) {
+		cells.cell_level.assign(total_cells, 3);
+		for(long n=first_new_atom; n<num_atoms; n++) cells.cell_level[cells.atom_cell[n]] = 0;
+		for(int level=1; level<=2; level++) {
+			for(int cell=0; cell<total_cells; cell++) {
+				if(cells.cell_level[cell] != level-1) continue;
+				int c[3] = {cell/(num_cells[1]*num_cells[2]), (cell/num_cells[2]) % num_cells[1], cell % num_cells[2]};
+				for(int i=0; i<cells.neighbour_range[0]; i++) {
+					for(int j=0; j<cells.neighbour_range[1]; j++) {
+						for(int l=0; l<cells.neighbour_range[2]; l++) {
+							int neighbour[3] = {i, j, l};
+							for(int k=0;k<3;k++) {
+								if(!cells.minimum_image[k]) neighbour[k] = (c[k] + neighbour[k] - 1 + num_cells[k]) % num_cells[k];
+							}
+							int neighbour_cell = (neighbour[0]*num_cells[1] + neighbour[1])*num_cells[2] + neighbour[2];
+							if(cells.cell_level[neighbour_cell] > level) cells.cell_level[neighbour_cell] = level;
+						}
+					}
+				}
+			}
+		}
+	}
+
+	// Counting sort of the listed atoms into cells, positions are copied in cell order for locality
+	cells.cell_start.resize(total_cells+1, 0);
+	for(long n=0; n<num_atoms; n++) {
+		if(cells.is_listed(cells.atom_cell[n])) cells.cell_start[cells.atom_cell[n]+1]++;
+	}
+	for(int cell=0; cell<total_cells; cell++) cells.cell_start[cell+1] += cells.cell_start[cell];
+	long num_listed = cells.cell_start[total_cells];
+	cells.cell_atoms.resize(num_listed);
+	cells.cell_positions.resize(3*num_listed);
+	vector<long> cell_fill(cells.cell_start.begin(), cells.cell_start.end()-1);
+	for(long n=0; n<num_atoms; n++) {
+		if(!cells.is_listed(cells.atom_cell[n])) continue;
+		long index = cell_fill[cells.atom_cell[n]]++;
+		cells.cell_atoms[index] = n;
+		for(int k=0;k<3;k++) cells.cell_positions[3*index+k] = positions[n][k];
+	}
+
+	cells.radius2 = radius*radius;
+	cells.one_over_radius = 1.0/radius;
+	// Integral of (1 - r/radius) over a sphere of uniform density
+	cells.one_over_full_occlusion = 1.0/(AMBIENT_OCCLUSION_DENSITY*M_PI*radius*radius*radius/3);
+
+	OccludeCells occlude_cells;
+	occlude_cells.cells = &cells;
+	parallel_for(0, total_cells, 16, occlude_cells);
+}
+
 void Timestep::load_atoms_xyz(string xyz_file) {
 	map<string,int> atom_type_list;
 	atom_type_list.insert(pair<string,int>("Si",1));
@@ -56,7 +318,7 @@ void Timestep::load_atoms_xyz(string xyz_file) {
 
 	ifstream file;
 	file.open(xyz_file.c_str());
-	int num_atoms;
+	long num_atoms;
 	file >> num_atoms;
 	string tmp;
 	file >> tmp;
@@ -65,13 +327,13 @@ void Timestep::load_atoms_xyz(string xyz_file) {
 	double x,y,z;
 	double max_x, max_y, max_z;
 	max_x = 0; max_y = 0; max_z = 0;
-	int atom_id;
+	long atom_id;
 	
 	positions.resize(num_atoms);
 	atom_ids.resize(num_atoms);
 	atom_types.resize(num_atoms);
 
-	for(int i=0; i<num_atoms; i++) {
+	for(long i=0; i<num_atoms; i++) {
 		file >> atom_type >> x >> y >> z >> atom_id;
 		int atom_type_int = atom_type_list.find(atom_type)->second;
 		positions[i].resize(3);
@@ -99,17 +361,116 @@ void Timestep::load_atoms_xyz(string xyz_file) {
 	h_matrix[1][2][2] = max_z;
 }
 
-Timestep::Timestep(string mts0_directory,int nx_, int ny_, int nz_) {
+Timestep::Timestep(string mts0_directory_,int nx_, int ny_, int nz_, TimestepManifest *manifest_, bool *skip_types_) {
+	cull_time = 0;
 	nx = nx_;
 	ny = ny_;
 	nz = nz_;
+	mts0_directory = mts0_directory_;
+	manifest = manifest_;
+	set_skip_types(skip_types_);
 	cout << get_file_extension(mts0_directory) << endl;
 	if(get_file_extension(mts0_directory).compare("xyz") == 0) {
 		load_atoms_xyz(mts0_directory);
+		partition_by_type();
 	}
 	else load_atoms(mts0_directory);
 }
 
+// Region of interest load, only the given nodes are read. The h-matrix is passed in since there may be no nodes to read it from.
+Timestep::Timestep(string mts0_directory_, int nx_, int ny_, int nz_, vector<int> &node_ids, float *h_matrix_local, TimestepManifest *manifest_, bool *skip_types_) {
+	cull_time = 0;
+	nx = nx_;
+	ny = ny_;
+	nz = nz_;
+	mts0_directory = mts0_directory_;
+	manifest = manifest_;
+	set_skip_types(skip_types_);
+	node_loaded.assign(nx*ny*nz, 0);
+	set_h_matrix(h_matrix_local);
+	load_nodes(node_ids);
+}
+
+// Out-of-core load, the atoms are copied out of the mapped file
+Timestep::Timestep(MappedTrajectory *trajectory, MappedTimestepEntry *entry, int nx_, int ny_, int nz_, bool *skip_types_) {
+	cull_time = 0;
+	nx = nx_;
+	ny = ny_;
+	nz = nz_;
+	mts0_directory = trajectory->filename;
+	manifest = 0;
+	trajectory->copy_timestep(entry, this, skip_types_);
+	partition_by_type();
+}
+
+// Copy of the atoms of timestep without its visible atom list, which the render thread may be changing. Streamed
+// regions are added to the copy while timestep is drawn.
+Timestep::Timestep(Timestep &timestep) {
+	cull_time = 0;
+	nx = timestep.nx;
+	ny = timestep.ny;
+	nz = timestep.nz;
+	mts0_directory = timestep.mts0_directory;
+	manifest = timestep.manifest;
+	set_skip_types(timestep.skip_types);
+	h_matrix = timestep.h_matrix;
+	append_copy(timestep);
+}
+
+// Room for num_atoms atoms. The positions of the atoms already there are moved instead of copied, which C++98
+// vectors would do when they grow.
+void Timestep::reserve_atoms(long num_atoms) {
+	if(num_atoms <= positions.capacity()) return;
+	long capacity = max(num_atoms, 2*long(positions.capacity()));
+	vector<vector<float> > grown_positions;
+	grown_positions.reserve(capacity);
+	grown_positions.resize(positions.size());
+	for(long n=0; n<positions.size(); n++) grown_positions[n].swap(positions[n]);
+	positions.swap(grown_positions);
+	atom_types.reserve(capacity);
+	atom_ids.reserve(capacity);
+}
+
+// Moves the atoms of region, nodes of the same timestep that this one does not hold, to the end of this timestep.
+// They keep their own type runs, so the cost depends on the size of region and not on the atoms already loaded.
+// The ambient occlusion of the new atoms is left to compute_ambient_occlusion(radius, first_new_atom).
+void Timestep::append_atoms(Timestep &region) {
+	long first_new_atom = get_number_of_atoms();
+	long num_atoms = first_new_atom + region.get_number_of_atoms();
+	reserve_atoms(num_atoms);
+	positions.resize(num_atoms);
+	for(long n=first_new_atom; n<num_atoms; n++) positions[n].swap(region.positions[n - first_new_atom]);
+	atom_types.insert(atom_types.end(), region.atom_types.begin(), region.atom_types.end());
+	atom_ids.insert(atom_ids.end(), region.atom_ids.begin(), region.atom_ids.end());
+	for(int run=0; run<region.type_runs.size(); run++) {
+		TypeRange type_run = region.type_runs[run];
+		type_run.begin += first_new_atom;
+		type_run.end += first_new_atom;
+		type_runs.push_back(type_run);
+	}
+	for(int node_id=0; node_id<node_loaded.size(); node_id++) node_loaded[node_id] |= region.node_loaded[node_id];
+	region.positions.clear();
+	region.atom_types.clear();
+	region.atom_ids.clear();
+	region.type_runs.clear();
+}
+
+// Brings this timestep up to timestep, which holds the same atoms followed by the regions appended since.
+// Only the appended atoms are copied, and the ambient occlusion since atoms next to the regions have changed.
+void Timestep::append_copy(Timestep &timestep) {
+	long first_new_atom = get_number_of_atoms();
+	long num_atoms = timestep.get_number_of_atoms();
+	reserve_atoms(num_atoms);
+	positions.insert(positions.end(), timestep.positions.begin() + first_new_atom, timestep.positions.end());
+	atom_types.insert(atom_types.end(), timestep.atom_types.begin() + first_new_atom, timestep.atom_types.end());
+	atom_ids.insert(atom_ids.end(), timestep.atom_ids.begin() + first_new_atom, timestep.atom_ids.end());
+	for(int run=0; run<timestep.type_runs.size(); run++) {
+		if(timestep.type_runs[run].begin >= first_new_atom) type_runs.push_back(timestep.type_runs[run]);
+	}
+	ambient_occlusion = timestep.ambient_occlusion;
+	node_loaded = timestep.node_loaded;
+}
+
 Timestep::~Timestep() {
 	positions.clear();
 	atom_ids.clear();
@@ -117,8 +478,9 @@ Timestep::~Timestep() {
 	h_matrix.clear();
 }
 
-Mts0_io::Mts0_io(int nx_, int ny_, int nz_, int max_timestep_, string foldername_base_, bool preload_, int step_) {
+Mts0_io::Mts0_io(int nx_, int ny_, int nz_, int max_timestep_, string foldername_base_, bool preload_, int step_, float ambient_occlusion_radius_, string manifest_file) {
 	step = step_;
+	ambient_occlusion_radius = ambient_occlusion_radius_;
 	nx = nx_;
 	ny = ny_;
 	nz = nz_;
@@ -126,133 +488,676 @@ Mts0_io::Mts0_io(int nx_, int ny_, int nz_, int max_timestep_, string foldername
 	foldername_base = foldername_base_;
 	max_timestep = max_timestep_;
 	current_timestep = -1; // Next will be 0
-	if(preload) load_timesteps();
+	load_time = 0;
+	region_of_interest = false;
+	region_margin = 0;
+	skip_hidden_water = false;
+	morton_order = false;
+	mapped_trajectory = 0;
+	resident_bytes = -1;
+	mapped_resident_fraction = 0;
+	last_timestep_index = -1;
+	for(int type=0; type<=NUM_ATOM_TYPES; type++) skip_types[type] = false;
+	manifest = 0;
+	if(manifest_file.compare("none") != 0) {
+		manifest = new TrajectoryManifest();
+		if(!manifest->load(manifest_file)) exit(1);
+		if(manifest->nx != nx || manifest->ny != ny || manifest->nz != nz) {
+			cout << "Error in Mts0_io::Mts0_io(): " << manifest_file << " is for " << manifest->nx << "x" << manifest->ny << "x" << manifest->nz << " nodes, not " << nx << "x" << ny << "x" << nz << endl;
+			exit(1);
+		}
+		manifest->print_statistics();
+	}
+}
+
+// Reads pieces that are contiguous in the file into their buffers, IOV_MAX pieces per call
+static bool read_vectored(int file, long offset, vector<struct iovec> &pieces) {
+	int first = 0;
+	while(first < pieces.size()) {
+		int count = min(int(pieces.size()) - first, IOV_MAX);
+		ssize_t num_read = preadv(file, &pieces[first], count, offset);
+		if(num_read <= 0) return false;
+		offset += num_read;
+		// Reads can stop early, continue after the last byte that arrived
+		while(first < pieces.size() && num_read >= (ssize_t)pieces[first].iov_len) {
+			num_read -= pieces[first].iov_len;
+			first++;
+		}
+		if(num_read > 0) {
+			pieces[first].iov_base = (char*)pieces[first].iov_base + num_read;
+			pieces[first].iov_len -= num_read;
+		}
+	}
+	return true;
 }
 
-void Timestep::read_data(ifstream *file, void *value) {
+// Reads the first bytes of the Fortran record at offset into value and moves offset past the record.
+// Records of 2 GB and more are split into subrecords, where the leading length of every subrecord but
+// the last is negative. Only the lengths are read to walk the record, the wanted bytes then come in one
+// vectored read with the length pairs between subrecords going to a scratch buffer. The rest of the
+// record is never read.
+static bool read_record(int file, long &offset, void *value, long bytes) {
+	vector<long> data_offsets, data_lengths;
 	int N;
-	file->read (reinterpret_cast<char*>(&N), sizeof(int));
-	file->read (reinterpret_cast<char*>(value), N);
-	file->read (reinterpret_cast<char*>(&N), sizeof(int));
+	do {
+		if(pread(file, &N, sizeof(int), offset) != sizeof(int)) return false;
+		long length = N < 0 ? -long(N) : long(N);
+		data_offsets.push_back(offset + sizeof(int));
+		data_lengths.push_back(length);
+		offset += length + 2*sizeof(int);
+	} while(N < 0);
+
+	int lengths[2];
+	vector<struct iovec> pieces;
+	long remaining = bytes;
+	for(int i=0; i<data_offsets.size() && remaining > 0; i++) {
+		if(i > 0) {
+			struct iovec scratch;
+			scratch.iov_base = lengths;
+			scratch.iov_len = sizeof(lengths);
+			pieces.push_back(scratch);
+		}
+		struct iovec piece;
+		piece.iov_base = (char*)value + (bytes - remaining);
+		piece.iov_len = min(remaining, data_lengths[i]);
+		pieces.push_back(piece);
+		remaining -= piece.iov_len;
+	}
+	if(remaining > 0) return false; // The record is shorter than asked for
+	return read_vectored(file, data_offsets[0], pieces);
 }
 
-void Timestep::read_mts(char *filename, vector<int> &atom_types_local, vector<int> &atom_ids_local, vector<vector<float> > &positions_local) {
-	ifstream *file = new ifstream();
-	file->open(filename, ios::in | ios::binary);
-	if (!*file) {
+// h_matrix_local receives the 18 h-matrix elements of this node in the order of Timestep::h_matrix[k][i][j].
+// The read buffers come from the arena of the calling worker, so repeated loads reuse the same memory.
+// The phase space record holds all positions and then all velocities, only the positions are read.
+// With file -1 the node file is opened, else the node starts at offset in file (a pack) and filename only names it.
+void Timestep::read_mts(char *filename, int file, long offset, vector<int> &atom_types_local, vector<long> &atom_ids_local, vector<vector<float> > &positions_local, float *h_matrix_local, WorkerArena &arena) {
+	bool opened = file < 0;
+	if(opened) file = open(filename, O_RDONLY);
+	if (file < 0) {
 		cout << "Error in Mts0_io::read_mts(): Failed to open file " << filename << endl;
 		exit(1);
 	}
-	int num_atoms_local;
-	read_data(file, &num_atoms_local);
+	// The count is an int in the file, byte sizes are computed in 64 bits since 6 doubles per atom pass 2 GB at 45M atoms
+	int num_atoms_local = 0;
+	bool complete = read_record(file, offset, &num_atoms_local, sizeof(int)) && num_atoms_local >= 0;
+	if(!complete) num_atoms_local = 0;
 	
-	double *phase_space = new double[6*num_atoms_local];
-	double *tmp_atom_data = new double[num_atoms_local];
+	ArenaScope scope(arena);
+	double *phase_space = (double*)arena.allocate(3*long(num_atoms_local)*sizeof(double));
+	double *tmp_atom_data = (double*)arena.allocate(long(num_atoms_local)*sizeof(double));
+	double tmp_h_matrix[18];
 
-	atom_types_local.resize(num_atoms_local);
-	atom_ids_local.resize(num_atoms_local);
-	positions_local.resize(num_atoms_local);
+	complete = complete && read_record(file, offset, tmp_atom_data, long(num_atoms_local)*sizeof(double));
+	complete = complete && read_record(file, offset, phase_space, 3*long(num_atoms_local)*sizeof(double));
+	complete = complete && read_record(file, offset, tmp_h_matrix, sizeof(tmp_h_matrix));
+	if(opened) close(file);
+	if(!complete) {
+		cout << "Error in Mts0_io::read_mts(): " << filename << " is truncated" << endl;
+		exit(1);
+	}
+	decode_mts(num_atoms_local, tmp_atom_data, phase_space, tmp_h_matrix, atom_types_local, atom_ids_local, positions_local, h_matrix_local);
+}
+
+// Turns the records of a node file into atoms. tmp_atom_data has a type + id*1e-11 per atom, phase_space the positions
+// (3 per atom) and tmp_h_matrix the 18 doubles of the h-matrix record.
+void Timestep::decode_mts(int num_atoms_local, double *tmp_atom_data, double *phase_space, double *tmp_h_matrix, vector<int> &atom_types_local, vector<long> &atom_ids_local, vector<vector<float> > &positions_local, float *h_matrix_local) {
+	// Atoms of skipped types are never stored
+	int num_kept = 0;
 	for(int i=0;i<num_atoms_local;i++) {
-		positions_local[i].resize(3);
+		if(!is_skipped(int(tmp_atom_data[i]))) num_kept++;
 	}
 
-	read_data(file, tmp_atom_data);
-	read_data(file, phase_space);
+	atom_types_local.resize(num_kept);
+	atom_ids_local.resize(num_kept);
+	positions_local.resize(num_kept);
+	for(int i=0;i<num_kept;i++) {
+		positions_local[i].resize(3);
+	}
 
+	int n = 0;
 	for(int i=0;i<num_atoms_local;i++) {
-		atom_types_local[i] = int(tmp_atom_data[i]);
+		int atom_type = int(tmp_atom_data[i]);
+		if(is_skipped(atom_type)) continue;
+		atom_types_local[n] = atom_type;
 		// Handle roundoff errors from 2 -> 1.99999999 -> 1
-		atom_ids_local[i] = (tmp_atom_data[i]-atom_types_local[i])*1e11 + 1e-5;
+		atom_ids_local[n] = (tmp_atom_data[i]-atom_type)*1e11 + 1e-5;
 		
-		positions_local [i][0] = float(phase_space[3*i+0]);
-		positions_local [i][1] = float(phase_space[3*i+1]);
-		positions_local [i][2] = float(phase_space[3*i+2]);
+		positions_local [n][0] = float(phase_space[3*long(i)+0]);
+		positions_local [n][1] = float(phase_space[3*long(i)+1]);
+		positions_local [n][2] = float(phase_space[3*long(i)+2]);
+		n++;
 	}
 
-	double *tmp_h_matrix = new double[18];
-	read_data(file,tmp_h_matrix);
 	int count = 0;
 	for(int k=0;k<2;k++) {
 		for(int j=0;j<3;j++) {
 			for(int i=0;i<3;i++) {
-				h_matrix[k][i][j] = float(tmp_h_matrix[count++]);
+				h_matrix_local[9*k + 3*i + j] = float(tmp_h_matrix[count++]);
 			}
 		}
 	}
+}
 
-	file->close();
+// A node file read through io_uring. The record lengths must match a file without subrecords: the count (N),
+// the atom data (8N bytes), the phase space (48N bytes, only the positions are read) and the h-matrix (144 bytes).
+class NodeRead {
+public:
+	int index;             // Into NodeLoader::node_ids
+	int file;
+	int stage;             // NODE_OPENING, NODE_HEADER or NODE_BODY
+	int pending;           // Reads of the stage not completed
+	long base;             // Offset of the node file in the pack, 0 for separate files
+	int header[4];         // Length and value of the count record, length of the atom data record
+	vector<double> buffer; // Atom data, phase space length and positions, h-matrix length and values
+	char *piece_buffer[3]; // Remaining part of each read of the stage
+	long piece_offset[3];
+	long piece_bytes[3];
+	char filename[1000];
+};
 
-	delete tmp_h_matrix;
-	delete phase_space;
-	delete tmp_atom_data;
-	delete file;
-}
+// Reads a list of node files of one timestep. With io_uring a task batches the reads of a range of nodes,
+// else every task reads one node with blocking calls.
+class NodeLoader {
+public:
+	Timestep *timestep;
+	string mts0_directory;
+	vector<int> node_ids;
+	vector<vector<vector<float> > > node_positions; // Indexed like node_ids
+	vector<vector<int> > node_atom_types;
+	vector<vector<long> > node_atom_ids;
+	vector<float> node_h_matrices; // 18 per node
+	long *node_offsets;            // Index of the first atom of each node in the timestep arrays when sized from the manifest, else 0
+	vector<char> node_placed;
+	NodePack *pack;                // 0 when the node files are read separately
 
-void Timestep::load_atoms(string mts0_directory) {
-	positions.clear();
-	atom_types.clear();
-	atom_ids.clear();
-	h_matrix.clear();
+	void operator()(int begin, int end, int worker) {
+		IoRing *ring = IoRing::for_worker(worker);
+		if(ring) read_batched(begin, end, worker, ring);
+		else {
+			for(int i=begin; i<end; i++) read_node(i, worker);
+		}
+	}
 
-	h_matrix.resize(2);
-	for(int i=0;i<2;i++) {
-		h_matrix[i].resize(3);
-		for(int j=0;j<3;j++) {
-			h_matrix[i][j].resize(3);
+	// Node files inside a pack are named <pack>:mt%04d in messages
+	void get_node_filename(int node_id, char *filename) {
+		if(pack) sprintf(filename,"%s:mt%04d",pack->filename.c_str(), node_id);
+		else sprintf(filename,"%s/mt%04d",mts0_directory.c_str(), node_id);
+	}
+
+	void read_node(int i, int worker) {
+		char filename[1000];
+		get_node_filename(node_ids[i], filename);
+		{
+			TraceSpan span("read_mts", node_ids[i]);
+			timestep->read_mts(filename, pack ? pack->file : -1, pack ? pack->nodes[node_ids[i]].offset : 0, node_atom_types[i], node_atom_ids[i], node_positions[i], &node_h_matrices[18*i], TaskPool::instance().arena(worker));
+		}
+		place_node(i);
+	}
+
+	// Keeps up to NODE_READS_IN_FLIGHT node files open, or in reading when they come from a pack. Every pass submits the new opens and reads together and
+	// handles one completion, so a node is decoded as soon as its last read arrives while the others are in flight.
+	void read_batched(int begin, int end, int worker, IoRing *ring) {
+		TraceSpan span("read_batch", end - begin);
+		vector<NodeRead> reads(min(end - begin, NODE_READS_IN_FLIGHT));
+		vector<int> free_slots;
+		for(int slot=reads.size()-1; slot>=0; slot--) free_slots.push_back(slot);
+		int next = begin;
+		int num_done = 0;
+		while(num_done < end - begin) {
+			while(next < end && free_slots.size() > 0) {
+				int slot = free_slots.back();
+				free_slots.pop_back();
+				NodeRead &read = reads[slot];
+				read.index = next++;
+				get_node_filename(node_ids[read.index], read.filename);
+				if(pack) {
+					read.file = pack->file;
+					read.base = pack->nodes[node_ids[read.index]].offset;
+					start_header(ring, read, slot);
+				} else {
+					read.base = 0;
+					read.stage = NODE_OPENING;
+					ring->prepare_open(read.filename, 4*slot);
+				}
+			}
+			ring->submit();
+
+			long tag;
+			int result;
+			ring->wait(tag, result);
+			int slot = tag/4, piece = tag%4;
+			NodeRead &read = reads[slot];
+			if(read.stage == NODE_OPENING) {
+				if(result < 0) {
+					cout << "Error in Mts0_io::read_mts(): Failed to open file " << read.filename << endl;
+					exit(1);
+				}
+				read.file = result;
+				start_header(ring, read, slot);
+				continue;
+			}
+
+			if(result == -EINTR || result == -EAGAIN) result = 0;
+			else if(result < 0 || (result == 0 && read.piece_bytes[piece] > 0)) {
+				cout << "Error in Mts0_io::read_mts(): " << read.filename << " is truncated" << endl;
+				exit(1);
+			}
+			// Reads can stop early, continue after the last byte that arrived
+			if(result < read.piece_bytes[piece]) {
+				start_read(ring, read, slot, piece, read.piece_buffer[piece] + result, read.piece_bytes[piece] - result, read.piece_offset[piece] + result);
+				continue;
+			}
+			if(--read.pending > 0) continue;
+
+			if(read.stage == NODE_HEADER) {
+				if(start_body(ring, read, slot)) continue;
+				// Subrecords or not an mts file, the blocking path handles and reports those
+				if(!pack) close(read.file);
+				read_node(read.index, worker);
+			}
+			else decode_node(read);
+			free_slots.push_back(slot);
+			num_done++;
 		}
 	}
-	vector<vector<float> > positions_local;
-	vector<int> atom_types_local;
-	vector<int> atom_ids_local;
 
-	int num_nodes = nx*ny*nz;
-	int num_atoms_local;
-	vector<int> node_vector_index(3,0);
-	vector<float> node_origin(3,0);
-	vector<float> node_offset(3,0);
+	void start_header(IoRing *ring, NodeRead &read, int slot) {
+		read.stage = NODE_HEADER;
+		read.pending = 1;
+		start_read(ring, read, slot, 0, (char*)read.header, sizeof(read.header), read.base);
+	}
 
-	char *filename = new char[1000];
+	void start_read(IoRing *ring, NodeRead &read, int slot, int piece, char *buffer, long bytes, long offset) {
+		read.piece_buffer[piece] = buffer;
+		read.piece_bytes[piece] = bytes;
+		read.piece_offset[piece] = offset;
+		ring->prepare_read(read.file, buffer, bytes, offset, 4*slot + piece);
+	}
 
-	node_offset[0] = 1.0/nx;
-	node_offset[1] = 1.0/ny;
-	node_offset[2] = 1.0/nz;
+	// The record lengths are read together with the data and checked in decode_node()
+	bool start_body(IoRing *ring, NodeRead &read, int slot) {
+		long n = read.header[1];
+		if(read.header[0] != sizeof(int) || read.header[2] != sizeof(int) || n < 0 || read.header[3] != 8*n || 48*n > MAX_RECORD_BYTES) return false;
+		read.buffer.resize(4*n + 20);
+		double *data = &read.buffer[0];
+		read.stage = NODE_BODY;
+		read.pending = 3;
+		start_read(ring, read, slot, 0, (char*)data, 8*n, read.base + 16);
+		start_read(ring, read, slot, 1, (char*)(data + n) + 4, 4 + 24*n, read.base + 20 + 8*n);
+		start_read(ring, read, slot, 2, (char*)(data + 4*n + 1) + 4, 4 + 18*sizeof(double), read.base + 28 + 56*n);
+		return true;
+	}
 
-	for(int node_id=0; node_id<num_nodes; node_id++) {
-		node_vector_index[0] = node_id/(ny*nz);   // Node id in x-direction
-		node_vector_index[1] = (node_id/nz) % ny; // Node id in y-direction
-		node_vector_index[2] = node_id % nz; 	  // Node id in z-direction
+	void decode_node(NodeRead &read) {
+		if(!pack) close(read.file);
+		int i = read.index;
+		long n = read.header[1];
+		double *data = &read.buffer[0];
+		if(*(int*)((char*)(data + n) + 4) != 48*n || *(int*)((char*)(data + 4*n + 1) + 4) != 18*sizeof(double)) {
+			cout << "Error in Mts0_io::read_mts(): " << read.filename << " is truncated" << endl;
+			exit(1);
+		}
+		{
+			TraceSpan span("decode_mts", node_ids[i]);
+			timestep->decode_mts(n, data, data + n + 1, data + 4*n + 2, node_atom_types[i], node_atom_ids[i], node_positions[i], &node_h_matrices[18*i]);
+		}
+		place_node(i);
+	}
 
-		node_origin[0] = node_offset[0]*node_vector_index[0]; // Displacement in x-direction
-		node_origin[1] = node_offset[1]*node_vector_index[1]; // Displacement in y-direction
-		node_origin[2] = node_offset[2]*node_vector_index[2]; // Displacement in z-direction
+	// Scales the atoms of a node that has been read into the system and moves them into place
+	void place_node(int i) {
+		int nx = timestep->nx, ny = timestep->ny, nz = timestep->nz;
+		int node_id = node_ids[i];
+		float node_origin[3];
+		node_origin[0] = float(1.0/nx)*(node_id/(ny*nz));   // Displacement in x-direction
+		node_origin[1] = float(1.0/ny)*((node_id/nz) % ny); // Displacement in y-direction
+		node_origin[2] = float(1.0/nz)*(node_id % nz);      // Displacement in z-direction
 
-		sprintf(filename,"%s/mt%04d",mts0_directory.c_str(), node_id);
-		read_mts(filename, atom_types_local, atom_ids_local, positions_local);
+		vector<vector<float> > &positions_local = node_positions[i];
+		float *h_matrix_local = &node_h_matrices[18*i];
 		int num_atoms_local = positions_local.size();
 
 		for(int j=0;j<num_atoms_local;j++) {
 			for(int k=0;k<3;k++) {
 				positions_local[j][k] += node_origin[k];
-				positions_local[j][k] *= h_matrix[0][k][k]*bohr; // Possibly broken, we don't know how h_matrix really works
+				positions_local[j][k] *= h_matrix_local[3*k + k]*Timestep::bohr; // Possibly broken, we don't know how h_matrix really works
 			}
 		}
 
-		positions.insert ( positions.end() , positions_local.begin() , positions_local.end()  );
-		atom_types.insert ( atom_types.end() , atom_types_local.begin() , atom_types_local.end()  );
-		atom_ids.insert ( atom_ids.end() , atom_ids_local.begin() , atom_ids_local.end()  );
+		// Move the atoms into their final place unless the manifest is out of date
+		if(node_offsets && num_atoms_local == timestep->get_manifest_atom_count(node_id)) {
+			long offset = node_offsets[i];
+			for(int j=0;j<num_atoms_local;j++) timestep->positions[offset+j].swap(positions_local[j]);
+			copy(node_atom_types[i].begin(), node_atom_types[i].end(), timestep->atom_types.begin() + offset);
+			copy(node_atom_ids[i].begin(), node_atom_ids[i].end(), timestep->atom_ids.begin() + offset);
+			node_placed[i] = 1;
+		}
 	}
+};
 
-	delete filename;
-	atom_types_local.clear();
-	atom_ids_local.clear();
-	positions_local.clear();
+// Reads the h-matrix record that ends at end
+static bool read_h_matrix_record(int file, long end, float *h_matrix_local) {
+	double tmp_h_matrix[18];
+	if(pread(file, tmp_h_matrix, sizeof(tmp_h_matrix), end - sizeof(int) - sizeof(tmp_h_matrix)) != sizeof(tmp_h_matrix)) return false;
+	int count = 0;
+	for(int k=0;k<2;k++) {
+		for(int j=0;j<3;j++) {
+			for(int i=0;i<3;i++) {
+				h_matrix_local[9*k + 3*i + j] = float(tmp_h_matrix[count++]);
+			}
+		}
+	}
+	return true;
+}
+
+// Reads only the h-matrix, the last record of a node file, from the pack of the timestep if there is one
+bool read_node_h_matrix(string mts0_directory, int node_id, float *h_matrix_local) {
+	NodePack pack;
+	if(pack.open(NodePack::get_filename(mts0_directory))) {
+		return node_id < pack.nodes.size() && read_h_matrix_record(pack.file, pack.nodes[node_id].offset + pack.nodes[node_id].size, h_matrix_local);
+	}
+	char filename[5000];
+	sprintf(filename, "%s/mt%04d", mts0_directory.c_str(), node_id);
+	int file = open(filename, O_RDONLY);
+	struct stat file_status;
+	bool complete = file >= 0 && fstat(file, &file_status) == 0 && read_h_matrix_record(file, file_status.st_size, h_matrix_local);
+	if(file >= 0) close(file);
+	return complete;
+}
+
+void Timestep::set_skip_types(bool *skip_types_) {
+	for(int type=0; type<=NUM_ATOM_TYPES; type++) skip_types[type] = skip_types_ ? skip_types_[type] : false;
+}
+
+// Atoms of the node that are kept after skipping types, according to the manifest
+long Timestep::get_manifest_atom_count(int node_id) {
+	return manifest->get_atom_count(node_id, skip_types);
+}
+
+void Timestep::set_h_matrix(float *h_matrix_local) {
+	h_matrix.resize(2);
+	for(int k=0;k<2;k++) {
+		h_matrix[k].resize(3);
+		for(int i=0;i<3;i++) {
+			h_matrix[k][i].resize(3);
+			for(int j=0;j<3;j++) h_matrix[k][i][j] = h_matrix_local[9*k + 3*i + j];
+		}
+	}
+}
+
+// Per chunk type counts for the counting sort in partition_by_type()
+class TypeHistogram {
+public:
+	vector<int> *atom_types;
+	vector<long> *chunk_counts;  // NUM_ATOM_TYPES+1 per chunk
+	long num_atoms;
+
+	void operator()(int begin, int end, int worker) {
+		for(int chunk=begin; chunk<end; chunk++) {
+			long *counts = &(*chunk_counts)[(NUM_ATOM_TYPES+1)*chunk];
+			long n_end = get_chunk_end(chunk, PARTITION_CHUNK_SIZE, num_atoms);
+			for(long n=get_chunk_begin(chunk, PARTITION_CHUNK_SIZE); n<n_end; n++) {
+				int atom_type = (*atom_types)[n];
+				counts[type_slot(atom_type)]++;
+			}
+		}
+	}
+};
+
+// Moves every atom to its slot, the chunk offsets keep the order within a type
+class TypeScatter {
+public:
+	Timestep *timestep;
+	vector<long> *chunk_offsets;
+	vector<vector<float> > *new_positions;
+	vector<int> *new_atom_types;
+	vector<long> *new_atom_ids;
+	long num_atoms;
+
+	void operator()(int begin, int end, int worker) {
+		for(int chunk=begin; chunk<end; chunk++) {
+			long *offsets = &(*chunk_offsets)[(NUM_ATOM_TYPES+1)*chunk];
+			long n_end = get_chunk_end(chunk, PARTITION_CHUNK_SIZE, num_atoms);
+			for(long n=get_chunk_begin(chunk, PARTITION_CHUNK_SIZE); n<n_end; n++) {
+				int atom_type = timestep->atom_types[n];
+				long target = offsets[type_slot(atom_type)]++;
+				(*new_positions)[target].swap(timestep->positions[n]);
+				(*new_atom_types)[target] = atom_type;
+				(*new_atom_ids)[target] = timestep->atom_ids[n];
+			}
+		}
+	}
+};
+
+// Groups the atoms by type with a parallel counting sort, into one type run per type that has atoms.
+// Unknown types go first, as type 0. Within a type the atoms keep their order.
+void Timestep::partition_by_type() {
+	TraceSpan span("partition_by_type");
+	long num_atoms = positions.size();
+	int num_chunks = get_num_chunks(num_atoms, PARTITION_CHUNK_SIZE);
+	vector<long> chunk_counts((NUM_ATOM_TYPES+1)*num_chunks, 0);
+
+	TypeHistogram histogram;
+	histogram.atom_types = &atom_types;
+	histogram.chunk_counts = &chunk_counts;
+	histogram.num_atoms = num_atoms;
+	parallel_for(0, num_chunks, 1, histogram);
+
+	// Offsets ordered by type and then by chunk
+	type_runs.clear();
+	long offset = 0;
+	for(int type=0; type<=NUM_ATOM_TYPES; type++) {
+		TypeRange type_run;
+		type_run.type = type;
+		type_run.begin = offset;
+		for(int chunk=0; chunk<num_chunks; chunk++) {
+			long count = chunk_counts[(NUM_ATOM_TYPES+1)*chunk + type];
+			chunk_counts[(NUM_ATOM_TYPES+1)*chunk + type] = offset;
+			offset += count;
+		}
+		type_run.end = offset;
+		if(type_run.end > type_run.begin) type_runs.push_back(type_run);
+	}
+	if(num_atoms == 0) return;
+
+	vector<vector<float> > new_positions(num_atoms);
+	vector<int> new_atom_types(num_atoms);
+	vector<long> new_atom_ids(num_atoms);
+	TypeScatter scatter;
+	scatter.timestep = this;
+	scatter.chunk_offsets = &chunk_counts;
+	scatter.new_positions = &new_positions;
+	scatter.new_atom_types = &new_atom_types;
+	scatter.new_atom_ids = &new_atom_ids;
+	scatter.num_atoms = num_atoms;
+	parallel_for(0, num_chunks, 1, scatter);
 
-	node_vector_index.clear();
-	node_origin.clear();
-	node_offset.clear();
+	positions.swap(new_positions);
+	atom_types.swap(new_atom_types);
+	atom_ids.swap(new_atom_ids);
 }
 
-int Timestep::get_number_of_atoms() {
+// Spreads the lower 10 bits of x out to every third bit
+inline unsigned int spread_bits(unsigned int x) {
+	x &= 0x3ff;
+	x = (x | (x << 16)) & 0x030000ff;
+	x = (x | (x << 8)) & 0x0300f00f;
+	x = (x | (x << 4)) & 0x030c30c3;
+	x = (x | (x << 2)) & 0x09249249;
+	return x;
+}
+
+class MortonKeys {
+public:
+	vector<vector<float> > *positions;
+	vector<unsigned int> *keys;
+	vector<long> *order;
+	float cells_per_length[3];
+
+	void operator()(int begin, int end, int worker) {
+		long n_end = get_chunk_end(end-1, PARTITION_CHUNK_SIZE, positions->size());
+		for(long n=get_chunk_begin(begin, PARTITION_CHUNK_SIZE); n<n_end; n++) {
+			unsigned int cell[3];
+			for(int k=0;k<3;k++) {
+				// Atoms that have left the box are clamped to the cells at its faces
+				int c = int(floor((*positions)[n][k]*cells_per_length[k]));
+				cell[k] = min(max(c, 0), MORTON_CELLS-1);
+			}
+			(*keys)[n] = spread_bits(cell[0]) | (spread_bits(cell[1]) << 1) | (spread_bits(cell[2]) << 2);
+			(*order)[n] = n;
+		}
+	}
+};
+
+// new[i] = old[order[i]] for all per-atom arrays
+class GatherAtoms {
+public:
+	Timestep *timestep;
+	vector<long> *order;
+	vector<vector<float> > *new_positions;
+	vector<int> *new_atom_types;
+	vector<long> *new_atom_ids;
+
+	void operator()(int begin, int end, int worker) {
+		long i_end = get_chunk_end(end-1, PARTITION_CHUNK_SIZE, order->size());
+		for(long i=get_chunk_begin(begin, PARTITION_CHUNK_SIZE); i<i_end; i++) {
+			long n = (*order)[i];
+			(*new_positions)[i].swap(timestep->positions[n]);
+			(*new_atom_types)[i] = timestep->atom_types[n];
+			(*new_atom_ids)[i] = timestep->atom_ids[n];
+		}
+	}
+};
+
+// Reorders the atoms along a Morton (Z-order) curve through a 1024^3 grid over the box, so that atoms close
+// in space are close in memory. atom_ids and atom_types move with their atoms. The type partition is
+// redone afterwards, it is stable so every type run stays in Morton order.
+void Timestep::sort_by_morton_code() {
+	TraceSpan span("morton_order");
+	long num_atoms = positions.size();
+	if(num_atoms == 0) return;
+	int num_chunks = get_num_chunks(num_atoms, PARTITION_CHUNK_SIZE);
+
+	vector<unsigned int> keys(num_atoms);
+	vector<long> order(num_atoms);
+	vector<float> system_size = get_lx_ly_lz();
+	MortonKeys morton_keys;
+	morton_keys.positions = &positions;
+	morton_keys.keys = &keys;
+	morton_keys.order = &order;
+	for(int k=0;k<3;k++) morton_keys.cells_per_length[k] = MORTON_CELLS/system_size[k];
+	parallel_for(0, num_chunks, 1, morton_keys);
+
+	DepthSort sorter;
+	sorter.sort_by_keys(keys, order);
+
+	vector<vector<float> > new_positions(num_atoms);
+	vector<int> new_atom_types(num_atoms);
+	vector<long> new_atom_ids(num_atoms);
+	GatherAtoms gather;
+	gather.timestep = this;
+	gather.order = &order;
+	gather.new_positions = &new_positions;
+	gather.new_atom_types = &new_atom_types;
+	gather.new_atom_ids = &new_atom_ids;
+	parallel_for(0, num_chunks, 1, gather);
+
+	positions.swap(new_positions);
+	atom_types.swap(new_atom_types);
+	atom_ids.swap(new_atom_ids);
+	partition_by_type();
+}
+
+void Timestep::load_atoms(string mts0_directory) {
+	positions.clear();
+	atom_types.clear();
+	atom_ids.clear();
+	h_matrix.clear();
+	node_loaded.assign(nx*ny*nz, 0);
+
+	vector<int> node_ids(nx*ny*nz);
+	for(int node_id=0; node_id<nx*ny*nz; node_id++) node_ids[node_id] = node_id;
+	load_nodes(node_ids);
+}
+
+// Appends the atoms of the given nodes. Atoms are ordered by node within each call, so a full
+// load gives the same atom indices as reading the nodes one by one.
+void Timestep::load_nodes(vector<int> &node_ids) {
+	int num_new_nodes = node_ids.size();
+	if(num_new_nodes == 0) return;
+	NodeLoader loader;
+	loader.timestep = this;
+	loader.mts0_directory = mts0_directory;
+	loader.node_ids = node_ids;
+	loader.node_positions.resize(num_new_nodes);
+	loader.node_atom_types.resize(num_new_nodes);
+	loader.node_atom_ids.resize(num_new_nodes);
+	loader.node_h_matrices.resize(18*num_new_nodes);
+	loader.node_offsets = 0;
+
+	// A pack holds all node files of the timestep and is opened once for the whole load
+	NodePack pack;
+	loader.pack = 0;
+	if(pack.open(NodePack::get_filename(mts0_directory))) {
+		if(pack.nodes.size() != nx*ny*nz) {
+			cout << "Error in Timestep::load_nodes(): " << pack.filename << " has " << pack.nodes.size() << " nodes, not " << nx*ny*nz << endl;
+			exit(1);
+		}
+		loader.pack = &pack;
+	}
+
+	// With a manifest the arrays get their final size before reading, and each task moves its atoms into place
+	long first_new_atom = positions.size();
+	vector<long> node_offsets;
+	if(manifest) {
+		long num_atoms = manifest->get_node_offsets(node_ids, skip_types, first_new_atom, node_offsets);
+		positions.resize(num_atoms);
+		atom_types.resize(num_atoms);
+		atom_ids.resize(num_atoms);
+		loader.node_offsets = &node_offsets[0];
+		loader.node_placed.assign(num_new_nodes, 0);
+	}
+
+	// With io_uring every worker batches one range of nodes
+	int grain = 1;
+	if(IoRing::is_available()) grain = (num_new_nodes + TaskPool::instance().num_workers - 1)/TaskPool::instance().num_workers;
+	parallel_for(0, num_new_nodes, grain, loader);
+
+	bool placed = manifest != 0;
+	for(int i=0; i<num_new_nodes && placed; i++) placed = loader.node_placed[i];
+	if(manifest && !placed) {
+		cout << "Error in Timestep::load_nodes(): Atom counts in " << mts0_directory << " do not match the manifest, it should be regenerated" << endl;
+		// Take back what was placed and join the nodes below instead
+		for(int i=0; i<num_new_nodes; i++) {
+			if(!loader.node_placed[i]) continue;
+			for(long j=0; j<loader.node_positions[i].size(); j++) loader.node_positions[i][j].swap(positions[node_offsets[i] + j]);
+		}
+		positions.resize(first_new_atom);
+		atom_types.resize(first_new_atom);
+		atom_ids.resize(first_new_atom);
+	}
+
+	if(!placed) {
+		long num_atoms = positions.size();
+		for(int i=0; i<num_new_nodes; i++) num_atoms += loader.node_positions[i].size();
+		positions.reserve(num_atoms);
+		atom_types.reserve(num_atoms);
+		atom_ids.reserve(num_atoms);
+		for(int i=0; i<num_new_nodes; i++) {
+			positions.insert ( positions.end() , loader.node_positions[i].begin() , loader.node_positions[i].end()  );
+			atom_types.insert ( atom_types.end() , loader.node_atom_types[i].begin() , loader.node_atom_types[i].end()  );
+			atom_ids.insert ( atom_ids.end() , loader.node_atom_ids[i].begin() , loader.node_atom_ids[i].end()  );
+		}
+	}
+	for(int i=0; i<num_new_nodes; i++) node_loaded[node_ids[i]] = 1;
+	partition_by_type();
+
+	// Like before, the h-matrix of the last node read is the one kept
+	set_h_matrix(&loader.node_h_matrices[18*(num_new_nodes-1)]);
+}
+
+long Timestep::get_number_of_atoms() {
 	return positions.size();
 }
 
@@ -271,16 +1176,19 @@ void Mts0_io::load_timesteps() {
 	timesteps.reserve(max_timestep+1);
 
 	for(int timestep=0;timestep<=max_timestep;timestep++) {
+		TraceSpan span("load_timestep", timestep);
 		sprintf(mts0_directory, "%s/%06d/mts0/",foldername_base.c_str(), timestep);
 		
-		Timestep *new_timestep = new Timestep(string(mts0_directory),nx, ny, nz);
+		Timestep *new_timestep = new Timestep(string(mts0_directory),nx, ny, nz, manifest ? manifest->get(timestep) : 0, skip_types);
+		if(morton_order) new_timestep->sort_by_morton_code();
+		if(ambient_occlusion_radius > 0) new_timestep->compute_ambient_occlusion(ambient_occlusion_radius);
 		timesteps.push_back(new_timestep);
 		cout << "Loaded timestep " << timestep << endl;
 	}
 	system_size = timesteps[0]->get_lx_ly_lz();
 }
 
-Timestep *Mts0_io::get_next_timestep(int &time_direction, float cam_x, float cam_y, float cam_z, int max_num_atoms, float dr2_max) {
+Timestep *Mts0_io::get_next_timestep(int &time_direction, float cam_x, float cam_y, float cam_z, long max_num_atoms, float dr2_max) {
 	current_timestep += step*time_direction;
 
 	if(current_timestep>max_timestep || current_timestep < 0) {
@@ -288,17 +1196,208 @@ Timestep *Mts0_io::get_next_timestep(int &time_direction, float cam_x, float cam
 		current_timestep += step*time_direction;
 	}
 
+	return get_timestep(current_timestep, cam_x, cam_y, cam_z, max_num_atoms, dr2_max);
+}
+
+Timestep *Mts0_io::get_timestep(int timestep_index, float cam_x, float cam_y, float cam_z, long max_num_atoms, float dr2_max) {
+	double t0 = omp_get_wtime();
+	TraceSpan span("load_timestep", timestep_index);
 	if(preload) {
-		return timesteps[current_timestep];
+		if(timesteps.size() == 0) load_timesteps(); // On first use, so that the type filter is set
+		load_time = 0;
+		return timesteps[timestep_index];
 	} else {
-		if(get_file_extension(foldername_base).compare("xyz") == 0) {
+		Timestep *timestep;
+		bool load_skip_types[NUM_ATOM_TYPES+1];
+		get_load_skip_types(load_skip_types, skip_hidden_water);
+		if(mapped_trajectory) {
+			MappedTimestepEntry *entry = mapped_trajectory->get(timestep_index);
+			if(!entry) {
+				cout << "Error in Mts0_io::get_timestep(): Timestep " << timestep_index << " is not in " << mapped_trajectory->filename << endl;
+				exit(1);
+			}
+			mapped_resident_fraction = entry->num_atoms > 0 ? double(mapped_trajectory->get_resident_bytes(entry))/entry->get_size() : 1;
+			timestep = new Timestep(mapped_trajectory, entry, nx, ny, nz, load_skip_types);
+			mapped_trajectory->advise(timestep_index, step, timestep_index >= last_timestep_index ? 1 : -1);
+			resident_bytes = get_process_resident_bytes();
+		} else if(get_file_extension(foldername_base).compare("xyz") == 0) {
 			sprintf(mts0_directory, "%s",foldername_base.c_str());
+			timestep = new Timestep(string(mts0_directory),nx, ny, nz);
 		} else {
-			sprintf(mts0_directory, "%s/%06d/mts0/",foldername_base.c_str(), current_timestep);
+			sprintf(mts0_directory, "%s/%06d/mts0/",foldername_base.c_str(), timestep_index);
+			TimestepManifest *timestep_manifest = manifest ? manifest->get(timestep_index) : 0;
+			if(region_of_interest) {
+				float h_matrix_local[18];
+				if(timestep_manifest) {
+					for(int i=0;i<18;i++) h_matrix_local[i] = timestep_manifest->h_matrix[i];
+				} else if(!read_node_h_matrix(string(mts0_directory), 0, h_matrix_local)) {
+					cout << "Error in Mts0_io::get_timestep(): Failed to read h-matrix from " << mts0_directory << "mt0000" << endl;
+					exit(1);
+				}
+				float region_system_size[3];
+				for(int k=0;k<3;k++) region_system_size[k] = h_matrix_local[3*k + k]*Timestep::bohr;
+				vector<int> node_ids;
+				find_nodes_in_region(region_system_size, timestep_manifest, load_skip_types, cam_x, cam_y, cam_z, dr2_max, node_ids);
+				timestep = new Timestep(string(mts0_directory), nx, ny, nz, node_ids, h_matrix_local, timestep_manifest, load_skip_types);
+			} else timestep = new Timestep(string(mts0_directory),nx, ny, nz, timestep_manifest, load_skip_types);
 		}
-		Timestep *timestep = new Timestep(string(mts0_directory),nx, ny, nz);
+		// md_convert records in the file whether it already sorted the atoms
+		if(morton_order && !(mapped_trajectory && mapped_trajectory->is_morton_ordered())) timestep->sort_by_morton_code();
+		if(ambient_occlusion_radius > 0) timestep->compute_ambient_occlusion(ambient_occlusion_radius);
+		load_time = omp_get_wtime() - t0;
+		last_timestep_index = timestep_index;
 		timestep->update_visible_atom_list(cam_x, cam_y, cam_z, max_num_atoms, dr2_max);
 		system_size = timestep->get_lx_ly_lz();
 		return timestep;
 	}
-}
\ No newline at end of file
+}
+
+// Nodes whose domain box, grown by region_margin and including its periodic images, comes within dr2_max of the camera.
+// With a manifest the bounds of the atoms in each node are used instead, and nodes without atoms of the types
+// the timestep reads (those not in load_skip_types) are skipped.
+void Mts0_io::find_nodes_in_region(float *region_system_size, TimestepManifest *timestep_manifest, bool *load_skip_types, float cam_x, float cam_y, float cam_z, float dr2_max, vector<int> &node_ids) {
+	float cam[3] = {cam_x, cam_y, cam_z};
+	int node_count[3] = {nx, ny, nz};
+	node_ids.clear();
+
+	for(int node_id=0; node_id<nx*ny*nz; node_id++) {
+		int node_index[3] = {node_id/(ny*nz), (node_id/nz) % ny, node_id % nz};
+		float box_min[3], box_max[3];
+		if(timestep_manifest) {
+			NodeManifest &node = timestep_manifest->nodes[node_id];
+			if(timestep_manifest->get_atom_count(node_id, load_skip_types) == 0) continue;
+			for(int k=0;k<3;k++) {
+				box_min[k] = node.bounds_min[k];
+				box_max[k] = node.bounds_max[k];
+			}
+		} else {
+			for(int k=0;k<3;k++) {
+				box_min[k] = region_system_size[k]*node_index[k]/node_count[k] - region_margin;
+				box_max[k] = region_system_size[k]*(node_index[k]+1)/node_count[k] + region_margin;
+			}
+		}
+
+		bool inside = false;
+		for(int image=0; image<27 && !inside; image++) {
+			int shift[3] = {image/9 - 1, (image/3) % 3 - 1, image % 3 - 1};
+			float dr2 = 0;
+			for(int k=0;k<3;k++) {
+				float lo = box_min[k] + shift[k]*region_system_size[k];
+				float hi = box_max[k] + shift[k]*region_system_size[k];
+				float d = cam[k] < lo ? lo - cam[k] : (cam[k] > hi ? cam[k] - hi : 0);
+				dr2 += d*d;
+			}
+			inside = dr2 <= dr2_max;
+		}
+		if(inside) node_ids.push_back(node_id);
+	}
+}
+
+// Nodes within dr2_max of the camera that a region of interest timestep has not read yet
+void Mts0_io::find_missing_nodes(Timestep *timestep, float cam_x, float cam_y, float cam_z, float dr2_max, vector<int> &node_ids) {
+	node_ids.clear();
+	if(timestep->node_loaded.size() == 0) return; // Loaded completely
+	vector<float> timestep_system_size = timestep->get_lx_ly_lz();
+	vector<int> region_node_ids;
+	find_nodes_in_region(&timestep_system_size[0], timestep->manifest, timestep->skip_types, cam_x, cam_y, cam_z, dr2_max, region_node_ids);
+	for(int i=0; i<region_node_ids.size(); i++) {
+		if(!timestep->node_loaded[region_node_ids[i]]) node_ids.push_back(region_node_ids[i]);
+	}
+}
+
+// Extends a region of interest timestep in place by the nodes the camera has come close to since it was loaded,
+// false if there were none. The new nodes are Morton ordered among themselves and appended, and the ambient
+// occlusion is recomputed for them and for the atoms next to them.
+bool Mts0_io::stream_region(Timestep *timestep, float cam_x, float cam_y, float cam_z, long max_num_atoms, float dr2_max) {
+	double t0 = omp_get_wtime();
+	vector<int> missing_node_ids;
+	find_missing_nodes(timestep, cam_x, cam_y, cam_z, dr2_max, missing_node_ids);
+	if(missing_node_ids.size() == 0) return false;
+
+	TraceSpan span("stream_region", missing_node_ids.size());
+	float h_matrix_local[18];
+	for(int k=0;k<2;k++) {
+		for(int i=0;i<3;i++) {
+			for(int j=0;j<3;j++) h_matrix_local[9*k + 3*i + j] = timestep->h_matrix[k][i][j];
+		}
+	}
+	Timestep region(timestep->mts0_directory, nx, ny, nz, missing_node_ids, h_matrix_local, timestep->manifest, timestep->skip_types);
+	if(morton_order) region.sort_by_morton_code();
+
+	long first_new_atom = timestep->get_number_of_atoms();
+	timestep->append_atoms(region);
+	if(ambient_occlusion_radius > 0) timestep->compute_ambient_occlusion(ambient_occlusion_radius, first_new_atom);
+	timestep->update_visible_atom_list(cam_x, cam_y, cam_z, max_num_atoms, dr2_max);
+	load_time = omp_get_wtime() - t0;
+	return true;
+}
+
+// Parses a comma separated list of element names (Si, A, H, O, Na, Cl, X) or "none" into skip_types
+void Mts0_io::set_skip_types(string type_list) {
+	const char *type_names[NUM_ATOM_TYPES] = {"Si", "A", "H", "O", "Na", "Cl", "X"};
+	for(int type=0; type<=NUM_ATOM_TYPES; type++) skip_types[type] = false;
+	if(type_list.compare("none") == 0) return;
+
+	stringstream stream(type_list);
+	string name;
+	while(getline(stream, name, ',')) {
+		name.erase(0, name.find_first_not_of(" \t"));
+		name.erase(name.find_last_not_of(" \t") + 1);
+		bool found = false;
+		for(int type=1; type<=NUM_ATOM_TYPES; type++) {
+			if(name.compare(type_names[type-1]) == 0) {
+				skip_types[type] = true;
+				found = true;
+			}
+		}
+		if(!found) cout << "Error in Mts0_io::set_skip_types(): Unknown atom type " << name << endl;
+	}
+}
+
+// Plays back the file written by md_convert instead of the node files. It holds every timestep, so preload
+// and region of interest loading are turned off.
+void Mts0_io::open_mapped_trajectory(string filename, int readahead) {
+	if(filename.compare("none") == 0) return;
+	mapped_trajectory = new MappedTrajectory();
+	if(!mapped_trajectory->open(filename)) exit(1);
+	mapped_trajectory->readahead = readahead;
+	if(preload) cout << "preload is ignored for the mapped trajectory " << filename << endl;
+	preload = false;
+	region_of_interest = false;
+
+	double total_bytes = 0;
+	for(int i=0; i<mapped_trajectory->entries.size(); i++) total_bytes += mapped_trajectory->entries[i].get_size();
+	cout << "Mapped trajectory " << filename << ": " << mapped_trajectory->entries.size() << " timesteps, " << total_bytes/(1024*1024*1024) << " GB, reading " << readahead << " timesteps ahead" << endl;
+}
+
+// Types left out of the next load: skip_types, plus water while it is hidden. Preloaded timesteps keep
+// their water so that showing it again does not need a reload.
+void Mts0_io::get_load_skip_types(bool *load_skip_types, bool skip_water) {
+	for(int type=0; type<=NUM_ATOM_TYPES; type++) load_skip_types[type] = skip_types[type];
+	if(skip_water && !preload) {
+		load_skip_types[H_TYPE] = true;
+		load_skip_types[O_TYPE] = true;
+	}
+}
+
+// True if the timestep was loaded without types that the current filter keeps, it should then be read again
+bool Mts0_io::is_missing_types(Timestep *timestep) {
+	return is_missing_types(timestep, skip_hidden_water);
+}
+
+bool Mts0_io::is_missing_types(Timestep *timestep, bool skip_water) {
+	bool load_skip_types[NUM_ATOM_TYPES+1];
+	get_load_skip_types(load_skip_types, skip_water);
+	for(int type=1; type<=NUM_ATOM_TYPES; type++) {
+		if(timestep->skip_types[type] && !load_skip_types[type]) return true;
+	}
+	return false;
+}
+
+void Mts0_io::release_timestep(Timestep *timestep) {
+	if(!preload) delete timestep;
+}
+
+int Mts0_io::get_max_timestep() {
+	return max_timestep;
+}
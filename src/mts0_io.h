@@ -9,7 +9,7 @@ nx, ny, nz     - number of cpus [int].
 velocities     - atom velocities [vector<vector<double> >], dimension num_atoms x 3, units unknown
 positions      - atom positions [vector<vector<double> >], dimension num_atoms x 3, units Ångström
 atom_types     - atom types [vector<int>], dimension num_atoms, {1-Si,2-A,3-H,4-O,5-Na,6-Cl,7-X}
-atom_ids       - atom ids [vector<int>], dimension num_atoms
+atom_ids       - atom ids [vector<long>], dimension num_atoms
 h_matrix       - h-matrix [vector<vector<vector<double> > >], dimension 2 x (3 x 3)
 mts0_directory - mts0-directory [string]
 */
@@ -20,6 +20,8 @@ mts0_directory - mts0-directory [string]
 #include <string>
 #include <iostream>
 #include <cstdlib>
+#include <algorithm>
+#include <TaskPool.h>
 
 using namespace std;
 
@@ -30,26 +32,133 @@ using namespace std;
 #define NA_TYPE 5
 #define CL_TYPE 6
 #define X_TYPE 7
+#define NUM_ATOM_TYPES 7
+
+// Per-type colours and radii shared by the OpenGL and software renderers
+extern double color_list[7][3];
+extern double visual_atom_radii[7];
+
+class WorkerArena;
+class TimestepManifest;
+class TrajectoryManifest;
+class MappedTrajectory;
+class MappedTimestepEntry;
+
+bool read_node_h_matrix(string mts0_directory, int node_id, float *h_matrix_local);
+
+// Loops over all atoms run parallel_for() over chunks of chunk_size atoms, its ranges are int but atom indices are long
+inline int get_num_chunks(long num_atoms, long chunk_size) {
+  return (num_atoms + chunk_size - 1)/chunk_size;
+}
+inline long get_chunk_begin(int chunk, long chunk_size) {
+  return long(chunk)*chunk_size;
+}
+inline long get_chunk_end(int chunk, long chunk_size, long num_atoms) {
+  return min(num_atoms, long(chunk+1)*chunk_size);
+}
+
+#define CULL_CHUNK_SIZE 65536
+
+// Each chunk of atoms collects its visible atoms separately, the lists are joined in chunk order.
+// Positions is any type with positions[n][k], vector<vector<float> > for a timestep.
+template<class Positions>
+class CullChunks {
+public:
+  Positions *positions;
+  vector<vector<long> > chunk_indices;
+  long num_atoms;
+  float cam_x, cam_y, cam_z, dr2_max;
+
+  void operator()(int begin, int end, int worker) {
+    for(int chunk=begin; chunk<end; chunk++) {
+      vector<long> &indices = chunk_indices[chunk];
+      indices.clear();
+      long n_end = get_chunk_end(chunk, CULL_CHUNK_SIZE, num_atoms);
+      for(long n=get_chunk_begin(chunk, CULL_CHUNK_SIZE); n<n_end; n++) {
+        double delta_x = (*positions)[n][0] - cam_x;
+        double delta_y = (*positions)[n][1] - cam_y;
+        double delta_z = (*positions)[n][2] - cam_z;
+
+        double dr2 = delta_x*delta_x + delta_y*delta_y + delta_z*delta_z;
+        if(dr2 < 50) continue;
+        if(dr2 > dr2_max) continue;
+
+        indices.push_back(n);
+      }
+    }
+  }
+};
+
+// Appends the atoms with 50 <= dr2 <= dr2_max from the camera to visible_atom_indices, in index order
+template<class Positions>
+void cull_atoms(Positions &positions, long num_atoms, float cam_x, float cam_y, float cam_z, float dr2_max, vector<long> &visible_atom_indices) {
+  CullChunks<Positions> cull;
+  cull.positions = &positions;
+  cull.num_atoms = num_atoms;
+  cull.cam_x = cam_x;
+  cull.cam_y = cam_y;
+  cull.cam_z = cam_z;
+  cull.dr2_max = dr2_max;
+  int num_chunks = get_num_chunks(num_atoms, CULL_CHUNK_SIZE);
+  cull.chunk_indices.resize(num_chunks);
+  parallel_for(0, num_chunks, 1, cull);
+
+  for(int chunk=0; chunk<num_chunks; chunk++) {
+    visible_atom_indices.insert(visible_atom_indices.end(), cull.chunk_indices[chunk].begin(), cull.chunk_indices[chunk].end());
+  }
+}
+
+// A run of atoms, or of visible_atom_indices, that all have the same type
+class TypeRange {
+public:
+  int type;
+  long begin, end;
+};
 
 class Timestep {
 public:
   int nx, ny, nz;
   static const double bohr = 0.5291772;
   vector<vector<float> > positions;
-  vector<int> atom_ids;
+  vector<long> atom_ids;
   vector<int> atom_types;
   vector<vector<vector<float> > > h_matrix;
-  vector<int> visible_atom_indices;
+  vector<TypeRange> type_runs;     // Atoms are grouped by type, one run per type and then one per type for every streamed region
+  vector<long> visible_atom_indices;
+  vector<TypeRange> visible_type_ranges; // visible_atom_indices split by type, renderers apply per-type settings per range
+  vector<float> ambient_occlusion; // Per-atom colour multiplier, empty if not computed
+  double cull_time;                // Seconds spent in the last update_visible_atom_list()
+  string mts0_directory;
+  vector<char> node_loaded;        // Per node file, empty for xyz files
+  TimestepManifest *manifest;      // Owned by Mts0_io, 0 without a manifest
+  bool skip_types[NUM_ATOM_TYPES+1]; // Atom types left out when the node files were read, indexed by type
   vector<float> get_lx_ly_lz();
-  int get_number_of_atoms();
+  long get_number_of_atoms();
   
-  Timestep(string filename, int nx_, int ny_, int nz_);
+  Timestep(string filename, int nx_, int ny_, int nz_, TimestepManifest *manifest_ = 0, bool *skip_types_ = 0);
+  Timestep(string mts0_directory_, int nx_, int ny_, int nz_, vector<int> &node_ids, float *h_matrix_local, TimestepManifest *manifest_ = 0, bool *skip_types_ = 0);
+  Timestep(MappedTrajectory *trajectory, MappedTimestepEntry *entry, int nx_, int ny_, int nz_, bool *skip_types_ = 0);
+  Timestep(Timestep &timestep);
   ~Timestep();
-  void update_visible_atom_list(float cam_x, float cam_y, float cam_z, int number_of_visible_atoms, float dr2_max);
+  void update_visible_atom_list(float cam_x, float cam_y, float cam_z, long number_of_visible_atoms, float dr2_max);
+  void group_visible_by_type();
+  void split_visible_into_type_runs();
+  static void find_type_ranges(vector<long> &atom_indices, vector<TypeRange> &type_runs, vector<TypeRange> &type_ranges);
+  void partition_by_type();
+  void sort_by_morton_code();
+  void compute_ambient_occlusion(float radius, long first_new_atom = 0);
+  void reserve_atoms(long num_atoms);
+  void append_atoms(Timestep &region);
+  void append_copy(Timestep &timestep);
   void load_atoms(string filename);
+  void load_nodes(vector<int> &node_ids);
+  void set_h_matrix(float *h_matrix_local);
+  void set_skip_types(bool *skip_types_);
+  bool is_skipped(int atom_type) { return atom_type > 0 && atom_type <= NUM_ATOM_TYPES && skip_types[atom_type]; }
+  long get_manifest_atom_count(int node_id);
   void load_atoms_xyz(string xyz_file);
-  void read_data(ifstream *file, void *value);
-  void read_mts(char *filename, vector<int> &atom_types_local, vector<int> &atom_ids_local, vector<vector<float> > &positions_local);
+  void read_mts(char *filename, int file, long offset, vector<int> &atom_types_local, vector<long> &atom_ids_local, vector<vector<float> > &positions_local, float *h_matrix_local, WorkerArena &arena);
+  void decode_mts(int num_atoms_local, double *tmp_atom_data, double *phase_space, double *tmp_h_matrix, vector<int> &atom_types_local, vector<long> &atom_ids_local, vector<vector<float> > &positions_local, float *h_matrix_local);
 };
 
 class Mts0_io {
@@ -59,15 +168,38 @@ private:
   bool preload;
   vector<Timestep*> timesteps;
   string foldername_base;
+  float ambient_occlusion_radius;
 
 public:
   int step;
   int current_timestep;
+  double load_time;                // Seconds spent reading the last timestep in get_next_timestep()
   vector<float> system_size;
 	int nx, ny, nz;
-  Mts0_io(int nx_, int ny_, int nz_, int max_timestep_, string foldername_base_, bool preload_, int step_);
+  bool region_of_interest;         // Only read the node files that can hold atoms within dr2_max of the camera
+  float region_margin;             // Ångström added around each node box, atoms drift out of their domain between decompositions
+  TrajectoryManifest *manifest;    // From md_manifest, 0 if manifest_file is "none"
+  bool skip_types[NUM_ATOM_TYPES+1]; // Atom types never read from the node files, indexed by type
+  bool skip_hidden_water;          // Also leave out H and O while water is not drawn (not for preloaded timesteps)
+  bool morton_order;               // Reorder the atoms of each loaded timestep along a Morton curve
+  MappedTrajectory *mapped_trajectory; // From md_convert, timesteps are copied out of it instead of read from node files, or 0
+  long resident_bytes;             // Resident set of the process after the last load from mapped_trajectory, -1 if unknown
+  double mapped_resident_fraction; // Part of the last timestep that was in memory before it was copied
+  int last_timestep_index;         // Of the last get_timestep(), gives the direction of playback for the readahead
+  Mts0_io(int nx_, int ny_, int nz_, int max_timestep_, string foldername_base_, bool preload_, int step_, float ambient_occlusion_radius_, string manifest_file);
 
-  Timestep *get_next_timestep(int &time_direction, float cam_x, float cam_y, float cam_z, int max_num_atoms, float dr2_max);
+  Timestep *get_next_timestep(int &time_direction, float cam_x, float cam_y, float cam_z, long max_num_atoms, float dr2_max);
+  Timestep *get_timestep(int timestep_index, float cam_x, float cam_y, float cam_z, long max_num_atoms, float dr2_max);
+  void release_timestep(Timestep *timestep); // Deletes the timestep unless it is owned by the preload cache
+  int get_max_timestep();
+  void find_nodes_in_region(float *region_system_size, TimestepManifest *timestep_manifest, bool *load_skip_types, float cam_x, float cam_y, float cam_z, float dr2_max, vector<int> &node_ids);
+  void find_missing_nodes(Timestep *timestep, float cam_x, float cam_y, float cam_z, float dr2_max, vector<int> &node_ids);
+  void set_skip_types(string type_list);
+  void open_mapped_trajectory(string filename, int readahead);
+  void get_load_skip_types(bool *load_skip_types, bool skip_water);
+  bool is_missing_types(Timestep *timestep);
+  bool is_missing_types(Timestep *timestep, bool skip_water); // As if skip_hidden_water was skip_water
+  bool stream_region(Timestep *timestep, float cam_x, float cam_y, float cam_z, long max_num_atoms, float dr2_max);
 
   void load_timesteps();
 };